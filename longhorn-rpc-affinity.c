@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "longhorn-rpc-affinity.h"
+
+// Parse a cpu list like "0-3,8,10-11", as used by taskset and cpusets
+int parse_cpu_list(const char *list, cpu_set_t *cpus) {
+        const char *p = list;
+        char *end;
+        long first, last;
+
+        CPU_ZERO(cpus);
+        while (*p != '\0') {
+                first = strtol(p, &end, 10);
+                if (end == p || first < 0) {
+                        return -EINVAL;
+                }
+                last = first;
+                if (*end == '-') {
+                        p = end + 1;
+                        last = strtol(p, &end, 10);
+                        if (end == p || last < first) {
+                                return -EINVAL;
+                        }
+                }
+                if (last >= CPU_SETSIZE) {
+                        return -EINVAL;
+                }
+                for (; first <= last; first++) {
+                        CPU_SET(first, cpus);
+                }
+                if (*end == ',') {
+                        end++;
+                } else if (*end != '\0') {
+                        return -EINVAL;
+                }
+                p = end;
+        }
+        return CPU_COUNT(cpus) != 0 ? 0 : -EINVAL;
+}
+
+// The node a cpu belongs to shows up as a nodeN entry in its sysfs
+// directory. Returns -1 if it can't be told, e.g. without NUMA support.
+int cpu_to_node(int cpu) {
+        char path[64];
+        struct dirent *ent;
+        DIR *dir;
+        int node = -1;
+
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+        dir = opendir(path);
+        if (dir == NULL) {
+                return -1;
+        }
+        while ((ent = readdir(dir)) != NULL) {
+                if (strncmp(ent->d_name, "node", 4) == 0 &&
+                                sscanf(ent->d_name + 4, "%d", &node) == 1) {
+                        break;
+                }
+        }
+        closedir(dir);
+        if (node >= MAX_NUMA_NODES) {
+                return -1;
+        }
+        return node;
+}
+
+int numa_node_count() {
+        char path[64];
+        int node;
+
+        for (node = 0; node < MAX_NUMA_NODES; node++) {
+                snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", node);
+                if (access(path, F_OK) != 0) {
+                        break;
+                }
+        }
+        return node > 0 ? node : 1;
+}
+
+// Deals the cpus of a set out round-robin to workers: worker n gets the
+// (n % count)th of them. -1 for an empty set.
+int nth_cpu(cpu_set_t *cpus, int n) {
+        int cpu, count = CPU_COUNT(cpus);
+
+        if (count == 0) {
+                return -1;
+        }
+        n %= count;
+        for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (CPU_ISSET(cpu, cpus) && n-- == 0) {
+                        return cpu;
+                }
+        }
+        return -1;
+}
+
+int pin_thread_attr(pthread_attr_t *attr, cpu_set_t *cpus) {
+        int rc;
+
+        rc = pthread_attr_setaffinity_np(attr, sizeof(cpu_set_t), cpus);
+        if (rc != 0) {
+                fprintf(stderr, "fail to set thread affinity: %s\n", strerror(rc));
+                return -rc;
+        }
+        return 0;
+}
+
+// Prefer node for pages of a mapping that hasn't been touched yet, so its
+// placement doesn't depend on which thread happens to touch it first
+int bind_to_node(void *buf, size_t len, int node) {
+        unsigned long nodemask;
+
+        if (node < 0) {
+                return 0;
+        }
+        nodemask = 1UL << node;
+        if (syscall(SYS_mbind, buf, len, MPOL_PREFERRED, &nodemask,
+                                MAX_NUMA_NODES, 0) < 0) {
+                // Still usable, just not placed
+                perror("fail to bind buffer to numa node");
+                return -errno;
+        }
+        return 0;
+}
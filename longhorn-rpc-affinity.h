@@ -0,0 +1,19 @@
+#ifndef LONGHORN_RPC_AFFINITY_HEADER
+#define LONGHORN_RPC_AFFINITY_HEADER
+
+#include <sched.h>
+#include <pthread.h>
+
+// Highest NUMA node tracked, nodes beyond it are treated as unknown
+#define MAX_NUMA_NODES 64
+
+int parse_cpu_list(const char *list, cpu_set_t *cpus);
+int cpu_to_node(int cpu);
+int numa_node_count();
+int nth_cpu(cpu_set_t *cpus, int n);
+
+int pin_thread_attr(pthread_attr_t *attr, cpu_set_t *cpus);
+
+int bind_to_node(void *buf, size_t len, int node);
+
+#endif
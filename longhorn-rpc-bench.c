@@ -0,0 +1,498 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "longhorn-rpc-client.h"
+#include "longhorn-rpc-bench.h"
+#include "longhorn-rpc-histogram.h"
+#include "longhorn-rpc-pattern.h"
+
+#define PREFILL_SIZE    (1024 * 1024)
+#define BENCH_DEFAULT_SEED      0x6c6f6e67686f726eULL   // "longhorn"
+
+enum {
+        OpRead,
+        OpWrite,
+        NR_OPS,
+};
+
+static const char *op_names[NR_OPS] = { "read", "write" };
+
+struct bench_stats {
+        uint64_t ops[NR_OPS];
+        uint64_t bytes[NR_OPS];
+        uint64_t errors;
+        struct histogram_data latency[NR_OPS];
+};
+
+struct bench_run {
+        struct client_connection *conn;
+        struct bench_config *cfg;
+        int size;
+        int depth;
+        int read_percent;
+        // Requests each thread measures in a one pass run, 0 if time based
+        uint64_t quota;
+};
+
+struct bench_thread;
+
+struct bench_slot {
+        struct bench_thread *t;
+        void *buf;
+        uint16_t volume;
+        off_t offset;
+        int op;
+        // Submitted after the warm-up
+        int measured;
+        uint64_t start;
+        uint64_t end;
+        int rc;
+        struct bench_slot *next;
+};
+
+struct bench_thread {
+        struct bench_run *run;
+        pthread_t thread;
+        uint64_t rand_state;
+        off_t region_start;
+        off_t region_size;
+        off_t cursor;
+        uint64_t submitted;
+        uint64_t measure;
+        uint64_t end;
+        uint64_t measured;
+
+        // Completed slots, pushed by the response thread
+        struct bench_slot *completed;
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+
+        struct bench_slot *slots;
+        struct bench_stats stats;
+        uint64_t elapsed_ns;
+};
+
+// xorshift64*, good enough to pick offsets and operations
+static uint64_t bench_rand(struct bench_thread *t) {
+        t->rand_state ^= t->rand_state >> 12;
+        t->rand_state ^= t->rand_state << 25;
+        t->rand_state ^= t->rand_state >> 27;
+        return t->rand_state * 2685821657736338717ULL;
+}
+
+// Comma separated list of positive numbers
+int parse_bench_list(char *arg, int *values, int *nr) {
+        char *s, *end;
+        long v;
+
+        *nr = 0;
+        for (s = arg; *s != '\0'; s = end + 1) {
+                v = strtol(s, &end, 0);
+                if (end == s || v < 0 || v > 0x7fffffff || *nr == BENCH_MAX_SWEEP) {
+                        return -EINVAL;
+                }
+                values[(*nr)++] = v;
+                if (*end == '\0') {
+                        break;
+                }
+                if (*end != ',') {
+                        return -EINVAL;
+                }
+        }
+        return *nr == 0 ? -EINVAL : 0;
+}
+
+// A sequential write pass and a sequential read pass at 4 KiB and queue
+// depth 1, as the old test did
+void init_bench_config(struct bench_config *cfg, size_t span) {
+        memset(cfg, 0, sizeof(struct bench_config));
+        cfg->pattern = BenchSequential;
+        cfg->sizes[0] = 4096;
+        cfg->nr_sizes = 1;
+        cfg->depths[0] = 1;
+        cfg->nr_depths = 1;
+        cfg->read_percents[0] = 0;
+        cfg->read_percents[1] = 100;
+        cfg->nr_read_percents = 2;
+        cfg->threads = 1;
+        cfg->span = span;
+        cfg->volumes = 1;
+        cfg->seed = BENCH_DEFAULT_SEED;
+}
+
+static void bench_done(void *data, int rc) {
+        struct bench_slot *s = data;
+        struct bench_thread *t = s->t;
+
+        s->end = now_ns();
+        s->rc = rc;
+        pthread_mutex_lock(&t->mutex);
+        s->next = t->completed;
+        t->completed = s;
+        pthread_cond_signal(&t->cond);
+        pthread_mutex_unlock(&t->mutex);
+}
+
+// Whether to submit another request at now
+static int bench_more(struct bench_thread *t, uint64_t now) {
+        if (now >= t->end) {
+                return 0;
+        }
+        if (now >= t->measure && t->run->quota != 0) {
+                return t->measured++ < t->run->quota;
+        }
+        return 1;
+}
+
+static void bench_submit(struct bench_thread *t, struct bench_slot *s,
+                uint64_t now) {
+        struct bench_run *run = t->run;
+        int rc;
+
+        if (run->read_percent == 100 || (run->read_percent != 0 &&
+                                bench_rand(t) % 100 < run->read_percent)) {
+                s->op = OpRead;
+        } else {
+                s->op = OpWrite;
+        }
+        if (run->cfg->pattern == BenchRandom) {
+                s->offset = bench_rand(t) % (run->cfg->span / run->size) *
+                        run->size;
+        } else {
+                s->offset = t->region_start + t->cursor;
+                t->cursor += run->size;
+                if (t->cursor + run->size > t->region_size) {
+                        t->cursor = 0;
+                }
+        }
+
+        s->volume = t->submitted++ % run->cfg->volumes;
+        // Generating the payload is part of the write's latency, a copy
+        // from a reference buffer used to be too
+        if (s->op == OpWrite) {
+                pattern_fill(pattern_volume_seed(run->cfg->seed, s->volume),
+                                s->offset, s->buf, run->size);
+        }
+
+        s->measured = now >= t->measure;
+        s->start = now_ns();
+        rc = submit_request(run->conn, s->op == OpRead ? TypeRead : TypeWrite,
+                        s->volume, s->buf, run->size, s->offset,
+                        PriorityDefault, bench_done, s, NULL);
+        if (rc < 0) {
+                bench_done(s, rc);
+        }
+}
+
+static int bench_complete(struct bench_thread *t, struct bench_slot *s) {
+        struct bench_run *run = t->run;
+        ssize_t bad;
+
+        if (s->rc < 0) {
+                if (t->stats.errors++ == 0) {
+                        fprintf(stderr, "Fail to complete %s at %ld: %s\n",
+                                        op_names[s->op], s->offset, strerror(-s->rc));
+                }
+                return -EIO;
+        }
+        if (s->op != OpRead) {
+                return 0;
+        }
+        bad = pattern_verify(pattern_volume_seed(run->cfg->seed, s->volume),
+                        s->offset, s->buf, run->size);
+        if (bad >= 0) {
+                if (t->stats.errors++ == 0) {
+                        fprintf(stderr, "Inconsistency found on volume %d at %ld!\n",
+                                        s->volume, s->offset + bad);
+                }
+                return -EIO;
+        }
+        return 0;
+}
+
+static void *bench_thread_main(void *arg) {
+        struct bench_thread *t = arg;
+        struct bench_run *run = t->run;
+        struct bench_slot *s, *next;
+        uint64_t now;
+        int i, rc, inflight = 0;
+
+        now = now_ns();
+        t->measure = now + run->cfg->warmup_secs * 1000000000ULL;
+        t->end = run->cfg->runtime_secs == 0 ? UINT64_MAX :
+                t->measure + run->cfg->runtime_secs * 1000000000ULL;
+
+        for (i = 0; i < run->depth && bench_more(t, now); i++) {
+                bench_submit(t, &t->slots[i], now);
+                inflight++;
+        }
+        while (inflight > 0) {
+                pthread_mutex_lock(&t->mutex);
+                while (t->completed == NULL) {
+                        pthread_cond_wait(&t->cond, &t->mutex);
+                }
+                s = t->completed;
+                t->completed = NULL;
+                pthread_mutex_unlock(&t->mutex);
+
+                now = now_ns();
+                for (; s != NULL; s = next) {
+                        next = s->next;
+                        inflight--;
+                        rc = bench_complete(t, s);
+                        // Warm-up requests are not counted
+                        if (rc == 0 && s->measured) {
+                                t->stats.ops[s->op]++;
+                                t->stats.bytes[s->op] += run->size;
+                                histogram_add(&t->stats.latency[s->op],
+                                                s->end - s->start);
+                        }
+                        if (bench_more(t, now)) {
+                                bench_submit(t, s, now);
+                                inflight++;
+                        }
+                }
+        }
+        t->elapsed_ns = now > t->measure ? now - t->measure : 0;
+        return NULL;
+}
+
+static void print_result(struct bench_run *run, struct bench_stats *stats,
+                double secs, int first) {
+        struct bench_config *cfg = run->cfg;
+        struct histogram_data *h;
+        int op;
+
+        if (cfg->json) {
+                printf("%s\n  {\"pattern\": \"%s\", \"size\": %d, \"depth\": %d, "
+                                "\"threads\": %d, \"read_percent\": %d, "
+                                "\"volumes\": %d, \"seconds\": %.3f, \"errors\": %lu",
+                                first ? "" : ",",
+                                cfg->pattern == BenchRandom ? "random" : "sequential",
+                                run->size, run->depth, cfg->threads,
+                                run->read_percent, cfg->volumes, secs,
+                                stats->errors);
+        } else {
+                printf("%s size %d depth %d threads %d read %d%%, %.2f s\n",
+                                cfg->pattern == BenchRandom ? "Random" : "Sequential",
+                                run->size, run->depth, cfg->threads,
+                                run->read_percent, secs);
+        }
+        for (op = 0; op < NR_OPS; op++) {
+                h = &stats->latency[op];
+                if (stats->ops[op] == 0) {
+                        continue;
+                }
+                if (cfg->json) {
+                        printf(", \"%s\": {\"ops\": %lu, \"iops\": %.0f, "
+                                        "\"bw_mib\": %.2f, \"lat_p50_us\": %.1f, "
+                                        "\"lat_p99_us\": %.1f, \"lat_p999_us\": %.1f}",
+                                        op_names[op], stats->ops[op],
+                                        stats->ops[op] / secs,
+                                        stats->bytes[op] / 1048576.0 / secs,
+                                        histogram_percentile(h, 50) / 1E3,
+                                        histogram_percentile(h, 99) / 1E3,
+                                        histogram_percentile(h, 99.9) / 1E3);
+                } else {
+                        printf("  %-5s %10.0f IOPS %10.2f M/s  latency us p50 %.1f "
+                                        "p99 %.1f p99.9 %.1f\n", op_names[op],
+                                        stats->ops[op] / secs,
+                                        stats->bytes[op] / 1048576.0 / secs,
+                                        histogram_percentile(h, 50) / 1E3,
+                                        histogram_percentile(h, 99) / 1E3,
+                                        histogram_percentile(h, 99.9) / 1E3);
+                }
+        }
+        if (cfg->json) {
+                printf("}");
+        } else if (stats->errors != 0) {
+                printf("  %lu errors\n", stats->errors);
+        }
+        fflush(stdout);
+}
+
+static int bench_one(struct bench_run *run, int first) {
+        struct bench_config *cfg = run->cfg;
+        struct bench_thread *threads;
+        struct bench_stats *stats;
+        uint64_t blocks, elapsed = 0;
+        int i, j, rc = 0, started = 0;
+
+        blocks = cfg->span / run->size / cfg->threads;
+        if (blocks == 0) {
+                fprintf(stderr, "Span too small for %d threads of %d bytes\n",
+                                cfg->threads, run->size);
+                return -EINVAL;
+        }
+        run->quota = cfg->runtime_secs == 0 ? blocks : 0;
+
+        threads = calloc(cfg->threads, sizeof(struct bench_thread));
+        stats = calloc(1, sizeof(struct bench_stats));
+        if (threads == NULL || stats == NULL) {
+                perror("cannot allocate memory for benchmark");
+                free(threads);
+                free(stats);
+                return -ENOMEM;
+        }
+        for (i = 0; i < cfg->threads; i++) {
+                struct bench_thread *t = &threads[i];
+
+                t->run = run;
+                t->rand_state = 0x9e3779b97f4a7c15ULL * (i + 1);
+                t->region_size = blocks * run->size;
+                t->region_start = i * t->region_size;
+                pthread_mutex_init(&t->mutex, NULL);
+                pthread_cond_init(&t->cond, NULL);
+                t->slots = calloc(run->depth, sizeof(struct bench_slot));
+                if (t->slots == NULL) {
+                        perror("cannot allocate memory for benchmark");
+                        rc = -ENOMEM;
+                        goto out;
+                }
+                for (j = 0; j < run->depth; j++) {
+                        t->slots[j].t = t;
+                        t->slots[j].buf = client_alloc_buffer(run->conn, run->size);
+                        if (t->slots[j].buf == NULL) {
+                                rc = -ENOMEM;
+                                goto out;
+                        }
+                }
+        }
+
+        for (i = 0; i < cfg->threads; i++) {
+                rc = pthread_create(&threads[i].thread, NULL, bench_thread_main,
+                                &threads[i]);
+                if (rc != 0) {
+                        fprintf(stderr, "Fail to create benchmark thread: %s\n",
+                                        strerror(rc));
+                        rc = -rc;
+                        break;
+                }
+                started++;
+        }
+        for (i = 0; i < started; i++) {
+                pthread_join(threads[i].thread, NULL);
+                for (j = 0; j < NR_OPS; j++) {
+                        stats->ops[j] += threads[i].stats.ops[j];
+                        stats->bytes[j] += threads[i].stats.bytes[j];
+                        histogram_merge(&stats->latency[j],
+                                        &threads[i].stats.latency[j]);
+                }
+                stats->errors += threads[i].stats.errors;
+                if (threads[i].elapsed_ns > elapsed) {
+                        elapsed = threads[i].elapsed_ns;
+                }
+        }
+        if (rc == 0) {
+                print_result(run, stats, elapsed ? elapsed / 1E9 : 1E-9, first);
+                if (stats->errors != 0) {
+                        rc = -EIO;
+                }
+        }
+out:
+        for (i = 0; i < cfg->threads; i++) {
+                for (j = 0; threads[i].slots != NULL && j < run->depth; j++) {
+                        if (threads[i].slots[j].buf != NULL) {
+                                client_free_buffer(run->conn,
+                                                threads[i].slots[j].buf, run->size);
+                        }
+                }
+                free(threads[i].slots);
+                pthread_mutex_destroy(&threads[i].mutex);
+                pthread_cond_destroy(&threads[i].cond);
+        }
+        free(threads);
+        free(stats);
+        return rc;
+}
+
+// Reads are checked against the pattern of the seed, so it has to be on
+// every volume before anything reads it
+static int bench_prefill(struct client_connection *conn, struct bench_config *cfg) {
+        size_t offset, len;
+        uint64_t seed;
+        void *buf;
+        int v, rc = 0;
+
+        buf = malloc(PREFILL_SIZE);
+        if (buf == NULL) {
+                perror("cannot allocate memory for prefill");
+                return -ENOMEM;
+        }
+        for (v = 0; v < cfg->volumes && rc == 0; v++) {
+                seed = pattern_volume_seed(cfg->seed, v);
+                for (offset = 0; offset < cfg->span; offset += len) {
+                        len = cfg->span - offset;
+                        if (len > PREFILL_SIZE) {
+                                len = PREFILL_SIZE;
+                        }
+                        pattern_fill(seed, offset, buf, len);
+                        rc = write_volume_at(conn, v, buf, len, offset);
+                        if (rc < 0) {
+                                fprintf(stderr, "Fail to prefill volume %d at %lu\n",
+                                                v, offset);
+                                break;
+                        }
+                }
+        }
+        free(buf);
+        return rc;
+}
+
+// Runs every combination of the config, stops at the first failing run
+int run_benchmark(struct client_connection *conn, struct bench_config *cfg) {
+        struct bench_run run;
+        int i, j, k, rc = 0, reads = 0, first = 1;
+
+        if (cfg->threads <= 0 || cfg->volumes <= 0 || cfg->span == 0) {
+                return -EINVAL;
+        }
+        for (i = 0; i < cfg->nr_sizes; i++) {
+                if (cfg->sizes[i] <= 0) {
+                        return -EINVAL;
+                }
+        }
+        for (i = 0; i < cfg->nr_depths; i++) {
+                if (cfg->depths[i] <= 0) {
+                        return -EINVAL;
+                }
+        }
+        for (i = 0; i < cfg->nr_read_percents; i++) {
+                if (cfg->read_percents[i] > 100) {
+                        return -EINVAL;
+                }
+                reads |= cfg->read_percents[i] != 0;
+        }
+
+        if (reads && !cfg->prefilled) {
+                rc = bench_prefill(conn, cfg);
+                if (rc < 0) {
+                        return rc;
+                }
+        }
+
+        if (cfg->json) {
+                printf("[");
+        }
+        run.conn = conn;
+        run.cfg = cfg;
+        for (i = 0; i < cfg->nr_sizes && rc == 0; i++) {
+                for (j = 0; j < cfg->nr_depths && rc == 0; j++) {
+                        for (k = 0; k < cfg->nr_read_percents && rc == 0; k++) {
+                                run.size = cfg->sizes[i];
+                                run.depth = cfg->depths[j];
+                                run.read_percent = cfg->read_percents[k];
+                                rc = bench_one(&run, first);
+                                first = 0;
+                        }
+                }
+        }
+        if (cfg->json) {
+                printf("\n]\n");
+        }
+        return rc;
+}
@@ -0,0 +1,51 @@
+#ifndef LONGHORN_RPC_BENCH_HEADER
+#define LONGHORN_RPC_BENCH_HEADER
+
+#include <stdint.h>
+#include <sys/types.h>
+
+struct client_connection;
+
+#define BENCH_MAX_SWEEP 16
+
+enum bench_pattern {
+        BenchSequential,
+        BenchRandom,
+};
+
+// Every combination of request size, queue depth and read mix is one run.
+// Each of the threads keeps depth requests in flight on the shared
+// connection. Sequential threads each walk their own part of the span,
+// random ones pick aligned offsets anywhere in it.
+struct bench_config {
+        enum bench_pattern pattern;
+        int sizes[BENCH_MAX_SWEEP];
+        int nr_sizes;
+        int depths[BENCH_MAX_SWEEP];
+        int nr_depths;
+        // Percentage of requests that are reads
+        int read_percents[BENCH_MAX_SWEEP];
+        int nr_read_percents;
+        int threads;
+        // Seconds of unmeasured I/O before each run
+        int warmup_secs;
+        // Seconds each run is measured for, 0 for one pass over the span
+        int runtime_secs;
+        // Bytes of every volume used, from offset 0
+        size_t span;
+        // Requests are spread round robin over volumes 0 to volumes - 1
+        int volumes;
+        // Writes carry, and reads must return, the data pattern of this
+        // seed, see longhorn-rpc-pattern.h
+        uint64_t seed;
+        // Volumes already hold the seed's data, from an earlier run, so
+        // reads don't need them written first
+        int prefilled;
+        int json;
+};
+
+void init_bench_config(struct bench_config *cfg, size_t span);
+int parse_bench_list(char *arg, int *values, int *nr);
+int run_benchmark(struct client_connection *conn, struct bench_config *cfg);
+
+#endif
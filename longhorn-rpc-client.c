@@ -1,159 +1,611 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 
 #include "longhorn-rpc-client.h"
 #include "longhorn-rpc-protocol.h"
+#include "longhorn-rpc-trace.h"
+#include "longhorn-rpc-loopback.h"
 
-int send_request(struct client_connection *conn, struct Message *req) {
-        int rc = 0;
+// Spin slightly longer than the average wait, so most waits end while
+// spinning. Once waits are typically longer than max_ns, spinning only
+// burns CPU before sleeping anyway, so stop until they get short again.
+uint64_t poll_budget(struct poll_tuner *tuner) {
+        uint64_t budget = tuner->avg_ns + tuner->avg_ns / 2;
 
-        pthread_mutex_lock(&conn->mutex);
-        rc = send_msg(conn->fd, req);
-        pthread_mutex_unlock(&conn->mutex);
-        return rc;
+        if (tuner->max_ns == 0 || tuner->avg_ns > tuner->max_ns) {
+                return 0;
+        }
+        return budget < tuner->max_ns ? budget : tuner->max_ns;
 }
 
-int receive_response(struct client_connection *conn, struct Message *resp) {
-        int rc = 0;
+// Updated without locking by whoever waited, an occasional lost update
+// only nudges the heuristic
+void poll_update(struct poll_tuner *tuner, uint64_t waited_ns) {
+        // Clamp long sleeps so one idle period doesn't turn polling off
+        // for a long time
+        if (waited_ns > 2 * tuner->max_ns) {
+                waited_ns = 2 * tuner->max_ns;
+        }
+        tuner->avg_ns = tuner->avg_ns - tuner->avg_ns / 8 + waited_ns / 8;
+}
 
-        rc = receive_msg(conn->fd, resp);
-        return rc;
+void set_busy_poll(struct client_connection *conn, uint64_t max_ns) {
+        conn->socket_poll.max_ns = max_ns;
+        conn->socket_poll.avg_ns = 0;
+        conn->completion_poll.max_ns = max_ns;
+        conn->completion_poll.avg_ns = 0;
 }
 
-void* response_process(void *arg) {
-        struct client_connection *conn = arg;
-        struct Message *req, *resp;
-        int ret = 0;
+// Block until the server's credits leave room for one more fragment of
+// len bytes
+void acquire_credit(struct client_connection *conn, uint32_t len) {
+        pthread_mutex_lock(&conn->credit_mutex);
+        while (conn->inflight >= conn->max_inflight ||
+                        conn->inflight_bytes + len > conn->max_inflight_bytes) {
+                pthread_cond_wait(&conn->credit_cond, &conn->credit_mutex);
+        }
+        conn->inflight++;
+        conn->inflight_bytes += len;
+        pthread_mutex_unlock(&conn->credit_mutex);
+}
 
-	resp = malloc(sizeof(struct Message));
-        if (resp == NULL) {
-            perror("cannot allocate memory for resp");
-            return NULL;
+void release_credit(struct client_connection *conn, uint32_t len) {
+        pthread_mutex_lock(&conn->credit_mutex);
+        conn->inflight--;
+        conn->inflight_bytes -= len;
+        // Waiters need different amounts of bytes, let all of them recheck
+        pthread_cond_broadcast(&conn->credit_cond);
+        pthread_mutex_unlock(&conn->credit_mutex);
+}
+
+// Submitted requests have nobody waiting, hand the result over and free
+void record_latency(struct client_connection *conn, struct Message *req) {
+        histogram_record(conn->latency[req->Type], now_ns() - req->start);
+}
+
+void finish_submitted(struct client_connection *conn, struct Message *req) {
+        record_latency(conn, req);
+        req->done(req->done_data, req->rc);
+        pthread_cond_destroy(&req->cond);
+        pthread_mutex_destroy(&req->mutex);
+        free(req);
+}
+
+void complete_fragment(struct client_connection *conn, struct Message *frag,
+                int rc) {
+        struct Message *req = frag->parent;
+        int done;
+
+        TRACE(ClientDone, frag->Seq, rc);
+        pthread_mutex_lock(&req->mutex);
+        if (rc < 0) {
+                req->rc = rc;
+        }
+        req->pending--;
+        done = req->pending == 0;
+        if (done && req->done == NULL) {
+                pthread_cond_signal(&req->cond);
         }
+        pthread_mutex_unlock(&req->mutex);
 
-        // TODO Need to add multiple event poll to gracefully shutdown
-	ret = receive_response(conn, resp);
-        while (ret == 0) {
-                /*
-                if (resp->Seq % 1024 == 0) {
-                        printf("Received seq %d\n", resp->Seq);
+        if (frag != req) {
+                free(frag);
+        }
+        if (done && req->done != NULL) {
+                finish_submitted(conn, req);
+        }
+}
+
+// Wait for the response socket to become readable by spinning on a
+// non-blocking peek, so a quick response doesn't cost a sleep and wake-up
+void poll_response_socket(struct client_connection *conn, uint64_t start) {
+        uint64_t budget = poll_budget(&conn->socket_poll);
+        char c;
+
+        // Loopback reads spin by themselves
+        if (is_loopback_fd(conn->fd)) {
+                return;
+        }
+        while (now_ns() - start < budget) {
+                // Data, EOF or an error, the blocking read will handle it
+                if (recv(conn->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) >= 0 ||
+                                errno != EAGAIN) {
+                        return;
                 }
-                */
+                cpu_relax();
+        }
+}
 
-                if (resp->Type != TypeResponse) {
-                        fprintf(stderr, "Wrong type for response of seq %d\n",
-                                        resp->Seq);
-                        continue;
+// Read the response for one fragment. Read data goes straight from the
+// socket into the caller's buffer, the response thread never copies it.
+int receive_response(struct client_connection *conn) {
+        struct Message resp, *req;
+        uint64_t start = 0;
+        int rc = 0, cancelled = 0;
+
+        // Spin only while something is outstanding, an idle connection
+        // just sleeps in read()
+        if (conn->socket_poll.max_ns != 0 && conn->inflight != 0) {
+                start = now_ns();
+                poll_response_socket(conn, start);
+        }
+
+        rc = receive_msg_header(conn->fd, &resp);
+        if (rc < 0) {
+                return rc;
+        }
+        TRACE(ClientResponse, resp.Seq, resp.Type);
+        if (start != 0) {
+                poll_update(&conn->socket_poll, now_ns() - start);
+        }
+
+        pthread_mutex_lock(&conn->mutex);
+        HASH_FIND(hh, conn->msg_table, &resp.Seq, sizeof(resp.Seq), req);
+        if (req != NULL) {
+                HASH_DEL(conn->msg_table, req);
+                // Decided together with cancel_request() setting the flag,
+                // so a canceller knows whether to wait for the data
+                cancelled = req->parent->cancelled;
+                if (!cancelled) {
+                        __atomic_store_n(&conn->receiving, req->parent,
+                                        __ATOMIC_RELEASE);
                 }
+        }
+        pthread_mutex_unlock(&conn->mutex);
+
+        // The server has let go of the request once it answers
+        if (req != NULL) {
+                release_credit(conn, req->DataLength);
+        }
+
+        if (req == NULL) {
+                fprintf(stderr, "Unknown response seq %lu\n", resp.Seq);
+        } else if (resp.Type != TypeResponse) {
+                if (resp.Type != TypeError) {
+                        fprintf(stderr, "Wrong type for response of seq %lu\n",
+                                        resp.Seq);
+                }
+                complete_fragment(conn, req, -EIO);
+                req = NULL;
+        } else if ((resp.Flags & FlagData) &&
+                        resp.DataLength != req->DataLength) {
+                fprintf(stderr, "Wrong data length %u for response of seq %lu\n",
+                                resp.DataLength, resp.Seq);
+                complete_fragment(conn, req, -EIO);
+                req = NULL;
+        }
 
-                pthread_mutex_lock(&conn->mutex);
-                HASH_FIND_INT(conn->msg_table, &resp->Seq, req);
-                if (req != NULL) {
-                        HASH_DEL(conn->msg_table, req);
+        if (resp.Flags & FlagData) {
+                if (req != NULL && !cancelled) {
+                        rc = receive_data(conn->fd, req->Data, resp.DataLength);
+                } else {
+                        rc = discard_data(conn->fd, resp.DataLength);
                 }
-                pthread_mutex_unlock(&conn->mutex);
+        }
+        __atomic_store_n(&conn->receiving, NULL, __ATOMIC_RELEASE);
+        if (req != NULL) {
+                complete_fragment(conn, req,
+                                cancelled && rc == 0 ? -ECANCELED : rc);
+        }
+        return rc;
+}
 
-                pthread_mutex_lock(&req->mutex);
-                memcpy(req->Data, resp->Data, req->DataLength);
-                free(resp->Data);
-                pthread_mutex_unlock(&req->mutex);
+// The connection is gone, nothing in flight will get its response. Later
+// requests fail right away in send_fragment().
+void fail_pending_requests(struct client_connection *conn) {
+        struct Message *table, *req, *tmp;
 
-                pthread_cond_signal(&req->cond);
+        pthread_mutex_lock(&conn->mutex);
+        conn->broken = 1;
+        table = conn->msg_table;
+        conn->msg_table = NULL;
+        pthread_mutex_unlock(&conn->mutex);
 
-                ret = receive_response(conn, resp);
+        HASH_ITER(hh, table, req, tmp) {
+                HASH_DEL(table, req);
+                release_credit(conn, req->DataLength);
+                complete_fragment(conn, req, -EIO);
         }
-        free(resp);
-        if (ret != 0) {
-                fprintf(stderr, "Receive response returned error");
+}
+
+void* response_process(void *arg) {
+        struct client_connection *conn = arg;
+        int ret = 0;
+
+        // TODO Need to add multiple event poll to gracefully shutdown
+        do {
+                ret = receive_response(conn);
+        } while (ret == 0);
+
+        if (!__atomic_load_n(&conn->closing, __ATOMIC_ACQUIRE)) {
+                fprintf(stderr, "Receive response returned error\n");
         }
+        fail_pending_requests(conn);
+        return NULL;
+}
+
+// Must be called before start_response_processing()
+void set_response_affinity(struct client_connection *conn, cpu_set_t *cpus) {
+        conn->pin_response_thread = 1;
+        conn->response_cpus = *cpus;
 }
 
 void start_response_processing(struct client_connection *conn) {
+        pthread_attr_t attr;
         int rc;
 
-        rc = pthread_create(&conn->response_thread, NULL, &response_process, conn);
-        if (rc < 0) {
-                perror("Fail to create response thread");
+        pthread_attr_init(&attr);
+        if (conn->pin_response_thread) {
+                pin_thread_attr(&attr, &conn->response_cpus);
+        }
+        rc = pthread_create(&conn->response_thread, &attr, &response_process, conn);
+        pthread_attr_destroy(&attr);
+        if (rc != 0) {
+                fprintf(stderr, "Fail to create response thread: %s\n", strerror(rc));
                 exit(-1);
         }
+        conn->response_running = 1;
 }
 
-int new_seq(struct client_connection *conn) {
+uint64_t new_seq(struct client_connection *conn) {
         return __sync_fetch_and_add(&conn->seq, 1);
 }
 
-int process_request(struct client_connection *conn, void *buf, size_t count, off_t offset, 
-                uint32_t type) {
-        struct Message *req = malloc(sizeof(struct Message));
-        int rc = 0;
+// Send one fragment of a request. On failure the fragment was never on the
+// wire, so it is removed from the table again and completed with the error.
+int send_fragment(struct client_connection *conn, struct Message *frag) {
+        int rc;
 
-        if (req == NULL) {
-                perror("cannot allocate memory for req");
-                return -EINVAL;
+        TRACE(ClientQueue, frag->Seq, frag->DataLength);
+        acquire_credit(conn, frag->DataLength);
+        TRACE(ClientCredit, frag->Seq, 0);
+
+        pthread_mutex_lock(&conn->mutex);
+        TRACE(ClientLocked, frag->Seq, 0);
+        if (conn->broken) {
+                rc = -EPIPE;
+        } else {
+                HASH_ADD(hh, conn->msg_table, Seq, sizeof(frag->Seq), frag);
+                rc = send_msg(conn->fd, frag);
+                if (rc < 0) {
+                        HASH_DEL(conn->msg_table, frag);
+                } else {
+                        TRACE(ClientSent, frag->Seq, 0);
+                }
         }
+        pthread_mutex_unlock(&conn->mutex);
 
-        if (type != TypeRead && type != TypeWrite) {
-                fprintf(stderr, "BUG: Invalid type for process_request %d\n", type);
-                rc = -EFAULT;
-                goto free;
+        if (rc < 0) {
+                release_credit(conn, frag->DataLength);
+                complete_fragment(conn, frag, rc);
+        }
+        return rc;
+}
+
+void wait_for_completion(struct client_connection *conn, struct Message *req) {
+        uint64_t budget, start = 0;
+
+        if (conn->completion_poll.max_ns != 0) {
+                start = now_ns();
+                budget = poll_budget(&conn->completion_poll);
+                while (__atomic_load_n(&req->pending, __ATOMIC_ACQUIRE) > 0 &&
+                                now_ns() - start < budget) {
+                        cpu_relax();
+                }
+        }
+
+        // Even if spinning saw the last completion, its completer may still
+        // hold the mutex, so always take it before req can be freed
+        pthread_mutex_lock(&req->mutex);
+        while (req->pending > 0) {
+                pthread_cond_wait(&req->cond, &req->mutex);
+        }
+        pthread_mutex_unlock(&req->mutex);
+
+        if (start != 0) {
+                poll_update(&conn->completion_poll, now_ns() - start);
+        }
+}
+
+// Send every fragment of a request. Returns the number of fragments still
+// pending, 0 once the request is complete.
+int send_request(struct client_connection *conn, struct Message *req,
+                uint16_t volume, void *buf, size_t count, off_t offset,
+                uint32_t type, uint32_t priority) {
+        size_t sent, len;
+        int rc = 0, pending;
+
+        if (priority == PriorityDefault) {
+                priority = conn->priority;
         }
-        req->Seq = new_seq(conn);
         req->Type = type;
+        req->Flags = type == TypeWrite ? FlagData : 0;
+        req->Flags |= priority << FlagPriorityShift;
+        req->Volume = volume;
         req->Offset = offset;
-        req->DataLength = count;
+        req->DataLength = count < conn->max_data_length ? count : conn->max_data_length;
         req->Data = buf;
+        req->parent = req;
+        req->rc = 0;
+        req->start = now_ns();
+        // Only I/O goes in the trace, a stats query can't be replayed
+        if (conn->recorder != NULL && (type == TypeRead || type == TypeWrite)) {
+                iotrace_record(conn->recorder, req->start, type, volume,
+                                offset, count);
+        }
+        // One more than the fragments, so the request can't complete while
+        // fragments are still being sent
+        req->pending = (count + conn->max_data_length - 1) / conn->max_data_length + 1;
+
+        // Requests larger than max_data_length go out as a pipeline of
+        // fragments, the first of which is the request itself. All of them
+        // are sent before waiting, so the server can start working on the
+        // first fragment while the rest are still on the wire.
+        for (sent = 0; sent < count; sent += len) {
+                struct Message *frag = req;
+
+                len = count - sent;
+                if (len > conn->max_data_length) {
+                        len = conn->max_data_length;
+                }
+                if (sent != 0) {
+                        frag = malloc(sizeof(struct Message));
+                        if (frag == NULL) {
+                                perror("cannot allocate memory for fragment");
+                                rc = -ENOMEM;
+                                break;
+                        }
+                        frag->Type = type;
+                        frag->Flags = req->Flags;
+                        frag->Volume = volume;
+                        frag->Offset = offset + sent;
+                        frag->DataLength = len;
+                        frag->Data = buf + sent;
+                        frag->parent = req;
+                }
+                frag->Seq = new_seq(conn);
 
-        if (req->Type == TypeRead) {
-                bzero(req->Data, count);
+                rc = send_fragment(conn, frag);
+                if (rc < 0) {
+                        sent += len;
+                        break;
+                }
+        }
+
+        // Fragments that were never sent will not get a response
+        pthread_mutex_lock(&req->mutex);
+        req->pending--;
+        if (sent < count) {
+                req->pending -= (count - sent + conn->max_data_length - 1) /
+                        conn->max_data_length;
+                req->rc = rc;
         }
+        pending = req->pending;
+        pthread_mutex_unlock(&req->mutex);
+        return pending;
+}
+
+struct Message *new_request() {
+        struct Message *req = malloc(sizeof(struct Message));
+        int rc;
 
+        if (req == NULL) {
+                perror("cannot allocate memory for req");
+                return NULL;
+        }
+        req->done = NULL;
+        req->cancelled = 0;
         rc = pthread_cond_init(&req->cond, NULL);
-        if (rc < 0) {
+        if (rc != 0) {
                 perror("Fail to init phread_cond");
-                rc = -EFAULT;
-                goto free;
+                free(req);
+                return NULL;
         }
         rc = pthread_mutex_init(&req->mutex, NULL);
-        if (rc < 0) {
+        if (rc != 0) {
                 perror("Fail to init phread_mutex");
-                rc = -EFAULT;
-                goto free;
+                pthread_cond_destroy(&req->cond);
+                free(req);
+                return NULL;
         }
+        return req;
+}
 
-        pthread_mutex_lock(&conn->mutex);
-        HASH_ADD_INT(conn->msg_table, Seq, req);
-        pthread_mutex_unlock(&conn->mutex);
+int process_request(struct client_connection *conn, uint16_t volume, void *buf,
+                size_t count, off_t offset, uint32_t type) {
+        struct Message *req;
+        int rc = 0;
 
-        pthread_mutex_lock(&req->mutex);
-        rc = send_request(conn, req);
-        if (rc < 0) {
-                goto out;
+        if (type != TypeRead && type != TypeWrite) {
+                fprintf(stderr, "BUG: Invalid type for process_request %d\n", type);
+                return -EFAULT;
+        }
+        req = new_request();
+        if (req == NULL) {
+                return -ENOMEM;
         }
 
-        pthread_cond_wait(&req->cond, &req->mutex);
-out:
-        pthread_mutex_unlock(&req->mutex);
-free:
+        send_request(conn, req, volume, buf, count, offset, type,
+                        PriorityDefault);
+        wait_for_completion(conn, req);
+        record_latency(conn, req);
+        rc = req->rc;
+
+        pthread_cond_destroy(&req->cond);
+        pthread_mutex_destroy(&req->mutex);
         free(req);
         return rc;
 }
 
+// Servers that don't know about volumes ignore the header field, a request
+// for another volume would silently hit volume 0
+static int volume_supported(struct client_connection *conn, uint16_t volume) {
+        return volume == 0 || (conn->features & FeatureVolumes);
+}
+
+// Servers that don't know about priorities treat everything as normal,
+// so refuse rather than pretend
+static int priority_supported(struct client_connection *conn,
+                uint32_t priority) {
+        if (priority != PriorityNormal && priority != PriorityIdle) {
+                return -EINVAL;
+        }
+        if (priority != PriorityNormal && !(conn->features & FeaturePriority)) {
+                return -EOPNOTSUPP;
+        }
+        return 0;
+}
+
+// Start a read or write without waiting for it. done(data, rc) is called
+// once the request completed, usually from the response thread, but from
+// the calling thread if it failed before anything was sent. Reads fill buf
+// up to completion, a write's payload is on the wire by the time this
+// returns. priority is the class of this request alone, or
+// PriorityDefault. If handle is set it gets the request for
+// cancel_request(), valid until done is called.
+int submit_request(struct client_connection *conn, uint32_t type,
+                uint16_t volume, void *buf, size_t count, off_t offset,
+                uint32_t priority, void (*done) (void *data, int rc),
+                void *data, struct Message **handle) {
+        struct Message *req;
+        int rc;
+
+        if (type != TypeRead && type != TypeWrite) {
+                return -EINVAL;
+        }
+        if (!volume_supported(conn, volume)) {
+                return -EOPNOTSUPP;
+        }
+        if (priority != PriorityDefault) {
+                rc = priority_supported(conn, priority);
+                if (rc < 0) {
+                        return rc;
+                }
+        }
+        req = new_request();
+        if (req == NULL) {
+                return -ENOMEM;
+        }
+        req->done = done;
+        req->done_data = data;
+        if (handle != NULL) {
+                *handle = req;
+        }
+
+        if (send_request(conn, req, volume, buf, count, offset, type,
+                                priority) == 0) {
+                finish_submitted(conn, req);
+        }
+        return 0;
+}
+
+// Stop a submitted read from touching its buffer. The buffer is the
+// caller's again on return; the request still completes, with -ECANCELED,
+// once the server answers. Must not race with the request's done callback.
+void cancel_request(struct client_connection *conn, struct Message *req) {
+        pthread_mutex_lock(&conn->mutex);
+        req->cancelled = 1;
+        pthread_mutex_unlock(&conn->mutex);
+
+        // A fragment the response thread picked up before is finishing its
+        // copy, that takes no longer than one read of the socket
+        while (__atomic_load_n(&conn->receiving, __ATOMIC_ACQUIRE) == req) {
+                cpu_relax();
+        }
+}
+
 int read_at(struct client_connection *conn, void *buf, size_t count, off_t offset) {
-        process_request(conn, buf, count, offset, TypeRead);
+        return process_request(conn, 0, buf, count, offset, TypeRead);
 }
 
 int write_at(struct client_connection *conn, void *buf, size_t count, off_t offset) {
-        process_request(conn, buf, count, offset, TypeWrite);
+        return process_request(conn, 0, buf, count, offset, TypeWrite);
+}
+
+int read_volume_at(struct client_connection *conn, uint16_t volume, void *buf,
+                size_t count, off_t offset) {
+        if (!volume_supported(conn, volume)) {
+                return -EOPNOTSUPP;
+        }
+        return process_request(conn, volume, buf, count, offset, TypeRead);
+}
+
+int write_volume_at(struct client_connection *conn, uint16_t volume, void *buf,
+                size_t count, off_t offset) {
+        if (!volume_supported(conn, volume)) {
+                return -EOPNOTSUPP;
+        }
+        return process_request(conn, volume, buf, count, offset, TypeWrite);
+}
+
+// Class of every request that doesn't pick its own
+int set_io_priority(struct client_connection *conn, uint32_t priority) {
+        int rc;
+
+        rc = priority_supported(conn, priority);
+        if (rc < 0) {
+                return rc;
+        }
+        conn->priority = priority;
+        return 0;
+}
+
+// Buffers for read_at()/write_at() that are 4 KiB aligned and backed by
+// hugepages. Data moves between them and the socket without any copy in
+// the library, and they can be handed to O_DIRECT I/O as they are.
+void *client_alloc_buffer(struct client_connection *conn, size_t size) {
+        return pool_alloc(conn->pool, size);
+}
+
+// size must be the size the buffer was allocated with
+void client_free_buffer(struct client_connection *conn, void *buf, size_t size) {
+        pool_free(conn->pool, buf, size);
+}
+
+// Tell the server what this client wants and adopt what it grants. Runs
+// before the response thread exists, so it reads the answer itself.
+int client_handshake(struct client_connection *conn) {
+        struct Handshake hs;
+        int rc;
+
+        hs.MaxDataLength = conn->max_data_length;
+        hs.MaxInflight = conn->max_inflight;
+        hs.MaxInflightBytes = conn->max_inflight_bytes;
+        hs.Features = conn->features;
+
+        rc = send_handshake(conn->fd, TypeHandshake, &hs);
+        if (rc < 0) {
+                return rc;
+        }
+        rc = receive_handshake(conn->fd, TypeHandshake, &hs);
+        if (rc < 0) {
+                return rc;
+        }
+        if (hs.MaxDataLength == 0 || hs.MaxDataLength > conn->max_data_length ||
+                        hs.MaxInflight == 0 || hs.MaxInflight > conn->max_inflight ||
+                        hs.MaxInflightBytes < hs.MaxDataLength ||
+                        hs.MaxInflightBytes > conn->max_inflight_bytes ||
+                        (hs.Features & ~conn->features) != 0) {
+                fprintf(stderr, "server granted invalid parameters\n");
+                return -EPROTO;
+        }
+
+        conn->max_data_length = hs.MaxDataLength;
+        conn->max_inflight = hs.MaxInflight;
+        conn->max_inflight_bytes = hs.MaxInflightBytes;
+        conn->features = hs.Features;
+        return 0;
 }
 
 struct client_connection *new_client_connection(char *socket_path) {
         struct sockaddr_un addr;
-        int fd, rc = 0;
-        struct client_connection *conn = NULL;
+        struct client_connection *conn;
+        int fd;
 
         fd = socket(AF_UNIX, SOCK_STREAM, 0);
         if (fd == -1) {
@@ -175,25 +627,166 @@ struct client_connection *new_client_connection(char *socket_path) {
                 exit(-EFAULT);
         }
 
+        conn = new_client_connection_fd(fd);
+        if (conn == NULL) {
+                fprintf(stderr, "handshake with %s failed\n", socket_path);
+        }
+        return conn;
+}
+
+// Takes over a connected socket, or one end of a loopback_pair(), and
+// handshakes over it. The descriptor is closed on failure.
+struct client_connection *new_client_connection_fd(int fd) {
+        struct client_connection *conn;
+        int rc;
+
         conn = malloc(sizeof(struct client_connection));
         if (conn == NULL) {
             perror("cannot allocate memory for conn");
+            close_fd(fd);
             return NULL;
         }
 
         conn->fd = fd;
         conn->seq = 0;
         conn->msg_table = NULL;
+        conn->max_data_length = MAX_DATA_LENGTH;
+        conn->max_inflight = DEFAULT_MAX_INFLIGHT;
+        conn->max_inflight_bytes = DEFAULT_MAX_INFLIGHT_BYTES;
+        conn->features = SUPPORTED_FEATURES;
+        conn->priority = PriorityNormal;
+        conn->inflight = 0;
+        conn->inflight_bytes = 0;
+        set_busy_poll(conn, 0);
+        conn->pin_response_thread = 0;
+        conn->broken = 0;
+        conn->receiving = NULL;
+        conn->recorder = NULL;
+        conn->response_running = 0;
+        conn->closing = 0;
 
         rc = pthread_mutex_init(&conn->mutex, NULL);
         if (rc < 0) {
                 perror("fail to init conn->mutex");
                 exit(-EFAULT);
         }
+        rc = pthread_mutex_init(&conn->credit_mutex, NULL);
+        if (rc < 0) {
+                perror("fail to init conn->credit_mutex");
+                exit(-EFAULT);
+        }
+        rc = pthread_cond_init(&conn->credit_cond, NULL);
+        if (rc < 0) {
+                perror("fail to init conn->credit_cond");
+                exit(-EFAULT);
+        }
+
+        rc = client_handshake(conn);
+        if (rc < 0) {
+                close_fd(fd);
+                free(conn);
+                return NULL;
+        }
+
+        conn->pool = new_buffer_pool(-1);
+        conn->latency[TypeRead] = new_histogram();
+        conn->latency[TypeWrite] = new_histogram();
+        if (conn->pool == NULL || conn->latency[TypeRead] == NULL ||
+                        conn->latency[TypeWrite] == NULL) {
+                close_fd(fd);
+                if (conn->pool != NULL) {
+                        free_buffer_pool(conn->pool);
+                }
+                free_histogram(conn->latency[TypeRead]);
+                free_histogram(conn->latency[TypeWrite]);
+                free(conn);
+                return NULL;
+        }
         return conn;
 }
 
+// Requests still in flight fail with -EIO. Nothing may be issued on the
+// connection anymore, and done callbacks must have returned before the
+// caller frees what they use.
 int shutdown_client_connection(struct client_connection *conn) {
-        close(conn->fd);
+        if (conn->response_running) {
+                __atomic_store_n(&conn->closing, 1, __ATOMIC_RELEASE);
+                shutdown_fd(conn->fd);
+                pthread_join(conn->response_thread, NULL);
+        }
+        close_fd(conn->fd);
+        free_buffer_pool(conn->pool);
+        free_histogram(conn->latency[TypeRead]);
+        free_histogram(conn->latency[TypeWrite]);
+        free_iotrace_recorder(conn->recorder);
         free(conn);
+        return 0;
+}
+
+// Log every read and write issued from now on to a block trace at path, see
+// longhorn-rpc-iotrace.h
+int client_start_recording(struct client_connection *conn, char *path) {
+        struct iotrace_recorder *rec;
+
+        pthread_mutex_lock(&conn->mutex);
+        if (conn->recorder == NULL) {
+                conn->recorder = new_iotrace_recorder();
+        }
+        rec = conn->recorder;
+        pthread_mutex_unlock(&conn->mutex);
+        if (rec == NULL) {
+                return -ENOMEM;
+        }
+        return iotrace_start(rec, path, now_ns());
+}
+
+// records gets the number of requests logged
+int client_stop_recording(struct client_connection *conn, uint64_t *records) {
+        if (conn->recorder == NULL) {
+                return -EINVAL;
+        }
+        return iotrace_stop(conn->recorder, records);
+}
+
+// Latency of reads or writes completed since the last reset, in ns
+int client_latency_snapshot(struct client_connection *conn, uint32_t type,
+                struct histogram_data *snap) {
+        if (type != TypeRead && type != TypeWrite) {
+                return -EINVAL;
+        }
+        histogram_snapshot(conn->latency[type], snap);
+        return 0;
+}
+
+void client_latency_reset(struct client_connection *conn) {
+        histogram_reset(conn->latency[TypeRead]);
+        histogram_reset(conn->latency[TypeWrite]);
+}
+
+// Ask the server what it is doing. Goes through the connection like any
+// other request, in-flight I/O carries on.
+int get_server_stats(struct client_connection *conn, struct StatsReply *stats) {
+        struct Message *req;
+        int rc;
+
+        if (!(conn->features & FeatureStats)) {
+                return -EOPNOTSUPP;
+        }
+        req = new_request();
+        if (req == NULL) {
+                return -ENOMEM;
+        }
+
+        send_request(conn, req, 0, stats, sizeof(struct StatsReply), 0, TypeStats,
+                        PriorityDefault);
+        wait_for_completion(conn, req);
+        rc = req->rc;
+
+        pthread_cond_destroy(&req->cond);
+        pthread_mutex_destroy(&req->mutex);
+        free(req);
+        if (rc == 0) {
+                stats_from_le(stats);
+        }
+        return rc;
 }
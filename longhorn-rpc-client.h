@@ -4,24 +4,104 @@
 #include <pthread.h>
 
 #include "longhorn-rpc-protocol.h"
+#include "longhorn-rpc-affinity.h"
+#include "longhorn-rpc-pool.h"
+#include "longhorn-rpc-histogram.h"
+#include "longhorn-rpc-iotrace.h"
+
+// Self-tuning spin budget for hybrid polling. Waiters spin for up to the
+// budget before sleeping; the budget follows the average observed wait
+// and drops to zero while waits are longer than max_ns.
+struct poll_tuner {
+        uint64_t max_ns;  // 0 disables polling
+        uint64_t avg_ns;
+};
+
+// Priority argument of submit_request() for the connection's own, see
+// set_io_priority()
+#define PriorityDefault ((uint32_t)-1)
 
 struct client_connection {
-        int seq;  // must be atomic
+        uint64_t seq;  // must be atomic
         int fd;
         int notify_fd;
 
+        // Negotiated with the server at connection time. Requests larger
+        // than max_data_length are split into fragments.
+        uint32_t max_data_length;
+        uint32_t max_inflight;
+        uint32_t max_inflight_bytes;
+        uint64_t features;
+
+        // Priority class of requests sent with PriorityDefault
+        uint32_t priority;
+
+        // Credits in use, a fragment waits for credits before it is sent
+        uint32_t inflight;
+        uint32_t inflight_bytes;
+        pthread_mutex_t credit_mutex;
+        pthread_cond_t credit_cond;
+
         pthread_t response_thread;
+        int response_running;
+        // Set by shutdown_client_connection(), the response thread then
+        // expects to lose the connection
+        int closing;
+        // Cpus the response thread is pinned to, if any
+        int pin_response_thread;
+        cpu_set_t response_cpus;
+
+        // Busy polling on the response socket and on request completion
+        struct poll_tuner socket_poll;
+        struct poll_tuner completion_poll;
 
         struct Message *msg_table;
         pthread_mutex_t mutex;
+        // Set once the response thread gave up on the connection
+        int broken;
+        // Request the response thread is receiving data for, must be atomic
+        struct Message *receiving;
+
+        // Hugepage backed buffers handed out by client_alloc_buffer()
+        struct buffer_pool *pool;
+
+        // Submission to completion of requests, indexed by TypeRead and
+        // TypeWrite
+        struct histogram *latency[2];
+
+        // Set on the first client_start_recording(), never freed before
+        // the connection, so requests can check it without locking
+        struct iotrace_recorder *recorder;
 };
 
 struct client_connection *new_client_connection(char *socket_path);
+struct client_connection *new_client_connection_fd(int fd);
 int shutdown_client_connection(struct client_connection *conn);
 
 int read_at(struct client_connection *conn, void *buf, size_t count, off_t offset);
 int write_at(struct client_connection *conn, void *buf, size_t count, off_t offset);
+int read_volume_at(struct client_connection *conn, uint16_t volume, void *buf,
+                size_t count, off_t offset);
+int write_volume_at(struct client_connection *conn, uint16_t volume, void *buf,
+                size_t count, off_t offset);
+int submit_request(struct client_connection *conn, uint32_t type,
+                uint16_t volume, void *buf, size_t count, off_t offset,
+                uint32_t priority, void (*done) (void *data, int rc),
+                void *data, struct Message **handle);
+void cancel_request(struct client_connection *conn, struct Message *req);
+
+void *client_alloc_buffer(struct client_connection *conn, size_t size);
+void client_free_buffer(struct client_connection *conn, void *buf, size_t size);
 
 void start_response_processing(struct client_connection *conn);
+void set_busy_poll(struct client_connection *conn, uint64_t max_ns);
+int set_io_priority(struct client_connection *conn, uint32_t priority);
+void set_response_affinity(struct client_connection *conn, cpu_set_t *cpus);
+int client_latency_snapshot(struct client_connection *conn, uint32_t type,
+                struct histogram_data *snap);
+void client_latency_reset(struct client_connection *conn);
+int get_server_stats(struct client_connection *conn, struct StatsReply *stats);
+int client_start_recording(struct client_connection *conn, char *path);
+int client_stop_recording(struct client_connection *conn, uint64_t *records);
 
 #endif
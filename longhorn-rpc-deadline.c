@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "longhorn-rpc-server.h"
+#include "longhorn-rpc-deadline.h"
+
+static enum deadline_queue_type queue_of(struct server_connection *conn,
+                struct Message *msg) {
+        uint32_t priority = (msg->Flags & FlagPriorityMask) >> FlagPriorityShift;
+
+        if ((conn->features & FeaturePriority) && priority == PriorityIdle) {
+                return DeadlineIdle;
+        }
+        return msg->Type == TypeRead ? DeadlineRead : DeadlineWrite;
+}
+
+static struct server_request *queue_pop(struct deadline_queue *q) {
+        struct server_request *req = q->head;
+
+        q->head = req->sched_next;
+        if (q->head == NULL) {
+                q->tail = NULL;
+        }
+        return req;
+}
+
+// Called with sched->mutex held and something queued. The most overdue
+// request goes first. Otherwise reads beat writes, and idle requests only
+// run when nothing else is waiting.
+static struct server_request *deadline_pick(struct deadline_sched *sched) {
+        struct deadline_queue *q, *expired = NULL;
+        uint64_t now = now_ns();
+        int i;
+
+        for (i = 0; i < NR_DEADLINE_QUEUES; i++) {
+                q = &sched->queues[i];
+                if (q->head != NULL && q->head->deadline <= now &&
+                                (expired == NULL ||
+                                 q->head->deadline < expired->head->deadline)) {
+                        expired = q;
+                }
+        }
+        if (expired != NULL) {
+                return queue_pop(expired);
+        }
+        for (i = 0; i < NR_DEADLINE_QUEUES; i++) {
+                if (sched->queues[i].head != NULL) {
+                        return queue_pop(&sched->queues[i]);
+                }
+        }
+        return NULL;
+}
+
+static void *deadline_process(void *arg) {
+        struct deadline_sched *sched = arg;
+        struct server_request *req;
+
+        while (1) {
+                pthread_mutex_lock(&sched->mutex);
+                while (sched->queued == 0 && !sched->stop) {
+                        pthread_cond_wait(&sched->cond, &sched->mutex);
+                }
+                if (sched->queued == 0) {
+                        pthread_mutex_unlock(&sched->mutex);
+                        break;
+                }
+                req = deadline_pick(sched);
+                sched->queued--;
+                pthread_mutex_unlock(&sched->mutex);
+
+                server_process_requests(req);
+        }
+        return NULL;
+}
+
+void deadline_submit(struct server_connection *conn, struct server_request *req) {
+        struct deadline_sched *sched = conn->deadline;
+        struct deadline_queue *q = &sched->queues[queue_of(conn, req->msg)];
+
+        req->sched_next = NULL;
+        req->deadline = now_ns() + q->expire_ns;
+
+        pthread_mutex_lock(&sched->mutex);
+        if (q->tail == NULL) {
+                q->head = req;
+        } else {
+                q->tail->sched_next = req;
+        }
+        q->tail = req;
+        sched->queued++;
+        pthread_cond_signal(&sched->cond);
+        pthread_mutex_unlock(&sched->mutex);
+}
+
+// Worker i is pinned to the ith cpu of cpus, round-robin, if cpus isn't
+// NULL
+struct deadline_sched *new_deadline_sched(int nr_workers, cpu_set_t *cpus) {
+        struct deadline_sched *sched;
+        pthread_attr_t attr;
+        cpu_set_t cpu;
+        int i, n, rc;
+
+        if (nr_workers <= 0) {
+                return NULL;
+        }
+        sched = calloc(1, sizeof(struct deadline_sched));
+        if (sched == NULL) {
+                perror("cannot allocate memory for deadline scheduler");
+                return NULL;
+        }
+        sched->workers = calloc(nr_workers, sizeof(pthread_t));
+        if (sched->workers == NULL) {
+                perror("cannot allocate memory for deadline scheduler");
+                free(sched);
+                return NULL;
+        }
+        pthread_mutex_init(&sched->mutex, NULL);
+        pthread_cond_init(&sched->cond, NULL);
+        sched->queues[DeadlineRead].expire_ns = READ_EXPIRE_NS;
+        sched->queues[DeadlineWrite].expire_ns = WRITE_EXPIRE_NS;
+        sched->queues[DeadlineIdle].expire_ns = IDLE_EXPIRE_NS;
+
+        for (i = 0; i < nr_workers; i++) {
+                pthread_attr_init(&attr);
+                n = cpus != NULL ? nth_cpu(cpus, i) : -1;
+                if (n >= 0) {
+                        CPU_ZERO(&cpu);
+                        CPU_SET(n, &cpu);
+                        pin_thread_attr(&attr, &cpu);
+                }
+                rc = pthread_create(&sched->workers[i], &attr, deadline_process,
+                                sched);
+                pthread_attr_destroy(&attr);
+                if (rc != 0) {
+                        fprintf(stderr, "Fail to create deadline worker: %s\n",
+                                        strerror(rc));
+                        free_deadline_sched(sched);
+                        return NULL;
+                }
+                sched->nr_workers++;
+        }
+        return sched;
+}
+
+// Lets the workers drain the queues before they exit. Connections using
+// the scheduler must be shut down first.
+void free_deadline_sched(struct deadline_sched *sched) {
+        int i;
+
+        pthread_mutex_lock(&sched->mutex);
+        sched->stop = 1;
+        pthread_cond_broadcast(&sched->cond);
+        pthread_mutex_unlock(&sched->mutex);
+
+        for (i = 0; i < sched->nr_workers; i++) {
+                pthread_join(sched->workers[i], NULL);
+        }
+        free(sched->workers);
+        free(sched);
+}
+
+// Run the requests of conn on the workers of sched. Must be called before
+// start_server().
+int set_deadline_sched(struct server_connection *conn,
+                struct deadline_sched *sched) {
+        if (sched == NULL) {
+                return -EINVAL;
+        }
+        conn->deadline = sched;
+        conn->exec_mode = ExecDeadline;
+        return 0;
+}
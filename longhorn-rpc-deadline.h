@@ -0,0 +1,53 @@
+#ifndef LONGHORN_RPC_DEADLINE_HEADER
+#define LONGHORN_RPC_DEADLINE_HEADER
+
+#include <stdint.h>
+#include <sched.h>
+#include <pthread.h>
+
+struct server_connection;
+struct server_request;
+
+// How long a request may wait before it is served ahead of everything
+// else. Reads are preferred anyway, the write deadline bounds how long
+// reads can starve writes, and the idle deadline keeps background I/O
+// moving under constant foreground load.
+#define READ_EXPIRE_NS  (5 * 1000 * 1000ULL)
+#define WRITE_EXPIRE_NS (50 * 1000 * 1000ULL)
+#define IDLE_EXPIRE_NS  (1000 * 1000 * 1000ULL)
+
+enum deadline_queue_type {
+        DeadlineRead,
+        DeadlineWrite,
+        DeadlineIdle,
+        NR_DEADLINE_QUEUES
+};
+
+// FIFO in arrival order, which is also deadline order since every request
+// of a queue gets the same expiry
+struct deadline_queue {
+        struct server_request *head;
+        struct server_request *tail;
+        uint64_t expire_ns;
+};
+
+// Shared by every connection attached with set_deadline_sched(), so idle
+// requests of one client wait for the foreground requests of all of them
+struct deadline_sched {
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+        struct deadline_queue queues[NR_DEADLINE_QUEUES];
+        int queued;
+
+        int nr_workers;
+        pthread_t *workers;
+        int stop;
+};
+
+struct deadline_sched *new_deadline_sched(int nr_workers, cpu_set_t *cpus);
+void free_deadline_sched(struct deadline_sched *sched);
+int set_deadline_sched(struct server_connection *conn,
+                struct deadline_sched *sched);
+void deadline_submit(struct server_connection *conn, struct server_request *req);
+
+#endif
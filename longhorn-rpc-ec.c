@@ -0,0 +1,412 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "longhorn-rpc-client.h"
+#include "longhorn-rpc-gf.h"
+#include "longhorn-rpc-ec.h"
+
+// Regions are coded in blocks of this size, so the data chunks of a block
+// are still in cache while every parity chunk is computed from them
+#define EC_BLOCK (16 * 1024)
+
+// Requests sent to several servers at once, waited for together
+struct ec_batch {
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+        int pending;
+        int rc[EC_MAX_CHUNKS];
+};
+
+struct ec_io {
+        struct ec_batch *batch;
+        int server;
+};
+
+// Row i, column j is 1 / ((k + i) ^ j). Every square submatrix of a Cauchy
+// matrix is invertible, which is what lets any k chunks rebuild the data.
+uint8_t *ec_parity_matrix(int k, int m) {
+        uint8_t *matrix;
+        int i, j;
+
+        gf_init();
+        matrix = malloc(m * k);
+        if (matrix == NULL) {
+                return NULL;
+        }
+        for (i = 0; i < m; i++) {
+                for (j = 0; j < k; j++) {
+                        matrix[i * k + j] = gf_inv((k + i) ^ j);
+                }
+        }
+        return matrix;
+}
+
+void ec_encode(int k, int m, uint8_t *matrix, uint8_t **data, uint8_t **parity,
+                size_t len) {
+        size_t off, n;
+        int i, j;
+
+        for (off = 0; off < len; off += n) {
+                n = len - off < EC_BLOCK ? len - off : EC_BLOCK;
+                for (i = 0; i < m; i++) {
+                        memset(parity[i] + off, 0, n);
+                        for (j = 0; j < k; j++) {
+                                gf_region_mul_add(matrix[i * k + j],
+                                                data[j] + off, parity[i] + off, n);
+                        }
+                }
+        }
+}
+
+// chunks holds k + m buffers of len bytes, present tells which of them
+// hold valid data. Rebuilds the missing data chunks from the first k
+// present ones; missing parity is left alone. Returns -EIO if fewer than k
+// chunks are present.
+int ec_decode(int k, int m, uint8_t *matrix, uint8_t **chunks, int *present,
+                size_t len) {
+        uint8_t a[EC_MAX_CHUNKS * EC_MAX_CHUNKS], inv[EC_MAX_CHUNKS * EC_MAX_CHUNKS];
+        int rows[EC_MAX_CHUNKS];
+        int i, j, r, nr = 0, missing = 0;
+        size_t off, n;
+
+        for (i = 0; i < k + m && nr < k; i++) {
+                if (present[i]) {
+                        rows[nr++] = i;
+                }
+        }
+        if (nr < k) {
+                return -EIO;
+        }
+        for (j = 0; j < k; j++) {
+                missing += !present[j];
+        }
+        if (missing == 0) {
+                return 0;
+        }
+
+        // The rows of the generator matrix, identity on top of the parity
+        // matrix, that produced the chunks we have
+        for (r = 0; r < k; r++) {
+                for (j = 0; j < k; j++) {
+                        if (rows[r] < k) {
+                                a[r * k + j] = rows[r] == j;
+                        } else {
+                                a[r * k + j] = matrix[(rows[r] - k) * k + j];
+                        }
+                }
+        }
+        if (gf_invert_matrix(a, inv, k) < 0) {
+                fprintf(stderr, "BUG: erasure code matrix is singular\n");
+                return -EIO;
+        }
+
+        for (off = 0; off < len; off += n) {
+                n = len - off < EC_BLOCK ? len - off : EC_BLOCK;
+                for (j = 0; j < k; j++) {
+                        if (present[j]) {
+                                continue;
+                        }
+                        memset(chunks[j] + off, 0, n);
+                        for (r = 0; r < k; r++) {
+                                gf_region_mul_add(inv[j * k + r],
+                                                chunks[rows[r]] + off,
+                                                chunks[j] + off, n);
+                        }
+                }
+        }
+        return 0;
+}
+
+void ec_fail_server(struct ec_volume *vol, int i) {
+        pthread_mutex_lock(&vol->mutex);
+        if (!vol->failed[i]) {
+                fprintf(stderr, "Erasure coded server %d failed\n", i);
+        }
+        vol->failed[i] = 1;
+        pthread_mutex_unlock(&vol->mutex);
+}
+
+static int ec_server_failed(struct ec_volume *vol, int i) {
+        int failed;
+
+        pthread_mutex_lock(&vol->mutex);
+        failed = vol->failed[i];
+        pthread_mutex_unlock(&vol->mutex);
+        return failed;
+}
+
+static void ec_io_done(void *data, int rc) {
+        struct ec_io *io = data;
+        struct ec_batch *b = io->batch;
+
+        pthread_mutex_lock(&b->mutex);
+        b->rc[io->server] = rc;
+        b->pending--;
+        if (b->pending == 0) {
+                pthread_cond_signal(&b->cond);
+        }
+        pthread_mutex_unlock(&b->mutex);
+}
+
+static void ec_submit(struct ec_volume *vol, struct ec_batch *b, struct ec_io *io,
+                uint32_t type, void *buf, size_t len, off_t offset) {
+        int rc;
+
+        pthread_mutex_lock(&b->mutex);
+        b->pending++;
+        pthread_mutex_unlock(&b->mutex);
+
+        rc = submit_request(vol->conns[io->server], type, 0, buf, len, offset,
+                        PriorityDefault, ec_io_done, io, NULL);
+        if (rc < 0) {
+                ec_io_done(io, rc);
+        }
+}
+
+static void ec_wait(struct ec_batch *b) {
+        pthread_mutex_lock(&b->mutex);
+        while (b->pending > 0) {
+                pthread_cond_wait(&b->cond, &b->mutex);
+        }
+        pthread_mutex_unlock(&b->mutex);
+}
+
+static void ec_free_chunks(struct ec_volume *vol, uint8_t **bufs, size_t len) {
+        int i;
+
+        for (i = 0; i < vol->k + vol->m; i++) {
+                if (bufs[i] != NULL) {
+                        client_free_buffer(vol->conns[i], bufs[i], len);
+                }
+        }
+}
+
+// Writes n whole stripes from stripe s0 on. Servers get their chunks of
+// all stripes in one request, so each server's chunks are gathered into a
+// buffer of its own and coded in one go.
+static int ec_write_stripes(struct ec_volume *vol, uint8_t *src, uint64_t s0,
+                uint64_t n) {
+        struct ec_batch b;
+        struct ec_io ios[EC_MAX_CHUNKS];
+        uint8_t *bufs[EC_MAX_CHUNKS] = { NULL };
+        size_t chunk = vol->chunk_size, len = n * chunk;
+        uint64_t t;
+        int i, j, ok = 0, rc = 0;
+
+        for (i = 0; i < vol->k + vol->m; i++) {
+                bufs[i] = client_alloc_buffer(vol->conns[i], len);
+                if (bufs[i] == NULL) {
+                        rc = -ENOMEM;
+                        goto out;
+                }
+        }
+        for (t = 0; t < n; t++) {
+                for (j = 0; j < vol->k; j++) {
+                        memcpy(bufs[j] + t * chunk,
+                                        src + (t * vol->k + j) * chunk, chunk);
+                }
+        }
+        ec_encode(vol->k, vol->m, vol->parity_matrix, bufs, bufs + vol->k, len);
+
+        pthread_mutex_init(&b.mutex, NULL);
+        pthread_cond_init(&b.cond, NULL);
+        b.pending = 0;
+        for (i = 0; i < vol->k + vol->m; i++) {
+                ios[i].batch = &b;
+                ios[i].server = i;
+                b.rc[i] = -ENODEV;
+                if (!ec_server_failed(vol, i)) {
+                        ec_submit(vol, &b, &ios[i], TypeWrite, bufs[i], len,
+                                        s0 * chunk);
+                }
+        }
+        ec_wait(&b);
+        pthread_cond_destroy(&b.cond);
+        pthread_mutex_destroy(&b.mutex);
+
+        // Any k chunks are enough to read the stripes back
+        for (i = 0; i < vol->k + vol->m; i++) {
+                if (b.rc[i] == 0) {
+                        ok++;
+                } else if (b.rc[i] != -ENODEV) {
+                        ec_fail_server(vol, i);
+                }
+        }
+        rc = ok >= vol->k ? 0 : -EIO;
+out:
+        ec_free_chunks(vol, bufs, len);
+        return rc;
+}
+
+// Reads n whole stripes from stripe s0 on. Data servers are asked first;
+// for every one that failed, a parity server is read instead and the
+// missing data is decoded.
+static int ec_read_stripes(struct ec_volume *vol, uint8_t *dst, uint64_t s0,
+                uint64_t n) {
+        struct ec_batch b;
+        struct ec_io ios[EC_MAX_CHUNKS];
+        uint8_t *bufs[EC_MAX_CHUNKS] = { NULL };
+        int present[EC_MAX_CHUNKS] = { 0 };
+        size_t chunk = vol->chunk_size, len = n * chunk;
+        uint64_t t;
+        int i, j, have = 0, asked, rc = 0;
+
+        pthread_mutex_init(&b.mutex, NULL);
+        pthread_cond_init(&b.cond, NULL);
+        b.pending = 0;
+
+        // Every round either gets k chunks or loses a server for good, so
+        // this ends
+        while (have < vol->k) {
+                asked = 0;
+                for (i = 0; i < vol->k + vol->m && have + asked < vol->k; i++) {
+                        if (present[i] || ec_server_failed(vol, i)) {
+                                continue;
+                        }
+                        if (bufs[i] == NULL) {
+                                bufs[i] = client_alloc_buffer(vol->conns[i], len);
+                                if (bufs[i] == NULL) {
+                                        rc = -ENOMEM;
+                                        goto out;
+                                }
+                        }
+                        ios[i].batch = &b;
+                        ios[i].server = i;
+                        b.rc[i] = 0;
+                        ec_submit(vol, &b, &ios[i], TypeRead, bufs[i], len,
+                                        s0 * chunk);
+                        present[i] = -1;
+                        asked++;
+                }
+                if (asked == 0) {
+                        rc = -EIO;
+                        goto out;
+                }
+                ec_wait(&b);
+                for (i = 0; i < vol->k + vol->m; i++) {
+                        if (present[i] != -1) {
+                                continue;
+                        }
+                        if (b.rc[i] < 0) {
+                                ec_fail_server(vol, i);
+                                present[i] = 0;
+                        } else {
+                                present[i] = 1;
+                                have++;
+                        }
+                }
+        }
+
+        for (j = 0; j < vol->k; j++) {
+                if (bufs[j] == NULL) {
+                        bufs[j] = client_alloc_buffer(vol->conns[j], len);
+                        if (bufs[j] == NULL) {
+                                rc = -ENOMEM;
+                                goto out;
+                        }
+                }
+        }
+        rc = ec_decode(vol->k, vol->m, vol->parity_matrix, bufs, present, len);
+        if (rc < 0) {
+                goto out;
+        }
+        for (t = 0; t < n; t++) {
+                for (j = 0; j < vol->k; j++) {
+                        memcpy(dst + (t * vol->k + j) * chunk,
+                                        bufs[j] + t * chunk, chunk);
+                }
+        }
+out:
+        pthread_cond_destroy(&b.cond);
+        pthread_mutex_destroy(&b.mutex);
+        ec_free_chunks(vol, bufs, len);
+        return rc;
+}
+
+int ec_read_at(struct ec_volume *vol, void *buf, size_t count, off_t offset) {
+        uint64_t stripe = (uint64_t)vol->k * vol->chunk_size;
+        uint64_t s0 = offset / stripe;
+        uint64_t n = (offset + count + stripe - 1) / stripe - s0;
+        uint8_t *tmp;
+        int rc;
+
+        if (offset % stripe == 0 && count % stripe == 0) {
+                return ec_read_stripes(vol, buf, s0, n);
+        }
+        tmp = malloc(n * stripe);
+        if (tmp == NULL) {
+                return -ENOMEM;
+        }
+        rc = ec_read_stripes(vol, tmp, s0, n);
+        if (rc == 0) {
+                memcpy(buf, tmp + (offset - s0 * stripe), count);
+        }
+        free(tmp);
+        return rc;
+}
+
+// Writes that don't cover whole stripes read the rest of the stripes first.
+// That read-modify-write isn't atomic, so the caller must not overlap it
+// with other writes to the same stripes.
+int ec_write_at(struct ec_volume *vol, void *buf, size_t count, off_t offset) {
+        uint64_t stripe = (uint64_t)vol->k * vol->chunk_size;
+        uint64_t s0 = offset / stripe;
+        uint64_t n = (offset + count + stripe - 1) / stripe - s0;
+        uint8_t *tmp;
+        int rc;
+
+        if (offset % stripe == 0 && count % stripe == 0) {
+                return ec_write_stripes(vol, buf, s0, n);
+        }
+        tmp = malloc(n * stripe);
+        if (tmp == NULL) {
+                return -ENOMEM;
+        }
+        rc = ec_read_stripes(vol, tmp, s0, n);
+        if (rc == 0) {
+                memcpy(tmp + (offset - s0 * stripe), buf, count);
+                rc = ec_write_stripes(vol, tmp, s0, n);
+        }
+        free(tmp);
+        return rc;
+}
+
+// The connections must have their response processing started, and stay
+// owned by the caller: k data servers followed by m parity servers
+struct ec_volume *new_ec_volume(struct client_connection **conns, int k, int m,
+                uint32_t chunk_size) {
+        struct ec_volume *vol;
+        int i;
+
+        if (k <= 0 || m < 0 || k + m > EC_MAX_CHUNKS || chunk_size == 0) {
+                fprintf(stderr, "Invalid erasure code %d+%d\n", k, m);
+                return NULL;
+        }
+        vol = calloc(1, sizeof(struct ec_volume));
+        if (vol == NULL) {
+                perror("cannot allocate memory for erasure coded volume");
+                return NULL;
+        }
+        vol->parity_matrix = ec_parity_matrix(k, m);
+        if (vol->parity_matrix == NULL) {
+                perror("cannot allocate memory for erasure coded volume");
+                free(vol);
+                return NULL;
+        }
+        vol->k = k;
+        vol->m = m;
+        vol->chunk_size = chunk_size;
+        for (i = 0; i < k + m; i++) {
+                vol->conns[i] = conns[i];
+        }
+        pthread_mutex_init(&vol->mutex, NULL);
+        return vol;
+}
+
+void free_ec_volume(struct ec_volume *vol) {
+        pthread_mutex_destroy(&vol->mutex);
+        free(vol->parity_matrix);
+        free(vol);
+}
@@ -0,0 +1,43 @@
+#ifndef LONGHORN_RPC_EC_HEADER
+#define LONGHORN_RPC_EC_HEADER
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+struct client_connection;
+
+#define EC_MAX_CHUNKS           32
+#define DEFAULT_EC_CHUNK_SIZE   4096
+
+// A volume striped over k data and m parity servers. Stripe s holds
+// k * chunk_size bytes of the volume from offset s * k * chunk_size: server
+// j < k stores data chunk j of it, server k + i stores parity chunk i, all
+// at offset s * chunk_size. Parity comes from a Cauchy matrix, so any k of
+// the k + m chunks rebuild the stripe.
+struct ec_volume {
+        int k;
+        int m;
+        uint32_t chunk_size;
+        uint8_t *parity_matrix;         // m rows of k coefficients
+
+        struct client_connection *conns[EC_MAX_CHUNKS];
+        // Servers that failed a request, no longer used. Protected by mutex.
+        int failed[EC_MAX_CHUNKS];
+        pthread_mutex_t mutex;
+};
+
+struct ec_volume *new_ec_volume(struct client_connection **conns, int k, int m,
+                uint32_t chunk_size);
+void free_ec_volume(struct ec_volume *vol);
+int ec_write_at(struct ec_volume *vol, void *buf, size_t count, off_t offset);
+int ec_read_at(struct ec_volume *vol, void *buf, size_t count, off_t offset);
+void ec_fail_server(struct ec_volume *vol, int i);
+
+uint8_t *ec_parity_matrix(int k, int m);
+void ec_encode(int k, int m, uint8_t *matrix, uint8_t **data, uint8_t **parity,
+                size_t len);
+int ec_decode(int k, int m, uint8_t *matrix, uint8_t **chunks, int *present,
+                size_t len);
+
+#endif
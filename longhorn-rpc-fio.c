@@ -0,0 +1,311 @@
+// External fio ioengine on top of the client library. Every fio job gets
+// its own connection, each io_u goes out through submit_request() right
+// away, so iodepth is the number of requests actually in flight. Build
+// against a configured fio source tree with "make fio-engine FIO_SRC=..."
+// and use it as:
+//
+//   fio --ioengine=external:./longhorn-rpc-fio.so --socket=/tmp/rpc.sock
+//       --filename=lh --size=100m --rw=randrw --bs=4k --iodepth=16 --name=lh
+//
+// size must fit in the server's volume. fsync completes at once, the
+// protocol has nothing to flush; trims are refused.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "fio.h"
+#include "optgroup.h"
+
+#include "longhorn-rpc-client.h"
+
+struct fio_lh_options {
+        void *pad;      // fio keeps its own pointer here
+        char *socket;
+        unsigned int volume;
+};
+
+static struct fio_option options[] = {
+        {
+                .name           = "socket",
+                .lname          = "Longhorn RPC socket",
+                .type           = FIO_OPT_STR_STORE,
+                .off1           = offsetof(struct fio_lh_options, socket),
+                .def            = "/tmp/rpc.sock",
+                .help           = "Unix socket the server listens on",
+                .category       = FIO_OPT_C_ENGINE,
+                .group          = FIO_OPT_G_INVALID,
+        },
+        {
+                .name           = "volume",
+                .lname          = "Longhorn RPC volume",
+                .type           = FIO_OPT_INT,
+                .off1           = offsetof(struct fio_lh_options, volume),
+                .minval         = 0,
+                .maxval         = 65535,
+                .def            = "0",
+                .help           = "Volume of the server to run against",
+                .category       = FIO_OPT_C_ENGINE,
+                .group          = FIO_OPT_G_INVALID,
+        },
+        {
+                .name           = NULL,
+        },
+};
+
+// Completions are queued by the response thread and handed to fio by
+// getevents(), in the order they happened
+struct fio_lh_data {
+        struct client_connection *conn;
+        uint16_t volume;
+
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+        struct io_u **completed;
+        unsigned int nr_completed;
+
+        struct io_u **events;
+        unsigned int depth;
+};
+
+// Per io_u, so the done callback finds its way back
+struct fio_lh_request {
+        struct fio_lh_data *ld;
+        struct io_u *io_u;
+};
+
+static void fio_lh_done(void *data, int rc) {
+        struct fio_lh_request *r = data;
+        struct fio_lh_data *ld = r->ld;
+
+        r->io_u->error = rc < 0 ? -rc : 0;
+        r->io_u->resid = rc < 0 ? r->io_u->xfer_buflen : 0;
+
+        pthread_mutex_lock(&ld->mutex);
+        ld->completed[ld->nr_completed++] = r->io_u;
+        pthread_cond_signal(&ld->cond);
+        pthread_mutex_unlock(&ld->mutex);
+}
+
+static enum fio_q_status fio_lh_queue(struct thread_data *td,
+                struct io_u *io_u) {
+        struct fio_lh_data *ld = td->io_ops_data;
+        uint32_t type;
+        int rc;
+
+        fio_ro_check(td, io_u);
+
+        switch (io_u->ddir) {
+        case DDIR_READ:
+                type = TypeRead;
+                break;
+        case DDIR_WRITE:
+                type = TypeWrite;
+                break;
+        case DDIR_SYNC:
+        case DDIR_DATASYNC:
+                // Writes are done once acknowledged
+                io_u->error = 0;
+                return FIO_Q_COMPLETED;
+        default:
+                io_u->error = EOPNOTSUPP;
+                return FIO_Q_COMPLETED;
+        }
+
+        rc = submit_request(ld->conn, type, ld->volume, io_u->xfer_buf,
+                        io_u->xfer_buflen, io_u->offset, PriorityDefault,
+                        fio_lh_done, io_u->engine_data, NULL);
+        if (rc < 0) {
+                io_u->error = -rc;
+                return FIO_Q_COMPLETED;
+        }
+        return FIO_Q_QUEUED;
+}
+
+// Requests are on the wire once queue() returns
+static int fio_lh_commit(struct thread_data *td) {
+        return 0;
+}
+
+static int fio_lh_getevents(struct thread_data *td, unsigned int min,
+                unsigned int max, const struct timespec *t) {
+        struct fio_lh_data *ld = td->io_ops_data;
+        struct timespec deadline;
+        unsigned int n;
+        int rc = 0;
+
+        if (t != NULL) {
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_sec += t->tv_sec;
+                deadline.tv_nsec += t->tv_nsec;
+                if (deadline.tv_nsec >= 1000000000L) {
+                        deadline.tv_sec++;
+                        deadline.tv_nsec -= 1000000000L;
+                }
+        }
+
+        pthread_mutex_lock(&ld->mutex);
+        while (ld->nr_completed < min && rc != ETIMEDOUT) {
+                if (t != NULL) {
+                        rc = pthread_cond_timedwait(&ld->cond, &ld->mutex,
+                                        &deadline);
+                } else {
+                        pthread_cond_wait(&ld->cond, &ld->mutex);
+                }
+        }
+        n = ld->nr_completed < max ? ld->nr_completed : max;
+        memcpy(ld->events, ld->completed, n * sizeof(struct io_u *));
+        ld->nr_completed -= n;
+        memmove(ld->completed, ld->completed + n,
+                        ld->nr_completed * sizeof(struct io_u *));
+        pthread_mutex_unlock(&ld->mutex);
+        return n;
+}
+
+static struct io_u *fio_lh_event(struct thread_data *td, int event) {
+        struct fio_lh_data *ld = td->io_ops_data;
+
+        return ld->events[event];
+}
+
+// new_client_connection() exits the process when it can't connect, a job
+// must fail on its own instead
+static struct client_connection *fio_lh_connect(char *path) {
+        struct sockaddr_un addr;
+        struct client_connection *conn;
+        int fd;
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(path) >= sizeof(addr.sun_path)) {
+                log_err("longhorn-rpc: socket path %s is too long\n", path);
+                return NULL;
+        }
+        strcpy(addr.sun_path, path);
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+                log_err("longhorn-rpc: cannot create socket: %s\n",
+                                strerror(errno));
+                return NULL;
+        }
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+                log_err("longhorn-rpc: cannot connect to %s: %s\n", path,
+                                strerror(errno));
+                close(fd);
+                return NULL;
+        }
+        // Closes fd if the handshake fails
+        conn = new_client_connection_fd(fd);
+        if (conn == NULL) {
+                log_err("longhorn-rpc: handshake with %s failed\n", path);
+        }
+        return conn;
+}
+
+static int fio_lh_init(struct thread_data *td) {
+        struct fio_lh_options *o = td->eo;
+        struct fio_lh_data *ld;
+
+        ld = calloc(1, sizeof(struct fio_lh_data));
+        if (ld == NULL) {
+                log_err("longhorn-rpc: cannot allocate engine data\n");
+                return 1;
+        }
+        ld->depth = td->o.iodepth;
+        ld->completed = calloc(ld->depth, sizeof(struct io_u *));
+        ld->events = calloc(ld->depth, sizeof(struct io_u *));
+        if (ld->completed == NULL || ld->events == NULL) {
+                log_err("longhorn-rpc: cannot allocate engine data\n");
+                goto err;
+        }
+        pthread_mutex_init(&ld->mutex, NULL);
+        pthread_cond_init(&ld->cond, NULL);
+        ld->volume = o->volume;
+
+        ld->conn = fio_lh_connect(o->socket);
+        if (ld->conn == NULL) {
+                goto err;
+        }
+        if (ld->volume != 0 && !(ld->conn->features & FeatureVolumes)) {
+                log_err("longhorn-rpc: server doesn't support volumes\n");
+                shutdown_client_connection(ld->conn);
+                goto err;
+        }
+        start_response_processing(ld->conn);
+        td->io_ops_data = ld;
+        return 0;
+err:
+        free(ld->completed);
+        free(ld->events);
+        free(ld);
+        return 1;
+}
+
+static void fio_lh_cleanup(struct thread_data *td) {
+        struct fio_lh_data *ld = td->io_ops_data;
+
+        if (ld == NULL) {
+                return;
+        }
+        shutdown_client_connection(ld->conn);
+        pthread_mutex_destroy(&ld->mutex);
+        pthread_cond_destroy(&ld->cond);
+        free(ld->completed);
+        free(ld->events);
+        free(ld);
+        td->io_ops_data = NULL;
+}
+
+static int fio_lh_io_u_init(struct thread_data *td, struct io_u *io_u) {
+        struct fio_lh_request *r = malloc(sizeof(struct fio_lh_request));
+
+        if (r == NULL) {
+                return 1;
+        }
+        r->ld = td->io_ops_data;
+        r->io_u = io_u;
+        io_u->engine_data = r;
+        return 0;
+}
+
+static void fio_lh_io_u_free(struct thread_data *td, struct io_u *io_u) {
+        free(io_u->engine_data);
+        io_u->engine_data = NULL;
+}
+
+// There is no file, fio only needs offsets within size
+static int fio_lh_open_file(struct thread_data *td, struct fio_file *f) {
+        return 0;
+}
+
+static int fio_lh_close_file(struct thread_data *td, struct fio_file *f) {
+        return 0;
+}
+
+// Looked up by name when fio loads the engine, everything else in the
+// library stays hidden so it can't clash with fio's own symbols
+__attribute__((visibility("default")))
+struct ioengine_ops ioengine = {
+        .name                   = "longhorn-rpc",
+        .version                = FIO_IOOPS_VERSION,
+        .flags                  = FIO_DISKLESSIO | FIO_NODISKUTIL,
+        .init                   = fio_lh_init,
+        .queue                  = fio_lh_queue,
+        .commit                 = fio_lh_commit,
+        .getevents              = fio_lh_getevents,
+        .event                  = fio_lh_event,
+        .cleanup                = fio_lh_cleanup,
+        .io_u_init              = fio_lh_io_u_init,
+        .io_u_free              = fio_lh_io_u_free,
+        .open_file              = fio_lh_open_file,
+        .close_file             = fio_lh_close_file,
+        .options                = options,
+        .option_struct_size     = sizeof(struct fio_lh_options),
+};
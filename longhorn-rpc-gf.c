@@ -0,0 +1,304 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GF_X86
+#endif
+
+#include "longhorn-rpc-gf.h"
+
+#define GF_POLY 0x11d
+
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+static uint8_t gf_mul_table[256][256];
+
+static pthread_once_t gf_once = PTHREAD_ONCE_INIT;
+
+typedef void (*region_fn)(uint8_t c, const uint8_t *src, uint8_t *dst,
+                size_t len);
+typedef void (*xor_fn)(const uint8_t *src, uint8_t *dst, size_t len);
+static region_fn region_mul_add;
+// c == 1, a plain XOR, with the same instruction set
+static xor_fn region_xor;
+static enum gf_kernel current_kernel;
+
+static void region_mul_add_scalar(uint8_t c, const uint8_t *src, uint8_t *dst,
+                size_t len) {
+        const uint8_t *row = gf_mul_table[c];
+        size_t i;
+
+        for (i = 0; i < len; i++) {
+                dst[i] ^= row[src[i]];
+        }
+}
+
+static void region_xor_scalar(const uint8_t *src, uint8_t *dst, size_t len) {
+        size_t i;
+
+        for (i = 0; i < len; i++) {
+                dst[i] ^= src[i];
+        }
+}
+
+#ifdef GF_X86
+// c * x splits into c * (low nibble of x) ^ c * (high nibble of x << 4),
+// two 16 entry tables that fit a register and are looked up with a byte
+// shuffle
+static void nibble_tables(uint8_t c, uint8_t *lo, uint8_t *hi) {
+        int i;
+
+        for (i = 0; i < 16; i++) {
+                lo[i] = gf_mul_table[c][i];
+                hi[i] = gf_mul_table[c][i << 4];
+        }
+}
+
+__attribute__((target("ssse3")))
+static void region_mul_add_ssse3(uint8_t c, const uint8_t *src, uint8_t *dst,
+                size_t len) {
+        uint8_t lo_tbl[16], hi_tbl[16];
+        __m128i lo, hi, mask, s, l, h;
+        size_t i;
+
+        nibble_tables(c, lo_tbl, hi_tbl);
+        lo = _mm_loadu_si128((const __m128i *)lo_tbl);
+        hi = _mm_loadu_si128((const __m128i *)hi_tbl);
+        mask = _mm_set1_epi8(0x0f);
+
+        for (i = 0; i + 16 <= len; i += 16) {
+                s = _mm_loadu_si128((const __m128i *)(src + i));
+                l = _mm_shuffle_epi8(lo, _mm_and_si128(s, mask));
+                h = _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(s, 4), mask));
+                s = _mm_loadu_si128((const __m128i *)(dst + i));
+                _mm_storeu_si128((__m128i *)(dst + i),
+                                _mm_xor_si128(s, _mm_xor_si128(l, h)));
+        }
+        region_mul_add_scalar(c, src + i, dst + i, len - i);
+}
+
+__attribute__((target("ssse3")))
+static void region_xor_ssse3(const uint8_t *src, uint8_t *dst, size_t len) {
+        __m128i s, d;
+        size_t i;
+
+        for (i = 0; i + 16 <= len; i += 16) {
+                s = _mm_loadu_si128((const __m128i *)(src + i));
+                d = _mm_loadu_si128((const __m128i *)(dst + i));
+                _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(s, d));
+        }
+        region_xor_scalar(src + i, dst + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void region_mul_add_avx2(uint8_t c, const uint8_t *src, uint8_t *dst,
+                size_t len) {
+        uint8_t lo_tbl[16], hi_tbl[16];
+        __m256i lo, hi, mask, s, l, h;
+        size_t i;
+
+        nibble_tables(c, lo_tbl, hi_tbl);
+        // vpshufb looks up within each 128 bit lane, so both lanes get the
+        // table
+        lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)lo_tbl));
+        hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)hi_tbl));
+        mask = _mm256_set1_epi8(0x0f);
+
+        for (i = 0; i + 32 <= len; i += 32) {
+                s = _mm256_loadu_si256((const __m256i *)(src + i));
+                l = _mm256_shuffle_epi8(lo, _mm256_and_si256(s, mask));
+                h = _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask));
+                s = _mm256_loadu_si256((const __m256i *)(dst + i));
+                _mm256_storeu_si256((__m256i *)(dst + i),
+                                _mm256_xor_si256(s, _mm256_xor_si256(l, h)));
+        }
+        region_mul_add_scalar(c, src + i, dst + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void region_xor_avx2(const uint8_t *src, uint8_t *dst, size_t len) {
+        __m256i s, d;
+        size_t i;
+
+        for (i = 0; i + 32 <= len; i += 32) {
+                s = _mm256_loadu_si256((const __m256i *)(src + i));
+                d = _mm256_loadu_si256((const __m256i *)(dst + i));
+                _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(s, d));
+        }
+        region_xor_scalar(src + i, dst + i, len - i);
+}
+#endif
+
+static void gf_setup() {
+        int i, j, x = 1;
+
+        for (i = 0; i < 255; i++) {
+                gf_exp[i] = x;
+                gf_log[x] = i;
+                x <<= 1;
+                if (x & 0x100) {
+                        x ^= GF_POLY;
+                }
+        }
+        // Doubled so a product never needs the modulo
+        for (i = 255; i < 512; i++) {
+                gf_exp[i] = gf_exp[i - 255];
+        }
+        for (i = 0; i < 256; i++) {
+                for (j = 0; j < 256; j++) {
+                        gf_mul_table[i][j] = (i == 0 || j == 0) ? 0 :
+                                gf_exp[gf_log[i] + gf_log[j]];
+                }
+        }
+
+        region_mul_add = region_mul_add_scalar;
+        region_xor = region_xor_scalar;
+        current_kernel = GfScalar;
+#ifdef GF_X86
+        if (gf_kernel_supported(GfAVX2)) {
+                region_mul_add = region_mul_add_avx2;
+                region_xor = region_xor_avx2;
+                current_kernel = GfAVX2;
+        } else if (gf_kernel_supported(GfSSSE3)) {
+                region_mul_add = region_mul_add_ssse3;
+                region_xor = region_xor_ssse3;
+                current_kernel = GfSSSE3;
+        }
+#endif
+}
+
+// Safe to call any number of times, from any thread
+void gf_init() {
+        pthread_once(&gf_once, gf_setup);
+}
+
+uint8_t gf_mul(uint8_t a, uint8_t b) {
+        return gf_mul_table[a][b];
+}
+
+uint8_t gf_inv(uint8_t a) {
+        if (a == 0) {
+                return 0;
+        }
+        return gf_exp[255 - gf_log[a]];
+}
+
+// Gauss-Jordan elimination of the n x n matrix in, which is destroyed.
+// Returns -EINVAL if it is singular.
+int gf_invert_matrix(uint8_t *in, uint8_t *out, int n) {
+        int i, j, r;
+        uint8_t t;
+
+        memset(out, 0, n * n);
+        for (i = 0; i < n; i++) {
+                out[i * n + i] = 1;
+        }
+
+        for (i = 0; i < n; i++) {
+                if (in[i * n + i] == 0) {
+                        for (r = i + 1; r < n && in[r * n + i] == 0; r++) {
+                        }
+                        if (r == n) {
+                                return -EINVAL;
+                        }
+                        for (j = 0; j < n; j++) {
+                                t = in[i * n + j];
+                                in[i * n + j] = in[r * n + j];
+                                in[r * n + j] = t;
+                                t = out[i * n + j];
+                                out[i * n + j] = out[r * n + j];
+                                out[r * n + j] = t;
+                        }
+                }
+
+                t = gf_inv(in[i * n + i]);
+                for (j = 0; j < n; j++) {
+                        in[i * n + j] = gf_mul(in[i * n + j], t);
+                        out[i * n + j] = gf_mul(out[i * n + j], t);
+                }
+
+                for (r = 0; r < n; r++) {
+                        if (r == i || in[r * n + i] == 0) {
+                                continue;
+                        }
+                        t = in[r * n + i];
+                        for (j = 0; j < n; j++) {
+                                in[r * n + j] ^= gf_mul(in[i * n + j], t);
+                                out[r * n + j] ^= gf_mul(out[i * n + j], t);
+                        }
+                }
+        }
+        return 0;
+}
+
+// dst ^= c * src
+void gf_region_mul_add(uint8_t c, const void *src, void *dst, size_t len) {
+        if (c == 0) {
+                return;
+        }
+        if (c == 1) {
+                region_xor(src, dst, len);
+                return;
+        }
+        region_mul_add(c, src, dst, len);
+}
+
+int gf_kernel_supported(enum gf_kernel kernel) {
+        switch (kernel) {
+        case GfScalar:
+                return 1;
+#ifdef GF_X86
+        case GfSSSE3:
+                return __builtin_cpu_supports("ssse3");
+        case GfAVX2:
+                return __builtin_cpu_supports("avx2");
+#endif
+        default:
+                return 0;
+        }
+}
+
+// For benchmarks and testing, the best supported kernel is used by default
+int gf_set_kernel(enum gf_kernel kernel) {
+        gf_init();
+        if (!gf_kernel_supported(kernel)) {
+                return -ENOTSUP;
+        }
+        switch (kernel) {
+#ifdef GF_X86
+        case GfSSSE3:
+                region_mul_add = region_mul_add_ssse3;
+                region_xor = region_xor_ssse3;
+                break;
+        case GfAVX2:
+                region_mul_add = region_mul_add_avx2;
+                region_xor = region_xor_avx2;
+                break;
+#endif
+        default:
+                region_mul_add = region_mul_add_scalar;
+                region_xor = region_xor_scalar;
+                break;
+        }
+        current_kernel = kernel;
+        return 0;
+}
+
+enum gf_kernel gf_get_kernel() {
+        gf_init();
+        return current_kernel;
+}
+
+const char *gf_kernel_name(enum gf_kernel kernel) {
+        switch (kernel) {
+        case GfSSSE3:
+                return "ssse3";
+        case GfAVX2:
+                return "avx2";
+        default:
+                return "scalar";
+        }
+}
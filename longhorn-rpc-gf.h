@@ -0,0 +1,30 @@
+#ifndef LONGHORN_RPC_GF_HEADER
+#define LONGHORN_RPC_GF_HEADER
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Arithmetic in GF(2^8) with the polynomial x^8 + x^4 + x^3 + x^2 + 1
+// (0x11d), as used by Reed-Solomon codes. Addition is xor.
+
+// Implementations of the region kernels, picked at run time
+enum gf_kernel {
+        GfScalar,       // table lookups, works everywhere
+        GfSSSE3,        // 16 bytes at a time with pshufb
+        GfAVX2,         // 32 bytes at a time with vpshufb
+        NR_GF_KERNELS
+};
+
+void gf_init();
+uint8_t gf_mul(uint8_t a, uint8_t b);
+uint8_t gf_inv(uint8_t a);
+int gf_invert_matrix(uint8_t *in, uint8_t *out, int n);
+
+void gf_region_mul_add(uint8_t c, const void *src, void *dst, size_t len);
+
+int gf_kernel_supported(enum gf_kernel kernel);
+int gf_set_kernel(enum gf_kernel kernel);
+enum gf_kernel gf_get_kernel();
+const char *gf_kernel_name(enum gf_kernel kernel);
+
+#endif
@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "longhorn-rpc-histogram.h"
+
+// Slot of the calling thread, handed out round-robin on first use
+static __thread int hist_slot = -1;
+static unsigned int next_hist_slot;
+
+static int hist_index(uint64_t v) {
+        int shift;
+
+        if (v < (1 << HIST_SUB_BITS)) {
+                return v;
+        }
+        shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+        if (shift >= HIST_MAX_BITS - HIST_SUB_BITS) {
+                return HIST_BUCKETS - 1;
+        }
+        return ((shift + 1) << HIST_SUB_BITS) + (v >> shift) - (1 << HIST_SUB_BITS);
+}
+
+// Middle of the bucket
+static uint64_t hist_value(int index) {
+        int shift;
+
+        if (index < (1 << HIST_SUB_BITS)) {
+                return index;
+        }
+        shift = (index >> HIST_SUB_BITS) - 1;
+        return ((uint64_t)((index & ((1 << HIST_SUB_BITS) - 1)) +
+                                (1 << HIST_SUB_BITS)) << shift) + ((1ULL << shift) >> 1);
+}
+
+struct histogram *new_histogram() {
+        struct histogram *h = calloc(1, sizeof(struct histogram));
+
+        if (h == NULL) {
+                perror("cannot allocate memory for histogram");
+                return NULL;
+        }
+        pthread_mutex_init(&h->mutex, NULL);
+        return h;
+}
+
+void free_histogram(struct histogram *h) {
+        if (h == NULL) {
+                return;
+        }
+        pthread_mutex_destroy(&h->mutex);
+        free(h);
+}
+
+// Threads only share a slot once there are more than HIST_SLOTS of them,
+// the atomics keep that correct and cost little while uncontended
+void histogram_record(struct histogram *h, uint64_t value) {
+        struct histogram_data *d;
+
+        if (hist_slot < 0) {
+                hist_slot = __atomic_fetch_add(&next_hist_slot, 1,
+                                __ATOMIC_RELAXED) % HIST_SLOTS;
+        }
+        d = &h->slots[hist_slot];
+        __atomic_fetch_add(&d->buckets[hist_index(value)], 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&d->sum, value, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&d->count, 1, __ATOMIC_RELAXED);
+}
+
+static void histogram_sum(struct histogram *h, struct histogram_data *out) {
+        int i, j;
+
+        memset(out, 0, sizeof(struct histogram_data));
+        for (i = 0; i < HIST_SLOTS; i++) {
+                struct histogram_data *d = &h->slots[i];
+
+                for (j = 0; j < HIST_BUCKETS; j++) {
+                        out->buckets[j] += __atomic_load_n(&d->buckets[j],
+                                        __ATOMIC_RELAXED);
+                }
+                out->sum += __atomic_load_n(&d->sum, __ATOMIC_RELAXED);
+                out->count += __atomic_load_n(&d->count, __ATOMIC_RELAXED);
+        }
+}
+
+// Values recorded since the last reset. Recordings racing with the
+// snapshot may be partly included, count then doesn't exactly match the
+// buckets.
+void histogram_snapshot(struct histogram *h, struct histogram_data *snap) {
+        int i;
+
+        pthread_mutex_lock(&h->mutex);
+        histogram_sum(h, snap);
+        for (i = 0; i < HIST_BUCKETS; i++) {
+                snap->buckets[i] -= h->base.buckets[i];
+        }
+        snap->sum -= h->base.sum;
+        snap->count -= h->base.count;
+        pthread_mutex_unlock(&h->mutex);
+}
+
+void histogram_reset(struct histogram *h) {
+        pthread_mutex_lock(&h->mutex);
+        histogram_sum(h, &h->base);
+        pthread_mutex_unlock(&h->mutex);
+}
+
+void histogram_add(struct histogram_data *d, uint64_t value) {
+        d->buckets[hist_index(value)]++;
+        d->sum += value;
+        d->count++;
+}
+
+void histogram_merge(struct histogram_data *to, struct histogram_data *from) {
+        int i;
+
+        for (i = 0; i < HIST_BUCKETS; i++) {
+                to->buckets[i] += from->buckets[i];
+        }
+        to->sum += from->sum;
+        to->count += from->count;
+}
+
+uint64_t histogram_percentile(struct histogram_data *d, double percentile) {
+        double target = d->count * percentile / 100;
+        uint64_t seen = 0;
+        int i;
+
+        for (i = 0; i < HIST_BUCKETS; i++) {
+                seen += d->buckets[i];
+                if (seen != 0 && seen >= target) {
+                        return hist_value(i);
+                }
+        }
+        return 0;
+}
+
+uint64_t histogram_mean(struct histogram_data *d) {
+        return d->count != 0 ? d->sum / d->count : 0;
+}
@@ -0,0 +1,46 @@
+#ifndef LONGHORN_RPC_HISTOGRAM_HEADER
+#define LONGHORN_RPC_HISTOGRAM_HEADER
+
+#include <stdint.h>
+#include <pthread.h>
+
+// Log-linear buckets: values below 32 get one bucket each, every power of
+// two above that is split into 32, so a bucket is never more than ~3%
+// wide. Values are nanoseconds, anything above 2^40 (about 18 minutes)
+// lands in the last bucket.
+#define HIST_SUB_BITS   5
+#define HIST_MAX_BITS   40
+#define HIST_BUCKETS    ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+// Recording threads are spread over this many copies of the buckets
+#define HIST_SLOTS      16
+
+struct histogram_data {
+        uint64_t count;
+        uint64_t sum;
+        uint64_t buckets[HIST_BUCKETS];
+};
+
+// Recording takes no lock: every thread adds to its own slot, and readers
+// merge the slots. Slots are big enough that threads only share a cache
+// line at their rarely used edges. A reset only moves the base snapshots
+// are taken against, so recorders never see it.
+struct histogram {
+        struct histogram_data slots[HIST_SLOTS];
+        struct histogram_data base;
+        pthread_mutex_t mutex;
+};
+
+struct histogram *new_histogram();
+void free_histogram(struct histogram *h);
+void histogram_record(struct histogram *h, uint64_t value);
+void histogram_snapshot(struct histogram *h, struct histogram_data *snap);
+void histogram_reset(struct histogram *h);
+
+// For a histogram_data only one thread writes to
+void histogram_add(struct histogram_data *d, uint64_t value);
+void histogram_merge(struct histogram_data *to, struct histogram_data *from);
+uint64_t histogram_percentile(struct histogram_data *d, double percentile);
+uint64_t histogram_mean(struct histogram_data *d);
+
+#endif
@@ -0,0 +1,357 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <endian.h>
+
+#include "longhorn-rpc-client.h"
+#include "longhorn-rpc-iotrace.h"
+#include "longhorn-rpc-histogram.h"
+#include "longhorn-rpc-pattern.h"
+
+struct iotrace_recorder *new_iotrace_recorder() {
+        struct iotrace_recorder *rec = calloc(1, sizeof(struct iotrace_recorder));
+
+        if (rec == NULL) {
+                perror("cannot allocate memory for trace recorder");
+                return NULL;
+        }
+        pthread_mutex_init(&rec->mutex, NULL);
+        return rec;
+}
+
+// Must not be recording anymore
+void free_iotrace_recorder(struct iotrace_recorder *rec) {
+        if (rec == NULL) {
+                return;
+        }
+        pthread_mutex_destroy(&rec->mutex);
+        free(rec);
+}
+
+int iotrace_start(struct iotrace_recorder *rec, char *path, uint64_t now) {
+        struct iotrace_header hdr;
+        struct timespec ts;
+        int rc = 0;
+
+        pthread_mutex_lock(&rec->mutex);
+        if (rec->f != NULL) {
+                rc = -EBUSY;
+                goto out;
+        }
+        rec->f = fopen(path, "w");
+        if (rec->f == NULL) {
+                rc = -errno;
+                perror("cannot create trace file");
+                goto out;
+        }
+        clock_gettime(CLOCK_REALTIME, &ts);
+        hdr.Magic = htole32(IOTRACE_MAGIC);
+        hdr.Version = htole32(IOTRACE_VERSION);
+        hdr.StartTime = htole64(ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+        if (fwrite(&hdr, sizeof(hdr), 1, rec->f) != 1) {
+                rc = -EIO;
+                fclose(rec->f);
+                rec->f = NULL;
+                goto out;
+        }
+        rec->start = now;
+        rec->records = 0;
+        rec->error = 0;
+out:
+        pthread_mutex_unlock(&rec->mutex);
+        return rc;
+}
+
+// Flushes and closes the trace. Returns -EIO if any record was lost.
+int iotrace_stop(struct iotrace_recorder *rec, uint64_t *records) {
+        int rc = 0;
+
+        pthread_mutex_lock(&rec->mutex);
+        if (rec->f == NULL) {
+                rc = -EINVAL;
+                goto out;
+        }
+        if (fclose(rec->f) != 0 || rec->error) {
+                rc = -EIO;
+        }
+        rec->f = NULL;
+        if (records != NULL) {
+                *records = rec->records;
+        }
+out:
+        pthread_mutex_unlock(&rec->mutex);
+        return rc;
+}
+
+void iotrace_record(struct iotrace_recorder *rec, uint64_t now, uint32_t type,
+                uint16_t volume, int64_t offset, size_t count) {
+        struct iotrace_record r;
+
+        r.Offset = htole64(offset);
+        r.Length = htole32(count);
+        r.Volume = htole16(volume);
+        r.Type = type;
+        r.Reserved = 0;
+
+        pthread_mutex_lock(&rec->mutex);
+        if (rec->f != NULL) {
+                // Requests racing to here may land slightly out of order
+                r.Time = htole64(now > rec->start ? now - rec->start : 0);
+                if (fwrite(&r, sizeof(r), 1, rec->f) != 1) {
+                        rec->error = 1;
+                } else {
+                        rec->records++;
+                }
+        }
+        pthread_mutex_unlock(&rec->mutex);
+}
+
+enum {
+        OpRead,
+        OpWrite,
+        NR_OPS,
+};
+
+static const char *op_names[NR_OPS] = { "read", "write" };
+
+struct replay_slot {
+        struct replay_run *run;
+        void *buf;
+        size_t cap;
+        int op;
+        uint32_t length;
+        int64_t offset;
+        uint64_t start;
+        struct replay_slot *next;
+};
+
+struct replay_run {
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+        struct replay_slot *free;
+        int inflight;
+
+        uint64_t ops[NR_OPS];
+        uint64_t bytes[NR_OPS];
+        uint64_t errors;
+        struct histogram_data latency[NR_OPS];
+        // How late requests went out against their recorded time
+        struct histogram_data lag;
+};
+
+static void replay_sleep_until(uint64_t ns) {
+        struct timespec ts;
+
+        ts.tv_sec = ns / 1000000000ULL;
+        ts.tv_nsec = ns % 1000000000ULL;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+        }
+}
+
+static void replay_done(void *data, int rc) {
+        struct replay_slot *s = data;
+        struct replay_run *run = s->run;
+        uint64_t end = now_ns();
+
+        pthread_mutex_lock(&run->mutex);
+        if (rc < 0) {
+                if (run->errors++ == 0) {
+                        fprintf(stderr, "Fail to replay %s of %u at %ld: %s\n",
+                                        op_names[s->op], s->length, s->offset,
+                                        strerror(-rc));
+                }
+        } else {
+                run->ops[s->op]++;
+                run->bytes[s->op] += s->length;
+                histogram_add(&run->latency[s->op], end - s->start);
+        }
+        s->next = run->free;
+        run->free = s;
+        run->inflight--;
+        pthread_cond_signal(&run->cond);
+        pthread_mutex_unlock(&run->mutex);
+}
+
+static struct replay_slot *replay_get_slot(struct replay_run *run) {
+        struct replay_slot *s;
+
+        pthread_mutex_lock(&run->mutex);
+        while (run->free == NULL) {
+                pthread_cond_wait(&run->cond, &run->mutex);
+        }
+        s = run->free;
+        run->free = s->next;
+        run->inflight++;
+        pthread_mutex_unlock(&run->mutex);
+        return s;
+}
+
+static int replay_open(char *path, FILE **f) {
+        struct iotrace_header hdr;
+
+        *f = fopen(path, "r");
+        if (*f == NULL) {
+                perror("cannot open trace file");
+                return -errno;
+        }
+        if (fread(&hdr, sizeof(hdr), 1, *f) != 1 ||
+                        le32toh(hdr.Magic) != IOTRACE_MAGIC) {
+                fprintf(stderr, "%s is not a block trace\n", path);
+                fclose(*f);
+                return -EINVAL;
+        }
+        if (le32toh(hdr.Version) != IOTRACE_VERSION) {
+                fprintf(stderr, "unsupported block trace version %u\n",
+                                le32toh(hdr.Version));
+                fclose(*f);
+                return -EINVAL;
+        }
+        return 0;
+}
+
+static void print_replay(struct replay_config *cfg, struct replay_run *run,
+                uint64_t records, double secs) {
+        struct histogram_data *h;
+        int op;
+
+        printf("Replayed %lu requests %s at depth %d, %.2f s\n", records,
+                        cfg->timing == ReplayOriginal ? "at original timing" :
+                        "as fast as possible", cfg->depth, secs);
+        for (op = 0; op < NR_OPS; op++) {
+                h = &run->latency[op];
+                if (run->ops[op] == 0) {
+                        continue;
+                }
+                printf("  %-5s %10.0f IOPS %10.2f M/s  latency us p50 %.1f "
+                                "p99 %.1f p99.9 %.1f\n", op_names[op],
+                                run->ops[op] / secs,
+                                run->bytes[op] / 1048576.0 / secs,
+                                histogram_percentile(h, 50) / 1E3,
+                                histogram_percentile(h, 99) / 1E3,
+                                histogram_percentile(h, 99.9) / 1E3);
+        }
+        if (cfg->timing == ReplayOriginal && run->lag.count != 0) {
+                printf("  late  mean %.1f us p99 %.1f us\n",
+                                histogram_mean(&run->lag) / 1E3,
+                                histogram_percentile(&run->lag, 99) / 1E3);
+        }
+        if (run->errors != 0) {
+                printf("  %lu errors\n", run->errors);
+        }
+        fflush(stdout);
+}
+
+// Reissues every request of the trace on conn, each with its recorded
+// type, volume, offset and length. Writes carry the pattern of cfg->seed.
+int run_replay(struct client_connection *conn, struct replay_config *cfg) {
+        struct replay_run *run;
+        struct replay_slot *slots, *s;
+        struct iotrace_record r;
+        uint64_t start, now, target, records = 0;
+        FILE *f;
+        int i, rc;
+
+        if (cfg->depth <= 0) {
+                return -EINVAL;
+        }
+        rc = replay_open(cfg->path, &f);
+        if (rc < 0) {
+                return rc;
+        }
+        run = calloc(1, sizeof(struct replay_run));
+        slots = calloc(cfg->depth, sizeof(struct replay_slot));
+        if (run == NULL || slots == NULL) {
+                perror("cannot allocate memory for replay");
+                free(run);
+                free(slots);
+                fclose(f);
+                return -ENOMEM;
+        }
+        pthread_mutex_init(&run->mutex, NULL);
+        pthread_cond_init(&run->cond, NULL);
+        for (i = 0; i < cfg->depth; i++) {
+                slots[i].run = run;
+                slots[i].next = run->free;
+                run->free = &slots[i];
+        }
+
+        start = now_ns();
+        while (fread(&r, sizeof(r), 1, f) == 1) {
+                if (r.Type != TypeRead && r.Type != TypeWrite) {
+                        fprintf(stderr, "Invalid request type %d in trace\n", r.Type);
+                        rc = -EINVAL;
+                        break;
+                }
+                if (le32toh(r.Length) == 0) {
+                        continue;
+                }
+                records++;
+                target = start + le64toh(r.Time);
+                if (cfg->timing == ReplayOriginal && now_ns() < target) {
+                        replay_sleep_until(target);
+                }
+
+                s = replay_get_slot(run);
+                s->op = r.Type == TypeRead ? OpRead : OpWrite;
+                s->length = le32toh(r.Length);
+                s->offset = le64toh(r.Offset);
+                if (s->cap < s->length) {
+                        free(s->buf);
+                        s->buf = malloc(s->length);
+                        s->cap = s->buf != NULL ? s->length : 0;
+                        if (s->buf == NULL) {
+                                perror("cannot allocate memory for replay");
+                                replay_done(s, -ENOMEM);
+                                rc = -ENOMEM;
+                                break;
+                        }
+                }
+                if (s->op == OpWrite) {
+                        pattern_fill(pattern_volume_seed(cfg->seed,
+                                                le16toh(r.Volume)),
+                                        s->offset, s->buf, s->length);
+                }
+
+                now = now_ns();
+                if (cfg->timing == ReplayOriginal) {
+                        histogram_add(&run->lag, now > target ? now - target : 0);
+                }
+                s->start = now;
+                rc = submit_request(conn, r.Type, le16toh(r.Volume), s->buf,
+                                s->length, s->offset, PriorityDefault,
+                                replay_done, s, NULL);
+                if (rc < 0) {
+                        replay_done(s, rc);
+                        rc = 0;
+                }
+        }
+        if (rc == 0 && ferror(f)) {
+                fprintf(stderr, "Fail to read trace %s\n", cfg->path);
+                rc = -EIO;
+        }
+
+        pthread_mutex_lock(&run->mutex);
+        while (run->inflight > 0) {
+                pthread_cond_wait(&run->cond, &run->mutex);
+        }
+        pthread_mutex_unlock(&run->mutex);
+        now = now_ns();
+
+        if (rc == 0) {
+                print_replay(cfg, run, records, (now - start) / 1E9);
+                if (run->errors != 0) {
+                        rc = -EIO;
+                }
+        }
+        for (i = 0; i < cfg->depth; i++) {
+                free(slots[i].buf);
+        }
+        pthread_mutex_destroy(&run->mutex);
+        pthread_cond_destroy(&run->cond);
+        free(slots);
+        free(run);
+        fclose(f);
+        return rc;
+}
@@ -0,0 +1,65 @@
+#ifndef LONGHORN_RPC_IOTRACE_HEADER
+#define LONGHORN_RPC_IOTRACE_HEADER
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+struct client_connection;
+
+#define IOTRACE_MAGIC   0x5452484c      // "LHRT" on disk
+#define IOTRACE_VERSION 1
+
+// A block trace file is a header followed by one record per request, in
+// the order the requests were issued. Everything is little-endian.
+struct iotrace_header {
+        uint32_t        Magic;
+        uint32_t        Version;
+        // Wall clock time the recording started, ns since the epoch
+        uint64_t        StartTime;
+} __attribute__((packed));
+
+struct iotrace_record {
+        uint64_t        Time;           // ns since the recording started
+        int64_t         Offset;
+        uint32_t        Length;
+        uint16_t        Volume;
+        uint8_t         Type;           // TypeRead or TypeWrite
+        uint8_t         Reserved;
+} __attribute__((packed));
+
+// Logs the requests of a client connection. Requests may be issued from
+// any thread, records go out through a buffered stream under mutex.
+struct iotrace_recorder {
+        pthread_mutex_t mutex;
+        FILE *f;
+        // CLOCK_MONOTONIC ns record times are relative to
+        uint64_t start;
+        uint64_t records;
+        int error;
+};
+
+struct iotrace_recorder *new_iotrace_recorder();
+void free_iotrace_recorder(struct iotrace_recorder *rec);
+int iotrace_start(struct iotrace_recorder *rec, char *path, uint64_t now);
+int iotrace_stop(struct iotrace_recorder *rec, uint64_t *records);
+void iotrace_record(struct iotrace_recorder *rec, uint64_t now, uint32_t type,
+                uint16_t volume, int64_t offset, size_t count);
+
+enum replay_timing {
+        ReplayOriginal,         // issue each request at its recorded time
+        ReplayFast,             // as fast as depth allows
+};
+
+struct replay_config {
+        char *path;
+        enum replay_timing timing;
+        // Most requests in flight at once
+        int depth;
+        // Pattern seed of the data written, see longhorn-rpc-pattern.h
+        uint64_t seed;
+};
+
+int run_replay(struct client_connection *conn, struct replay_config *cfg);
+
+#endif
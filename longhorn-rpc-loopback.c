@@ -0,0 +1,276 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "longhorn-rpc-protocol.h"
+#include "longhorn-rpc-loopback.h"
+
+// Pauses before a waiting side goes to sleep. With a single CPU the other
+// side can't make progress while this one spins, so it sleeps right away.
+#define LOOPBACK_SPINS  4096
+
+static int loopback_spins;
+
+// head and tail only ever grow, head - tail bytes are buffered. seq and
+// waiters form an eventcount: a side that has to sleep registers in
+// waiters and waits for seq to move, the other side only makes the
+// futex call when someone is registered.
+struct loopback_ring {
+        uint64_t head __attribute__((aligned(64)));
+        uint64_t tail __attribute__((aligned(64)));
+        uint32_t seq __attribute__((aligned(64)));
+        uint32_t waiters;
+        char *buf;
+};
+
+// Side i reads rings[i] and writes rings[1 - i]. A side that was shut
+// down or closed is done in both directions, only whatever the other side
+// wrote before can still be read. The pipe goes away once both released
+// their descriptor.
+struct loopback_pipe {
+        struct loopback_ring rings[2];
+        int closed[2];
+        int released[2];
+        int nr_released;
+        int index;
+};
+
+static int pipe_closed(struct loopback_pipe *p) {
+        return __atomic_load_n(&p->closed[0], __ATOMIC_ACQUIRE) ||
+                __atomic_load_n(&p->closed[1], __ATOMIC_ACQUIRE);
+}
+
+static struct loopback_pipe *pipes[MAX_LOOPBACK_PIPES];
+
+static struct loopback_pipe *lookup_pipe(int fd, int *side) {
+        int n = LOOPBACK_FD_BASE - fd;
+
+        if (!is_loopback_fd(fd) || n / 2 >= MAX_LOOPBACK_PIPES) {
+                return NULL;
+        }
+        *side = n % 2;
+        return __atomic_load_n(&pipes[n / 2], __ATOMIC_ACQUIRE);
+}
+
+static void ring_notify(struct loopback_ring *r) {
+        // Orders the update just made before reading waiters, pairs with
+        // the fence in ring_sleep()
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&r->waiters, __ATOMIC_RELAXED) != 0) {
+                __atomic_fetch_add(&r->seq, 1, __ATOMIC_RELEASE);
+                syscall(SYS_futex, &r->seq, FUTEX_WAKE_PRIVATE, INT_MAX,
+                                NULL, NULL, 0);
+        }
+}
+
+// Called with seq loaded before the caller found it had to wait. Sleeps
+// unless the other side moved since, the caller then checks again.
+static void ring_sleep(struct loopback_ring *r, uint32_t seq, uint64_t *pos,
+                uint64_t blocked, struct loopback_pipe *p) {
+        __atomic_fetch_add(&r->waiters, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(pos, __ATOMIC_RELAXED) == blocked && !pipe_closed(p)) {
+                syscall(SYS_futex, &r->seq, FUTEX_WAIT_PRIVATE, seq,
+                                NULL, NULL, 0);
+        }
+        __atomic_fetch_sub(&r->waiters, 1, __ATOMIC_RELAXED);
+}
+
+int loopback_pair(int fds[2]) {
+        struct loopback_pipe *p;
+        int i;
+
+        if (posix_memalign((void **)&p, 64, sizeof(struct loopback_pipe)) != 0) {
+                perror("cannot allocate memory for loopback pipe");
+                return -ENOMEM;
+        }
+        memset(p, 0, sizeof(struct loopback_pipe));
+        loopback_spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? LOOPBACK_SPINS : 0;
+        p->rings[0].buf = malloc(LOOPBACK_RING_SIZE);
+        p->rings[1].buf = malloc(LOOPBACK_RING_SIZE);
+        if (p->rings[0].buf == NULL || p->rings[1].buf == NULL) {
+                perror("cannot allocate memory for loopback rings");
+                free(p->rings[0].buf);
+                free(p->rings[1].buf);
+                free(p);
+                return -ENOMEM;
+        }
+        for (i = 0; i < MAX_LOOPBACK_PIPES; i++) {
+                struct loopback_pipe *expected = NULL;
+
+                if (__atomic_compare_exchange_n(&pipes[i], &expected, p, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+                        p->index = i;
+                        fds[0] = LOOPBACK_FD_BASE - 2 * i;
+                        fds[1] = LOOPBACK_FD_BASE - 2 * i - 1;
+                        return 0;
+                }
+        }
+        fprintf(stderr, "too many loopback pipes\n");
+        free(p->rings[0].buf);
+        free(p->rings[1].buf);
+        free(p);
+        return -EMFILE;
+}
+
+// Like read() on a blocking socket: waits for at least one byte, returns 0
+// once the other side closed and everything it wrote was read
+ssize_t loopback_read(int fd, void *buf, size_t len) {
+        struct loopback_pipe *p;
+        struct loopback_ring *r;
+        uint64_t head, tail;
+        uint32_t seq;
+        size_t n, pos, first;
+        int side, spins = 0;
+
+        p = lookup_pipe(fd, &side);
+        if (p == NULL) {
+                errno = EBADF;
+                return -1;
+        }
+        if (len == 0) {
+                return 0;
+        }
+        r = &p->rings[side];
+        tail = r->tail;
+        while (1) {
+                seq = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+                head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+                if (__atomic_load_n(&p->closed[side], __ATOMIC_ACQUIRE)) {
+                        return 0;
+                }
+                if (head != tail) {
+                        break;
+                }
+                if (__atomic_load_n(&p->closed[1 - side], __ATOMIC_ACQUIRE)) {
+                        // Anything written before the close is visible now
+                        head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+                        if (head == tail) {
+                                return 0;
+                        }
+                        break;
+                }
+                if (spins++ < loopback_spins) {
+                        cpu_relax();
+                        continue;
+                }
+                ring_sleep(r, seq, &r->head, tail, p);
+        }
+
+        n = head - tail < len ? head - tail : len;
+        pos = tail & (LOOPBACK_RING_SIZE - 1);
+        first = LOOPBACK_RING_SIZE - pos < n ? LOOPBACK_RING_SIZE - pos : n;
+        memcpy(buf, r->buf + pos, first);
+        memcpy(buf + first, r->buf, n - first);
+        __atomic_store_n(&r->tail, tail + n, __ATOMIC_RELEASE);
+        ring_notify(r);
+        return n;
+}
+
+// Returns once all of buf is in the ring, or fails with EPIPE if either
+// side closed
+ssize_t loopback_write(int fd, const void *buf, size_t len) {
+        struct loopback_pipe *p;
+        struct loopback_ring *r;
+        uint64_t head, tail;
+        uint32_t seq;
+        size_t n, pos, first, done = 0;
+        int side, spins = 0;
+
+        p = lookup_pipe(fd, &side);
+        if (p == NULL) {
+                errno = EBADF;
+                return -1;
+        }
+        r = &p->rings[1 - side];
+        head = r->head;
+        while (done < len) {
+                if (pipe_closed(p)) {
+                        errno = EPIPE;
+                        return -1;
+                }
+                seq = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+                tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+                if (head - tail == LOOPBACK_RING_SIZE) {
+                        if (spins++ < loopback_spins) {
+                                cpu_relax();
+                        } else {
+                                ring_sleep(r, seq, &r->tail, tail, p);
+                        }
+                        continue;
+                }
+                spins = 0;
+
+                n = LOOPBACK_RING_SIZE - (head - tail);
+                if (n > len - done) {
+                        n = len - done;
+                }
+                pos = head & (LOOPBACK_RING_SIZE - 1);
+                first = LOOPBACK_RING_SIZE - pos < n ? LOOPBACK_RING_SIZE - pos : n;
+                memcpy(r->buf + pos, buf + done, first);
+                memcpy(r->buf, buf + done + first, n - first);
+                head += n;
+                done += n;
+                __atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+                ring_notify(r);
+        }
+        return done;
+}
+
+ssize_t loopback_writev(int fd, const struct iovec *iov, int iovcnt) {
+        ssize_t n, done = 0;
+        int i;
+
+        for (i = 0; i < iovcnt; i++) {
+                n = loopback_write(fd, iov[i].iov_base, iov[i].iov_len);
+                if (n < 0) {
+                        return n;
+                }
+                done += n;
+        }
+        return done;
+}
+
+// Like shutdown(SHUT_RDWR): readers and writers blocked on this side return,
+// the other side sees EOF once it has read everything, or EPIPE on its next
+// write. The descriptor stays valid until loopback_close().
+int loopback_shutdown(int fd) {
+        struct loopback_pipe *p;
+        int side;
+
+        p = lookup_pipe(fd, &side);
+        if (p == NULL) {
+                errno = EBADF;
+                return -1;
+        }
+        __atomic_store_n(&p->closed[side], 1, __ATOMIC_RELEASE);
+        ring_notify(&p->rings[0]);
+        ring_notify(&p->rings[1]);
+        return 0;
+}
+
+// Shuts the side down if that didn't happen yet. Whoever closes last frees
+// the pipe, nobody may still be using the descriptor.
+int loopback_close(int fd) {
+        struct loopback_pipe *p;
+        int side;
+
+        p = lookup_pipe(fd, &side);
+        if (p == NULL || __atomic_exchange_n(&p->released[side], 1, __ATOMIC_ACQ_REL)) {
+                errno = EBADF;
+                return -1;
+        }
+        loopback_shutdown(fd);
+        if (__atomic_add_fetch(&p->nr_released, 1, __ATOMIC_ACQ_REL) == 2) {
+                __atomic_store_n(&pipes[p->index], NULL, __ATOMIC_RELEASE);
+                free(p->rings[0].buf);
+                free(p->rings[1].buf);
+                free(p);
+        }
+        return 0;
+}
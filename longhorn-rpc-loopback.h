@@ -0,0 +1,35 @@
+#ifndef LONGHORN_RPC_LOOPBACK_HEADER
+#define LONGHORN_RPC_LOOPBACK_HEADER
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// In-process transport: a pair of descriptors like socketpair() gives, but
+// connected through two single producer, single consumer byte rings in
+// memory. While data keeps flowing neither side enters the kernel; a side
+// that finds nothing to do for a while sleeps on a futex instead of
+// burning its CPU.
+//
+// Loopback descriptors are negative, so they can travel in the fd fields
+// of client and server connections. The protocol layer routes them here
+// instead of read()/write(). Each ring must have one reader and one writer
+// at a time, which the connections already guarantee: sends happen under
+// the connection mutex and a single thread receives.
+
+#define LOOPBACK_FD_BASE        (-2)
+#define MAX_LOOPBACK_PIPES      64
+#define LOOPBACK_RING_SIZE      (4 * 1024 * 1024)
+
+static inline int is_loopback_fd(int fd) {
+        return fd <= LOOPBACK_FD_BASE;
+}
+
+int loopback_pair(int fds[2]);
+ssize_t loopback_read(int fd, void *buf, size_t len);
+ssize_t loopback_write(int fd, const void *buf, size_t len);
+ssize_t loopback_writev(int fd, const struct iovec *iov, int iovcnt);
+int loopback_shutdown(int fd);
+int loopback_close(int fd);
+
+#endif
@@ -0,0 +1,572 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <endian.h>
+#include <sys/socket.h>
+
+#include "longhorn-rpc-client.h"
+#include "longhorn-rpc-server.h"
+#include "longhorn-rpc-nbd.h"
+
+#define NBD_EXPORT_FLAGS        (NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH | \
+                                 NBD_FLAG_SEND_FUA | NBD_FLAG_SEND_TRIM | \
+                                 NBD_FLAG_CAN_MULTI_CONN)
+
+struct nbd_client;
+
+struct nbd_request {
+        struct nbd_client *client;
+        uint64_t handle;
+        uint16_t type;
+        uint32_t length;
+        void *buf;
+        uint32_t error;
+        struct nbd_request *next;
+};
+
+// One NBD connection. Its thread reads requests and submits them, a
+// second thread writes the replies in completion order, so an NBD client
+// slow to read them never holds up the response thread of the shared
+// client connection.
+struct nbd_client {
+        int fd;
+        struct client_connection *conn;
+        struct nbd_config *cfg;
+        uint16_t volume;
+        int no_zeroes;
+
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+        // Completed, waiting for their reply
+        struct nbd_request *head;
+        struct nbd_request *tail;
+        // Received and not answered yet
+        int inflight;
+        int stop;
+        pthread_t reply_thread;
+};
+
+static uint32_t nbd_error(int rc) {
+        switch (-rc) {
+        case 0:
+                return 0;
+        case EPERM:
+                return NBD_EPERM;
+        case ENOMEM:
+                return NBD_ENOMEM;
+        case EINVAL:
+                return NBD_EINVAL;
+        case ENOSPC:
+                return NBD_ENOSPC;
+        case EOPNOTSUPP:
+                return NBD_ENOTSUP;
+        default:
+                return NBD_EIO;
+        }
+}
+
+// Done callback of submit_request(), also used for requests answered
+// without one
+static void nbd_done(void *data, int rc) {
+        struct nbd_request *req = data;
+        struct nbd_client *client = req->client;
+
+        req->error = nbd_error(rc);
+        req->next = NULL;
+
+        pthread_mutex_lock(&client->mutex);
+        if (client->tail != NULL) {
+                client->tail->next = req;
+        } else {
+                client->head = req;
+        }
+        client->tail = req;
+        pthread_cond_broadcast(&client->cond);
+        pthread_mutex_unlock(&client->mutex);
+}
+
+static void *nbd_reply_thread(void *arg) {
+        struct nbd_client *client = arg;
+        struct nbd_request *req;
+        struct nbd_simple_reply reply;
+        struct iovec iov[2];
+        int iovcnt, len, broken = 0;
+
+        while (1) {
+                pthread_mutex_lock(&client->mutex);
+                while (client->head == NULL && !client->stop) {
+                        pthread_cond_wait(&client->cond, &client->mutex);
+                }
+                req = client->head;
+                if (req == NULL) {
+                        pthread_mutex_unlock(&client->mutex);
+                        break;
+                }
+                client->head = req->next;
+                if (client->head == NULL) {
+                        client->tail = NULL;
+                }
+                pthread_mutex_unlock(&client->mutex);
+
+                reply.Magic = htobe32(NBD_SIMPLE_REPLY_MAGIC);
+                reply.Error = htobe32(req->error);
+                reply.Handle = req->handle;
+                iov[0].iov_base = &reply;
+                iov[0].iov_len = sizeof(reply);
+                iovcnt = 1;
+                len = sizeof(reply);
+                if (req->type == NBD_CMD_READ && req->error == 0 &&
+                                req->length != 0) {
+                        iov[1].iov_base = req->buf;
+                        iov[1].iov_len = req->length;
+                        iovcnt = 2;
+                        len += req->length;
+                }
+                // Once a reply is lost the client can't go on, the request
+                // thread sees the connection fail on its next read
+                if (!broken && writev_full(client->fd, iov, iovcnt) != len) {
+                        broken = 1;
+                        shutdown_fd(client->fd);
+                }
+                free(req->buf);
+                free(req);
+
+                pthread_mutex_lock(&client->mutex);
+                client->inflight--;
+                pthread_cond_broadcast(&client->cond);
+                pthread_mutex_unlock(&client->mutex);
+        }
+        return NULL;
+}
+
+// 0 if the request can go ahead, or the error it is refused with
+static int nbd_check_request(struct nbd_client *client, uint16_t type,
+                uint64_t offset, uint32_t length) {
+        uint64_t size = client->cfg->size;
+
+        switch (type) {
+        case NBD_CMD_READ:
+        case NBD_CMD_WRITE:
+        case NBD_CMD_TRIM:
+                if (offset > size || length > size - offset) {
+                        return type == NBD_CMD_WRITE ? -ENOSPC : -EINVAL;
+                }
+                if (type != NBD_CMD_TRIM && length > NBD_MAX_LENGTH) {
+                        return -EINVAL;
+                }
+                return 0;
+        case NBD_CMD_FLUSH:
+                return 0;
+        default:
+                return -EINVAL;
+        }
+}
+
+// Reads requests until the client disconnects. Reads and writes become
+// requests on the client connection, as many in flight as the client
+// sends. The rest is answered right away: a write is on the server once
+// it is answered, which is all a flush promises, and trim is only a hint
+// the protocol has no request for.
+static int nbd_transmission(struct nbd_client *client) {
+        struct nbd_request_header hdr;
+        struct nbd_request *req;
+        uint64_t offset;
+        uint32_t length;
+        uint16_t type;
+        int n, rc;
+
+        while (1) {
+                n = read_full(client->fd, &hdr, sizeof(hdr));
+                if (n == 0) {
+                        // Gone without NBD_CMD_DISC
+                        return 0;
+                }
+                if (n != sizeof(hdr)) {
+                        fprintf(stderr, "fail to read NBD request, %d vs %lu\n",
+                                        n, sizeof(hdr));
+                        return -EIO;
+                }
+                if (be32toh(hdr.Magic) != NBD_REQUEST_MAGIC) {
+                        fprintf(stderr, "invalid NBD request magic 0x%x\n",
+                                        be32toh(hdr.Magic));
+                        return -EPROTO;
+                }
+                type = be16toh(hdr.Type);
+                offset = be64toh(hdr.Offset);
+                length = be32toh(hdr.Length);
+                if (type == NBD_CMD_DISC) {
+                        return 0;
+                }
+
+                req = calloc(1, sizeof(struct nbd_request));
+                if (req == NULL) {
+                        perror("cannot allocate memory for NBD request");
+                        return -ENOMEM;
+                }
+                req->client = client;
+                req->handle = hdr.Handle;
+                req->type = type;
+                req->length = length;
+                pthread_mutex_lock(&client->mutex);
+                client->inflight++;
+                pthread_mutex_unlock(&client->mutex);
+
+                rc = nbd_check_request(client, type, offset, length);
+                if (rc == 0 && (type == NBD_CMD_READ || type == NBD_CMD_WRITE) &&
+                                length != 0) {
+                        req->buf = malloc(length);
+                        if (req->buf == NULL) {
+                                rc = -ENOMEM;
+                        }
+                }
+                if (type == NBD_CMD_WRITE) {
+                        // The payload follows even if the write is refused
+                        if (req->buf != NULL) {
+                                n = receive_data(client->fd, req->buf, length);
+                        } else {
+                                n = discard_data(client->fd, length);
+                        }
+                        if (n < 0) {
+                                nbd_done(req, -EIO);
+                                return -EIO;
+                        }
+                }
+                if (rc < 0 || req->buf == NULL) {
+                        nbd_done(req, rc);
+                        continue;
+                }
+
+                rc = submit_request(client->conn, type == NBD_CMD_READ ?
+                                TypeRead : TypeWrite, client->volume, req->buf,
+                                length, offset, PriorityDefault, nbd_done,
+                                req, NULL);
+                if (rc < 0) {
+                        nbd_done(req, rc);
+                }
+        }
+}
+
+static int nbd_option_reply(struct nbd_client *client, uint32_t option,
+                uint32_t type, void *data, uint32_t len) {
+        struct nbd_option_reply reply;
+        struct iovec iov[2];
+
+        reply.Magic = htobe64(NBD_OPTION_REPLY_MAGIC);
+        reply.Option = htobe32(option);
+        reply.Type = htobe32(type);
+        reply.Length = htobe32(len);
+        iov[0].iov_base = &reply;
+        iov[0].iov_len = sizeof(reply);
+        iov[1].iov_base = data;
+        iov[1].iov_len = len;
+        if (writev_full(client->fd, iov, len != 0 ? 2 : 1) !=
+                        sizeof(reply) + len) {
+                return -EIO;
+        }
+        return 0;
+}
+
+// Volume an export name stands for
+static int nbd_lookup_export(struct nbd_client *client, char *name) {
+        char *end;
+        long v;
+
+        if (name[0] == '\0') {
+                return 0;
+        }
+        v = strtol(name, &end, 10);
+        if (*end != '\0' || v < 0 || v >= client->cfg->volumes) {
+                return -ENOENT;
+        }
+        return v;
+}
+
+static int nbd_list(struct nbd_client *client, uint32_t len) {
+        char data[4 + 16];
+        uint32_t namelen;
+        int v, rc;
+
+        if (len != 0) {
+                return nbd_option_reply(client, NBD_OPT_LIST,
+                                NBD_REP_ERR_INVALID, NULL, 0);
+        }
+        for (v = 0; v < client->cfg->volumes; v++) {
+                namelen = sprintf(data + 4, "%d", v);
+                *(uint32_t *)data = htobe32(namelen);
+                rc = nbd_option_reply(client, NBD_OPT_LIST, NBD_REP_SERVER,
+                                data, 4 + namelen);
+                if (rc < 0) {
+                        return rc;
+                }
+        }
+        return nbd_option_reply(client, NBD_OPT_LIST, NBD_REP_ACK, NULL, 0);
+}
+
+// NBD_OPT_INFO and NBD_OPT_GO. Returns 1 once GO picked an export.
+static int nbd_info(struct nbd_client *client, uint32_t option, char *data,
+                uint32_t len) {
+        struct {
+                uint16_t type;
+                uint64_t size;
+                uint16_t flags;
+        } __attribute__((packed)) info_export;
+        struct {
+                uint16_t type;
+                uint32_t min;
+                uint32_t preferred;
+                uint32_t max;
+        } __attribute__((packed)) info_block_size;
+        uint32_t namelen;
+        uint16_t nr_infos, info;
+        int i, volume, block_size = 0, rc;
+
+        // Name length, name, number of infos requested, infos
+        if (len < 6) {
+                return nbd_option_reply(client, option, NBD_REP_ERR_INVALID,
+                                NULL, 0);
+        }
+        memcpy(&namelen, data, 4);
+        namelen = be32toh(namelen);
+        if (namelen > len - 6) {
+                return nbd_option_reply(client, option, NBD_REP_ERR_INVALID,
+                                NULL, 0);
+        }
+        memcpy(&nr_infos, data + 4 + namelen, 2);
+        nr_infos = be16toh(nr_infos);
+        if (len != 6 + namelen + 2 * nr_infos) {
+                return nbd_option_reply(client, option, NBD_REP_ERR_INVALID,
+                                NULL, 0);
+        }
+        for (i = 0; i < nr_infos; i++) {
+                memcpy(&info, data + 6 + namelen + 2 * i, 2);
+                if (be16toh(info) == NBD_INFO_BLOCK_SIZE) {
+                        block_size = 1;
+                }
+        }
+        // The name is followed by binary data, move it out of the way
+        memmove(data, data + 4, namelen);
+        data[namelen] = '\0';
+        volume = nbd_lookup_export(client, data);
+        if (volume < 0) {
+                return nbd_option_reply(client, option, NBD_REP_ERR_UNKNOWN,
+                                NULL, 0);
+        }
+
+        info_export.type = htobe16(NBD_INFO_EXPORT);
+        info_export.size = htobe64(client->cfg->size);
+        info_export.flags = htobe16(NBD_EXPORT_FLAGS);
+        rc = nbd_option_reply(client, option, NBD_REP_INFO, &info_export,
+                        sizeof(info_export));
+        if (rc == 0 && block_size) {
+                // Any alignment works, larger requests are refused
+                info_block_size.type = htobe16(NBD_INFO_BLOCK_SIZE);
+                info_block_size.min = htobe32(1);
+                info_block_size.preferred = htobe32(4096);
+                info_block_size.max = htobe32(NBD_MAX_LENGTH);
+                rc = nbd_option_reply(client, option, NBD_REP_INFO,
+                                &info_block_size, sizeof(info_block_size));
+        }
+        if (rc == 0) {
+                rc = nbd_option_reply(client, option, NBD_REP_ACK, NULL, 0);
+        }
+        if (rc == 0 && option == NBD_OPT_GO) {
+                client->volume = volume;
+                return 1;
+        }
+        return rc;
+}
+
+// Old style NBD_OPT_EXPORT_NAME, which has no way to report an error
+static int nbd_export_name(struct nbd_client *client, char *name) {
+        static char zeroes[124];
+        struct {
+                uint64_t size;
+                uint16_t flags;
+        } __attribute__((packed)) reply;
+        int volume;
+
+        volume = nbd_lookup_export(client, name);
+        if (volume < 0) {
+                fprintf(stderr, "Unknown NBD export %s\n", name);
+                return volume;
+        }
+        reply.size = htobe64(client->cfg->size);
+        reply.flags = htobe16(NBD_EXPORT_FLAGS);
+        if (write_full(client->fd, &reply, sizeof(reply)) != sizeof(reply)) {
+                return -EIO;
+        }
+        if (!client->no_zeroes &&
+                        write_full(client->fd, zeroes, sizeof(zeroes)) !=
+                        sizeof(zeroes)) {
+                return -EIO;
+        }
+        client->volume = volume;
+        return 1;
+}
+
+// Handshake and option haggling, 0 once the client picked an export
+static int nbd_negotiate(struct nbd_client *client) {
+        struct {
+                uint64_t magic;
+                uint64_t option_magic;
+                uint16_t flags;
+        } __attribute__((packed)) greeting;
+        struct nbd_option_header opt;
+        char data[NBD_MAX_OPTION_LENGTH + 1];
+        uint32_t flags, option, len;
+        int rc;
+
+        greeting.magic = htobe64(NBD_MAGIC);
+        greeting.option_magic = htobe64(NBD_OPTION_MAGIC);
+        greeting.flags = htobe16(NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+        if (write_full(client->fd, &greeting, sizeof(greeting)) !=
+                        sizeof(greeting)) {
+                return -EIO;
+        }
+        if (read_full(client->fd, &flags, sizeof(flags)) != sizeof(flags)) {
+                return -EIO;
+        }
+        flags = be32toh(flags);
+        if (flags & ~(NBD_FLAG_C_FIXED_NEWSTYLE | NBD_FLAG_C_NO_ZEROES)) {
+                fprintf(stderr, "Unknown NBD client flags 0x%x\n", flags);
+                return -EINVAL;
+        }
+        client->no_zeroes = flags & NBD_FLAG_C_NO_ZEROES;
+
+        while (1) {
+                if (read_full(client->fd, &opt, sizeof(opt)) != sizeof(opt)) {
+                        return -EIO;
+                }
+                if (be64toh(opt.Magic) != NBD_OPTION_MAGIC) {
+                        fprintf(stderr, "invalid NBD option magic 0x%lx\n",
+                                        be64toh(opt.Magic));
+                        return -EPROTO;
+                }
+                option = be32toh(opt.Option);
+                len = be32toh(opt.Length);
+                if (len > NBD_MAX_OPTION_LENGTH) {
+                        if (option == NBD_OPT_EXPORT_NAME ||
+                                        discard_data(client->fd, len) < 0) {
+                                return -EINVAL;
+                        }
+                        rc = nbd_option_reply(client, option,
+                                        NBD_REP_ERR_TOO_BIG, NULL, 0);
+                        if (rc < 0) {
+                                return rc;
+                        }
+                        continue;
+                }
+                if (receive_data(client->fd, data, len) < 0) {
+                        return -EIO;
+                }
+                data[len] = '\0';
+
+                switch (option) {
+                case NBD_OPT_EXPORT_NAME:
+                        rc = nbd_export_name(client, data);
+                        break;
+                case NBD_OPT_ABORT:
+                        nbd_option_reply(client, option, NBD_REP_ACK, NULL, 0);
+                        return -ECONNABORTED;
+                case NBD_OPT_LIST:
+                        rc = nbd_list(client, len);
+                        break;
+                case NBD_OPT_INFO:
+                case NBD_OPT_GO:
+                        rc = nbd_info(client, option, data, len);
+                        break;
+                default:
+                        // Structured replies and TLS included
+                        rc = nbd_option_reply(client, option,
+                                        NBD_REP_ERR_UNSUP, NULL, 0);
+                        break;
+                }
+                if (rc != 0) {
+                        return rc > 0 ? 0 : rc;
+                }
+        }
+}
+
+static void *nbd_serve(void *arg) {
+        struct nbd_client *client = arg;
+        int rc;
+
+        rc = nbd_negotiate(client);
+        if (rc == 0) {
+                rc = pthread_create(&client->reply_thread, NULL,
+                                nbd_reply_thread, client);
+                if (rc != 0) {
+                        fprintf(stderr, "Fail to create NBD reply thread: %s\n",
+                                        strerror(rc));
+                }
+        }
+        if (rc == 0) {
+                nbd_transmission(client);
+
+                // Answer whatever is still in flight before letting go
+                pthread_mutex_lock(&client->mutex);
+                while (client->inflight > 0) {
+                        pthread_cond_wait(&client->cond, &client->mutex);
+                }
+                client->stop = 1;
+                pthread_cond_broadcast(&client->cond);
+                pthread_mutex_unlock(&client->mutex);
+                pthread_join(client->reply_thread, NULL);
+        }
+
+        close_fd(client->fd);
+        pthread_mutex_destroy(&client->mutex);
+        pthread_cond_destroy(&client->cond);
+        free(client);
+        return NULL;
+}
+
+// Serves NBD clients on cfg->path until the process exits, each from its
+// own threads, all through conn
+int run_nbd_gateway(struct client_connection *conn, struct nbd_config *cfg) {
+        struct nbd_client *client;
+        pthread_t thread;
+        int listen_fd, fd, rc;
+
+        if (cfg->volumes <= 0 || cfg->size == 0) {
+                return -EINVAL;
+        }
+        unlink(cfg->path);
+        listen_fd = server_listen(cfg->path);
+        printf("Serving %d NBD exports of %lu bytes on %s\n", cfg->volumes,
+                        cfg->size, cfg->path);
+        fflush(stdout);
+
+        while (1) {
+                fd = accept(listen_fd, NULL, NULL);
+                if (fd < 0) {
+                        perror("fail to accept NBD client");
+                        continue;
+                }
+                client = calloc(1, sizeof(struct nbd_client));
+                if (client == NULL) {
+                        perror("cannot allocate memory for NBD client");
+                        close(fd);
+                        continue;
+                }
+                client->fd = fd;
+                client->conn = conn;
+                client->cfg = cfg;
+                pthread_mutex_init(&client->mutex, NULL);
+                pthread_cond_init(&client->cond, NULL);
+                rc = pthread_create(&thread, NULL, nbd_serve, client);
+                if (rc != 0) {
+                        fprintf(stderr, "Fail to create NBD client thread: %s\n",
+                                        strerror(rc));
+                        pthread_mutex_destroy(&client->mutex);
+                        pthread_cond_destroy(&client->cond);
+                        free(client);
+                        close(fd);
+                        continue;
+                }
+                pthread_detach(thread);
+        }
+        return 0;
+}
@@ -0,0 +1,109 @@
+#ifndef LONGHORN_RPC_NBD_HEADER
+#define LONGHORN_RPC_NBD_HEADER
+
+#include <stdint.h>
+
+struct client_connection;
+
+// Gateway speaking the fixed newstyle NBD protocol on a Unix socket, so
+// NBD clients (qemu-img, nbdkit and libnbd tools, fio's nbd engine, the
+// kernel's nbd-client) can use the volumes of a server. Requests of every
+// NBD connection are pipelined onto one client connection. Only simple
+// replies are sent, structured replies are refused.
+//
+// Exports are named after the volume they map to, "0" and up; the empty
+// default name is volume 0.
+
+#define NBD_MAGIC               0x4e42444d41474943ULL   // "NBDMAGIC"
+#define NBD_OPTION_MAGIC        0x49484156454f5054ULL   // "IHAVEOPT"
+#define NBD_OPTION_REPLY_MAGIC  0x0003e889045565a9ULL
+#define NBD_REQUEST_MAGIC       0x25609513
+#define NBD_SIMPLE_REPLY_MAGIC  0x67446698
+
+// Handshake flags of the server and the client
+#define NBD_FLAG_FIXED_NEWSTYLE (1 << 0)
+#define NBD_FLAG_NO_ZEROES      (1 << 1)
+#define NBD_FLAG_C_FIXED_NEWSTYLE       (1 << 0)
+#define NBD_FLAG_C_NO_ZEROES    (1 << 1)
+
+// Transmission flags of an export
+#define NBD_FLAG_HAS_FLAGS      (1 << 0)
+#define NBD_FLAG_SEND_FLUSH     (1 << 2)
+#define NBD_FLAG_SEND_FUA       (1 << 3)
+#define NBD_FLAG_SEND_TRIM      (1 << 5)
+#define NBD_FLAG_CAN_MULTI_CONN (1 << 8)
+
+#define NBD_OPT_EXPORT_NAME     1
+#define NBD_OPT_ABORT           2
+#define NBD_OPT_LIST            3
+#define NBD_OPT_INFO            6
+#define NBD_OPT_GO              7
+
+#define NBD_REP_ACK             1
+#define NBD_REP_SERVER          2
+#define NBD_REP_INFO            3
+#define NBD_REP_ERR_UNSUP       (0x80000000 | 1)
+#define NBD_REP_ERR_INVALID     (0x80000000 | 3)
+#define NBD_REP_ERR_UNKNOWN     (0x80000000 | 6)
+#define NBD_REP_ERR_TOO_BIG     (0x80000000 | 9)
+
+#define NBD_INFO_EXPORT         0
+#define NBD_INFO_BLOCK_SIZE     3
+
+#define NBD_CMD_READ            0
+#define NBD_CMD_WRITE           1
+#define NBD_CMD_DISC            2
+#define NBD_CMD_FLUSH           3
+#define NBD_CMD_TRIM            4
+
+// Error values on the wire, whatever the host's errno values are
+#define NBD_EPERM               1
+#define NBD_EIO                 5
+#define NBD_ENOMEM              12
+#define NBD_EINVAL              22
+#define NBD_ENOSPC              28
+#define NBD_ENOTSUP             95
+
+// Largest read or write accepted, and option payload read
+#define NBD_MAX_LENGTH          (32 * 1024 * 1024)
+#define NBD_MAX_OPTION_LENGTH   4096
+
+// Everything on the wire is big-endian
+struct nbd_option_header {
+        uint64_t        Magic;
+        uint32_t        Option;
+        uint32_t        Length;
+} __attribute__((packed));
+
+struct nbd_option_reply {
+        uint64_t        Magic;
+        uint32_t        Option;
+        uint32_t        Type;
+        uint32_t        Length;
+} __attribute__((packed));
+
+struct nbd_request_header {
+        uint32_t        Magic;
+        uint16_t        Flags;
+        uint16_t        Type;
+        uint64_t        Handle;         // echoed back untouched
+        uint64_t        Offset;
+        uint32_t        Length;
+} __attribute__((packed));
+
+struct nbd_simple_reply {
+        uint32_t        Magic;
+        uint32_t        Error;
+        uint64_t        Handle;
+} __attribute__((packed));
+
+struct nbd_config {
+        char *path;
+        // Volumes exported, all of size bytes
+        int volumes;
+        uint64_t size;
+};
+
+int run_nbd_gateway(struct client_connection *conn, struct nbd_config *cfg);
+
+#endif
@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "longhorn-rpc-pattern.h"
+
+// Generated a block of 32-bit lanes at a time. GCC vector types map onto
+// whatever SIMD the target has, and fall back to scalar code elsewhere.
+#define PATTERN_BLOCK   32
+#define PATTERN_LANES   (PATTERN_BLOCK / sizeof(uint32_t))
+
+typedef uint32_t pattern_vec __attribute__((vector_size(PATTERN_BLOCK)));
+
+static const pattern_vec pattern_lane = { 0, 1, 2, 3, 4, 5, 6, 7 };
+
+// Lanes hold words 8 * block to 8 * block + 7 of the stream, each put
+// through a murmur3 style finalizer. The high half of the word index is
+// the same for all lanes, as they never carry into it. Every step is a
+// bijection, so the words of each aligned 16 GiB stretch are all different
+// and data read from the wrong offset doesn't verify.
+static inline void pattern_block(uint64_t seed, uint64_t block,
+                pattern_vec *out) {
+        uint64_t word = block * PATTERN_LANES;
+        pattern_vec x;
+
+        x = ((uint32_t)word + pattern_lane) ^ (uint32_t)seed;
+        x *= 0x9e3779b1;
+        x ^= (uint32_t)(word >> 32) ^ (uint32_t)(seed >> 32);
+        x ^= x >> 16;
+        x *= 0x85ebca6b;
+        x ^= x >> 13;
+        x *= 0xc2b2ae35;
+        x ^= x >> 16;
+        *out = x;
+}
+
+void pattern_fill(uint64_t seed, uint64_t offset, void *buf, size_t len) {
+        uint64_t block = offset / PATTERN_BLOCK;
+        size_t skip = offset % PATTERN_BLOCK, n;
+        char *p = buf;
+        pattern_vec x;
+
+        while (len > 0) {
+                pattern_block(seed, block++, &x);
+                if (skip == 0 && len >= PATTERN_BLOCK) {
+                        memcpy(p, &x, PATTERN_BLOCK);
+                        n = PATTERN_BLOCK;
+                } else {
+                        // Unaligned head or short tail
+                        n = PATTERN_BLOCK - skip < len ? PATTERN_BLOCK - skip : len;
+                        memcpy(p, (char *)&x + skip, n);
+                        skip = 0;
+                }
+                p += n;
+                len -= n;
+        }
+}
+
+// Returns the index of the first byte of buf that doesn't match, -1 if all
+// of them do
+ssize_t pattern_verify(uint64_t seed, uint64_t offset, const void *buf,
+                size_t len) {
+        uint64_t block = offset / PATTERN_BLOCK;
+        size_t skip = offset % PATTERN_BLOCK, n, i;
+        const char *p = buf;
+        pattern_vec x;
+
+        while (len > 0) {
+                pattern_block(seed, block++, &x);
+                n = PATTERN_BLOCK - skip < len ? PATTERN_BLOCK - skip : len;
+                if (memcmp(p, (char *)&x + skip, n) != 0) {
+                        for (i = 0; p[i] == ((char *)&x)[skip + i]; i++) {
+                        }
+                        return p + i - (const char *)buf;
+                }
+                skip = 0;
+                p += n;
+                len -= n;
+        }
+        return -1;
+}
+
+uint64_t pattern_volume_seed(uint64_t seed, uint16_t volume) {
+        return seed ^ ((uint64_t)volume * 0x9e3779b97f4a7c15ULL);
+}
@@ -0,0 +1,17 @@
+#ifndef LONGHORN_RPC_PATTERN_HEADER
+#define LONGHORN_RPC_PATTERN_HEADER
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Data derived from (seed, offset) alone: every byte of a volume has a fixed
+// value for a given seed, so writers generate their payload where it is
+// needed and readers verify theirs without keeping a copy around.
+void pattern_fill(uint64_t seed, uint64_t offset, void *buf, size_t len);
+ssize_t pattern_verify(uint64_t seed, uint64_t offset, const void *buf,
+                size_t len);
+
+// Seed of one volume, so data landing on the wrong volume doesn't verify
+uint64_t pattern_volume_seed(uint64_t seed, uint16_t volume);
+
+#endif
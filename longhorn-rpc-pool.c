@@ -0,0 +1,183 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "longhorn-rpc-pool.h"
+#include "longhorn-rpc-affinity.h"
+
+static size_t round_to_region(size_t len) {
+        return (len + POOL_REGION_SIZE - 1) & ~((size_t)POOL_REGION_SIZE - 1);
+}
+
+// Smallest class that fits size, or -1 if it's bigger than a region
+static int size_class(size_t size) {
+        size_t class_size = POOL_MIN_BUFFER;
+        int i;
+
+        for (i = 0; i < NR_POOL_CLASSES; i++, class_size <<= 1) {
+                if (size <= class_size) {
+                        return i;
+                }
+        }
+        return -1;
+}
+
+// len must be a multiple of POOL_REGION_SIZE
+static void *map_region(size_t len, int node) {
+        uintptr_t aligned;
+        void *buf;
+
+        buf = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (buf == MAP_FAILED) {
+                // No hugepages reserved. Map a 2 MiB aligned range instead
+                // and ask for transparent hugepages on it.
+                buf = mmap(NULL, len + POOL_REGION_SIZE, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (buf == MAP_FAILED) {
+                        return NULL;
+                }
+                aligned = ((uintptr_t)buf + POOL_REGION_SIZE - 1) &
+                        ~((uintptr_t)POOL_REGION_SIZE - 1);
+                if (aligned != (uintptr_t)buf) {
+                        munmap(buf, aligned - (uintptr_t)buf);
+                }
+                munmap((void *)(aligned + len),
+                                (uintptr_t)buf + POOL_REGION_SIZE - aligned);
+                buf = (void *)aligned;
+                madvise(buf, len, MADV_HUGEPAGE);
+        }
+        // Before anything touches the pages
+        bind_to_node(buf, len, node);
+        return buf;
+}
+
+struct buffer_pool *new_buffer_pool(int node) {
+        struct buffer_pool *pool;
+        int i;
+
+        pool = malloc(sizeof(struct buffer_pool));
+        if (pool == NULL) {
+                perror("cannot allocate memory for buffer pool");
+                return NULL;
+        }
+        pool->node = node;
+        for (i = 0; i < NR_POOL_CLASSES; i++) {
+                pthread_mutex_init(&pool->classes[i].mutex, NULL);
+                pool->classes[i].size = (size_t)POOL_MIN_BUFFER << i;
+                pool->classes[i].free_list = NULL;
+                pool->classes[i].regions = NULL;
+                pool->classes[i].hits = 0;
+                pool->classes[i].misses = 0;
+        }
+        pool->large = 0;
+        return pool;
+}
+
+// Only safe once no buffer of the pool is in use anymore
+void free_buffer_pool(struct buffer_pool *pool) {
+        struct pool_region *region;
+        int i;
+
+        for (i = 0; i < NR_POOL_CLASSES; i++) {
+                while ((region = pool->classes[i].regions) != NULL) {
+                        pool->classes[i].regions = region->next;
+                        munmap(region->base, POOL_REGION_SIZE);
+                        free(region);
+                }
+                pthread_mutex_destroy(&pool->classes[i].mutex);
+        }
+        free(pool);
+}
+
+// Carve a new region into buffers of the class. Called with class->mutex
+// held.
+static int pool_grow(struct buffer_pool *pool, struct pool_class *class) {
+        struct pool_region *region;
+        size_t off;
+
+        region = malloc(sizeof(struct pool_region));
+        if (region == NULL) {
+                return -ENOMEM;
+        }
+        region->base = map_region(POOL_REGION_SIZE, pool->node);
+        if (region->base == NULL) {
+                free(region);
+                return -ENOMEM;
+        }
+        region->next = class->regions;
+        class->regions = region;
+
+        for (off = 0; off < POOL_REGION_SIZE; off += class->size) {
+                void *buf = region->base + off;
+
+                *(void **)buf = class->free_list;
+                class->free_list = buf;
+        }
+        return 0;
+}
+
+void *pool_alloc(struct buffer_pool *pool, size_t size) {
+        struct pool_class *class;
+        int i = size_class(size);
+        void *buf = NULL;
+
+        // Too big to share a region, give it a mapping of its own
+        if (i < 0) {
+                __atomic_fetch_add(&pool->large, 1, __ATOMIC_RELAXED);
+                return map_region(round_to_region(size), pool->node);
+        }
+
+        class = &pool->classes[i];
+        pthread_mutex_lock(&class->mutex);
+        if (class->free_list != NULL) {
+                class->hits++;
+        } else {
+                class->misses++;
+                if (pool_grow(pool, class) < 0) {
+                        perror("cannot grow buffer pool");
+                }
+        }
+        if (class->free_list != NULL) {
+                buf = class->free_list;
+                class->free_list = *(void **)buf;
+        }
+        pthread_mutex_unlock(&class->mutex);
+        return buf;
+}
+
+// size must be the size the buffer was allocated with
+void pool_free(struct buffer_pool *pool, void *buf, size_t size) {
+        struct pool_class *class;
+        int i = size_class(size);
+
+        if (buf == NULL) {
+                return;
+        }
+        if (i < 0) {
+                munmap(buf, round_to_region(size));
+                return;
+        }
+
+        class = &pool->classes[i];
+        pthread_mutex_lock(&class->mutex);
+        *(void **)buf = class->free_list;
+        class->free_list = buf;
+        pthread_mutex_unlock(&class->mutex);
+}
+
+// Buffers too big for a size class always count as misses
+void pool_get_stats(struct buffer_pool *pool, uint64_t *hits, uint64_t *misses) {
+        int i;
+
+        *hits = 0;
+        *misses = __atomic_load_n(&pool->large, __ATOMIC_RELAXED);
+        for (i = 0; i < NR_POOL_CLASSES; i++) {
+                pthread_mutex_lock(&pool->classes[i].mutex);
+                *hits += pool->classes[i].hits;
+                *misses += pool->classes[i].misses;
+                pthread_mutex_unlock(&pool->classes[i].mutex);
+        }
+}
@@ -0,0 +1,47 @@
+#ifndef LONGHORN_RPC_POOL_HEADER
+#define LONGHORN_RPC_POOL_HEADER
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// Buffers are carved out of 2 MiB regions, backed by hugepages when the
+// system has them reserved and by transparent hugepages otherwise
+#define POOL_REGION_SIZE        (2 * 1024 * 1024)
+
+// Size classes are powers of two from 4 KiB up to a whole region, so every
+// buffer is at least 4 KiB aligned and can go straight to O_DIRECT I/O
+#define POOL_MIN_BUFFER         4096
+#define NR_POOL_CLASSES         10
+
+struct pool_region {
+        void *base;
+        struct pool_region *next;
+};
+
+struct pool_class {
+        pthread_mutex_t mutex;
+        size_t size;
+        void *free_list;
+        struct pool_region *regions;
+        // Allocations served from the free list, and ones that had to
+        // map a new region first
+        uint64_t hits;
+        uint64_t misses;
+};
+
+struct buffer_pool {
+        int node;  // NUMA node regions are bound to, -1 for any
+        struct pool_class classes[NR_POOL_CLASSES];
+        // Allocations too big for a size class, must be atomic
+        uint64_t large;
+};
+
+struct buffer_pool *new_buffer_pool(int node);
+void free_buffer_pool(struct buffer_pool *pool);
+
+void *pool_alloc(struct buffer_pool *pool, size_t size);
+void pool_free(struct buffer_pool *pool, void *buf, size_t size);
+void pool_get_stats(struct buffer_pool *pool, uint64_t *hits, uint64_t *misses);
+
+#endif
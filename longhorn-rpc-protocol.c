@@ -1,18 +1,31 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <endian.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
 
 #include "longhorn-rpc-protocol.h"
+#include "longhorn-rpc-loopback.h"
 
 int read_full(int fd, void *buf, int len) {
         int readed = 0;
         int ret;
 
         while (readed < len) {
-                ret = read(fd, buf + readed, len - readed);
+                if (is_loopback_fd(fd)) {
+                        ret = loopback_read(fd, buf + readed, len - readed);
+                } else {
+                        ret = read(fd, buf + readed, len - readed);
+                }
                 if (ret < 0) {
                         return ret;
                 }
+                if (ret == 0) {
+                        break;
+                }
                 readed += ret;
         }
         return readed;
@@ -23,7 +36,11 @@ int write_full(int fd, void *buf, int len) {
         int ret;
 
         while (wrote < len) {
-                ret = write(fd, buf + wrote, len - wrote);
+                if (is_loopback_fd(fd)) {
+                        ret = loopback_write(fd, buf + wrote, len - wrote);
+                } else {
+                        ret = write(fd, buf + wrote, len - wrote);
+                }
                 if (ret < 0) {
                         return ret;
                 }
@@ -32,82 +49,230 @@ int write_full(int fd, void *buf, int len) {
         return wrote;
 }
 
-int send_msg(int fd, struct Message *msg) {
-        int n = 0;
+// Header and payload go out in one writev(), only falling back to another
+// call if the socket took part of it
+int writev_full(int fd, struct iovec *iov, int iovcnt) {
+        int wrote = 0;
+        int ret;
 
-        n = write_full(fd, &msg->Seq, sizeof(msg->Seq));
-        if (n != sizeof(msg->Seq)) {
-                fprintf(stderr, "fail to write seq");
-                return -EINVAL;
+        while (iovcnt > 0) {
+                if (is_loopback_fd(fd)) {
+                        ret = loopback_writev(fd, iov, iovcnt);
+                } else {
+                        ret = writev(fd, iov, iovcnt);
+                }
+                if (ret < 0) {
+                        return ret;
+                }
+                wrote += ret;
+                while (iovcnt > 0 && ret >= iov->iov_len) {
+                        ret -= iov->iov_len;
+                        iov++;
+                        iovcnt--;
+                }
+                if (iovcnt > 0) {
+                        iov->iov_base += ret;
+                        iov->iov_len -= ret;
+                }
         }
-        n = write_full(fd, &msg->Type, sizeof(msg->Type));
-        if (n != sizeof(msg->Type)) {
-                fprintf(stderr, "fail to write type");
-                return -EINVAL;
+        return wrote;
+}
+
+// Connections may sit on a socket or on one end of a loopback_pair()
+int close_fd(int fd) {
+        if (is_loopback_fd(fd)) {
+                return loopback_close(fd);
         }
-        n = write_full(fd, &msg->Offset, sizeof(msg->Offset));
-        if (n != sizeof(msg->Offset)) {
-                fprintf(stderr, "fail to write offset");
-                return -EINVAL;
+        return close(fd);
+}
+
+// Wakes up whoever is blocked on fd, without releasing it yet
+int shutdown_fd(int fd) {
+        if (is_loopback_fd(fd)) {
+                return loopback_shutdown(fd);
         }
-        n = write_full(fd, &msg->DataLength, sizeof(msg->DataLength));
-        if (n != sizeof(msg->DataLength)) {
-                fprintf(stderr, "fail to write datalength");
+        return shutdown(fd, SHUT_RDWR);
+}
+
+int send_msg(int fd, struct Message *msg) {
+        struct MessageHeader hdr;
+        struct iovec iov[2];
+        int n, iovcnt = 1, len = sizeof(hdr);
+
+        hdr.Magic = htole32(MESSAGE_MAGIC);
+        hdr.Version = htole16(MESSAGE_VERSION);
+        hdr.Flags = htole16(msg->Flags);
+        hdr.Type = htole16(msg->Type);
+        hdr.Volume = htole16(msg->Volume);
+        hdr.DataLength = htole32(msg->DataLength);
+        hdr.Seq = htole64(msg->Seq);
+        hdr.Offset = htole64(msg->Offset);
+
+        iov[0].iov_base = &hdr;
+        iov[0].iov_len = sizeof(hdr);
+	if ((msg->Flags & FlagData) && msg->DataLength != 0) {
+                iov[1].iov_base = msg->Data;
+                iov[1].iov_len = msg->DataLength;
+                iovcnt++;
+                len += msg->DataLength;
+	}
+
+        n = writev_full(fd, iov, iovcnt);
+        if (n != len) {
+                fprintf(stderr, "fail to write message, %d vs %d\n", len, n);
                 return -EINVAL;
         }
-	if (msg->DataLength != 0) {
-		n = write_full(fd, msg->Data, msg->DataLength);
-		if (n != msg->DataLength) {
-			fprintf(stderr, "fail to write data");
-                        return -EINVAL;
-		}
-	}
         return 0;
 }
 
-// Caller need to release msg->Data
-int receive_msg(int fd, struct Message *msg) {
-	void *buf;
+int receive_msg_header(int fd, struct Message *msg) {
+        struct MessageHeader hdr;
 	int n;
 
         bzero(msg, sizeof(struct Message));
 
         // There is only one thread reading the response, and socket is
         // full-duplex, so no need to lock
-	n = read_full(fd, &msg->Seq, sizeof(msg->Seq));
-        if (n != sizeof(msg->Seq)) {
-                fprintf(stderr, "fail to write seq");
+	n = read_full(fd, &hdr, sizeof(hdr));
+        if (n != sizeof(hdr)) {
+                fprintf(stderr, "fail to read header, %d vs %lu\n", n, sizeof(hdr));
 		return -EINVAL;
         }
-        n = read_full(fd, &msg->Type, sizeof(msg->Type));
-        if (n != sizeof(msg->Type)) {
-                fprintf(stderr, "fail to read type");
-		return -EINVAL;
+        if (le32toh(hdr.Magic) != MESSAGE_MAGIC) {
+                fprintf(stderr, "invalid magic 0x%x\n", le32toh(hdr.Magic));
+                return -EPROTO;
         }
-        n = read_full(fd, &msg->Offset, sizeof(msg->Offset));
-        if (n != sizeof(msg->Offset)) {
-                fprintf(stderr, "fail to read offset");
-		return -EINVAL;
+        if (le16toh(hdr.Version) != MESSAGE_VERSION) {
+                fprintf(stderr, "unsupported protocol version %d\n",
+                                le16toh(hdr.Version));
+                return -EPROTO;
         }
-        n = read_full(fd, &msg->DataLength, sizeof(msg->DataLength));
-        if (n != sizeof(msg->DataLength)) {
-                fprintf(stderr, "fail to read datalength");
-		return -EINVAL;
+
+        msg->Seq = le64toh(hdr.Seq);
+        msg->Type = le16toh(hdr.Type);
+        msg->Flags = le16toh(hdr.Flags);
+        msg->Volume = le16toh(hdr.Volume);
+        msg->Offset = le64toh(hdr.Offset);
+        msg->DataLength = le32toh(hdr.DataLength);
+
+        if (msg->DataLength > MAX_DATA_LENGTH) {
+                fprintf(stderr, "data length %u exceeds maximum %u\n",
+                                msg->DataLength, MAX_DATA_LENGTH);
+                return -EINVAL;
         }
+        return 0;
+}
+
+int receive_data(int fd, void *buf, uint32_t len) {
+        int n;
+
+        n = read_full(fd, buf, len);
+        if (n != len) {
+                fprintf(stderr, "Cannot read full from fd, %u vs %d\n", len, n);
+                return -EINVAL;
+        }
+        return 0;
+}
+
+int discard_data(int fd, uint32_t len) {
+        char buf[4096];
+        uint32_t n;
+        int rc;
+
+        while (len > 0) {
+                n = len < sizeof(buf) ? len : sizeof(buf);
+                rc = receive_data(fd, buf, n);
+                if (rc < 0) {
+                        return rc;
+                }
+                len -= n;
+        }
+        return 0;
+}
+
+// Caller need to release msg->Data
+int receive_msg(int fd, struct Message *msg) {
+        int rc;
 
-	if (msg->DataLength > 0) {
+        rc = receive_msg_header(fd, msg);
+        if (rc < 0) {
+                return rc;
+        }
+
+	if ((msg->Flags & FlagData) && msg->DataLength > 0) {
 		msg->Data = malloc(msg->DataLength);
                 if (msg->Data == NULL) {
                         perror("cannot allocate memory for data");
                         return -EINVAL;
                 }
-		n = read_full(fd, msg->Data, msg->DataLength);
-		if (n != msg->DataLength) {
-                        fprintf(stderr, "Cannot read full from fd, %d vs %d\n",
-                                msg->DataLength, n);
+                rc = receive_data(fd, msg->Data, msg->DataLength);
+		if (rc < 0) {
 			free(msg->Data);
-			return -EINVAL;
+			return rc;
 		}
 	}
 	return 0;
 }
+
+int send_handshake(int fd, uint32_t type, struct Handshake *hs) {
+        struct Handshake wire;
+        struct Message msg;
+
+        wire.MaxDataLength = htole32(hs->MaxDataLength);
+        wire.MaxInflight = htole32(hs->MaxInflight);
+        wire.MaxInflightBytes = htole32(hs->MaxInflightBytes);
+        wire.Features = htole64(hs->Features);
+
+        bzero(&msg, sizeof(msg));
+        msg.Type = type;
+        msg.Flags = FlagData;
+        msg.DataLength = sizeof(wire);
+        msg.Data = &wire;
+        return send_msg(fd, &msg);
+}
+
+int receive_handshake(int fd, uint32_t type, struct Handshake *hs) {
+        struct Handshake wire;
+        struct Message msg;
+        int rc;
+
+        rc = receive_msg_header(fd, &msg);
+        if (rc < 0) {
+                return rc;
+        }
+        if (msg.Type != type || !(msg.Flags & FlagData) ||
+                        msg.DataLength != sizeof(wire)) {
+                fprintf(stderr, "invalid handshake, type %d length %u\n",
+                                msg.Type, msg.DataLength);
+                return -EPROTO;
+        }
+        rc = receive_data(fd, &wire, sizeof(wire));
+        if (rc < 0) {
+                return rc;
+        }
+
+        hs->MaxDataLength = le32toh(wire.MaxDataLength);
+        hs->MaxInflight = le32toh(wire.MaxInflight);
+        hs->MaxInflightBytes = le32toh(wire.MaxInflightBytes);
+        hs->Features = le64toh(wire.Features);
+        return 0;
+}
+
+// Every field is a uint64_t
+void stats_to_le(struct StatsReply *stats) {
+        uint64_t *v = (uint64_t *)stats;
+        int i;
+
+        for (i = 0; i < sizeof(struct StatsReply) / sizeof(uint64_t); i++) {
+                v[i] = htole64(v[i]);
+        }
+}
+
+void stats_from_le(struct StatsReply *stats) {
+        uint64_t *v = (uint64_t *)stats;
+        int i;
+
+        for (i = 0; i < sizeof(struct StatsReply) / sizeof(uint64_t); i++) {
+                v[i] = le64toh(v[i]);
+        }
+}
@@ -1,13 +1,65 @@
 #ifndef LONGHORN_RPC_PROTOCOL_HEADER
 #define LONGHORN_RPC_PROTOCOL_HEADER
 
+#include <stdint.h>
+#include <time.h>
 #include <pthread.h>
+#include <sys/uio.h>
 
 #include "uthash.h"
 
+#define MESSAGE_MAGIC   0x5052484c      // "LHRP" on the wire
+#define MESSAGE_VERSION 2
+
+// Monotonic time in ns, what every latency, deadline and rate is
+// measured with
+static inline uint64_t now_ns() {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Called on every round of a spin loop
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#else
+        __sync_synchronize();
+#endif
+}
+
+// Largest payload a single message may carry. Bigger requests are split
+// into fragments by the client, so neither side ever has to buffer more
+// than this for one message. The handshake may lower it per connection.
+#define MAX_DATA_LENGTH (1024 * 1024)
+
+// Default credits the server grants a client: requests and payload bytes
+// it may have in flight at once
+#define DEFAULT_MAX_INFLIGHT 128
+#define DEFAULT_MAX_INFLIGHT_BYTES (64 * 1024 * 1024)
+
+// Fixed size v2 wire header, little-endian. Readers fetch it with a single
+// read and then pull DataLength bytes of payload only if FlagData is set;
+// read requests and write responses describe DataLength bytes without
+// carrying them. Volume picks one of the volumes the server exports, it is
+// always 0 unless FeatureVolumes was negotiated.
+struct MessageHeader {
+        uint32_t        Magic;
+        uint16_t        Version;
+        uint16_t        Flags;
+        uint16_t        Type;
+        uint16_t        Volume;
+        uint32_t        DataLength;
+        uint64_t        Seq;
+        int64_t         Offset;
+} __attribute__((packed));
+
 struct Message {
-        uint32_t        Seq;
+        uint64_t        Seq;
         uint32_t        Type;
+        uint32_t        Flags;
+        uint16_t        Volume;
         int64_t         Offset;
         uint32_t        DataLength;
         void*           Data;
@@ -15,6 +67,23 @@ struct Message {
 	pthread_cond_t  cond;
 	pthread_mutex_t mutex;
 
+        // Client side bookkeeping for fragmented requests. Every fragment
+        // points to the request it belongs to (a request that fits in one
+        // message is its own parent), and the parent counts the fragments
+        // still in flight.
+        struct Message  *parent;
+        int             pending;
+        int             rc;
+        // When the client sent the request, for its latency
+        uint64_t        start;
+
+        // Set for requests from submit_request(), called instead of waking
+        // up a waiter
+        void            (*done) (void *data, int rc);
+        void            *done_data;
+        // Set by cancel_request(), responses are then discarded
+        int             cancelled;
+
         UT_hash_handle hh;
 };
 
@@ -23,10 +92,84 @@ enum uint32_t {
 	TypeWrite,
 	TypeResponse,
 	TypeError,
-	TypeEOF
+	TypeEOF,
+        TypeHandshake,
+        TypeStats
+};
+
+// Message flags
+#define FlagData        (1 << 0)        // DataLength bytes of payload follow
+
+// Priority class of a request, in bits 1-2 of the flags. Only sent when
+// FeaturePriority was negotiated.
+#define FlagPriorityShift       1
+#define FlagPriorityMask        (3 << FlagPriorityShift)
+
+#define PriorityNormal  0       // foreground I/O
+#define PriorityIdle    1       // background I/O like rebuilds, served
+                                // when nothing else is waiting
+
+// Payload of TypeHandshake, little-endian. The client sends what it wants,
+// the server answers with what the connection will use: the smaller of the
+// two limits and the features both sides support. MaxInflight and
+// MaxInflightBytes are the credits the client must stay within.
+struct Handshake {
+        uint32_t        MaxDataLength;
+        uint32_t        MaxInflight;
+        uint32_t        MaxInflightBytes;
+        uint64_t        Features;
+} __attribute__((packed));
+
+// Optional protocol features, negotiated per connection
+#define FeaturePriority         (1 << 0)        // priority classes in flags
+#define FeatureVolumes          (1 << 1)        // volume IDs in the header
+#define FeatureStats            (1 << 2)        // TypeStats requests
+
+#define SUPPORTED_FEATURES      (FeaturePriority | FeatureVolumes | FeatureStats)
+
+// Payload of the response to TypeStats, little-endian and all uint64_t, so
+// there is no padding to pack. A TypeStats request carries no payload but
+// a DataLength of sizeof(struct StatsReply), like a read. Covers every
+// connection sharing the server's stats, totals since the server started.
+// Latencies are in ns and indexed by server stage: receive, queue, handle,
+// respond.
+struct StatsReply {
+        uint64_t        Connections;
+        uint64_t        Inflight;       // requests holding credits
+        uint64_t        InflightBytes;
+        uint64_t        Queued;         // received, no handler started yet
+        uint64_t        Running;        // handler started, not answered
+        uint64_t        ThrottleQueued;
+        uint64_t        Throttled;      // requests throttling delayed
+        uint64_t        ThrottleDelay;  // total ns they were delayed
+        uint64_t        Reads;
+        uint64_t        Writes;
+        uint64_t        ReadBytes;
+        uint64_t        WriteBytes;
+        uint64_t        ReadErrors;
+        uint64_t        WriteErrors;
+        uint64_t        Rejected;       // over the client's credits
+        uint64_t        PoolHits;       // payload buffers from the free lists
+        uint64_t        PoolMisses;     // ones that had to map a new region
+        uint64_t        LatencyP50[4];
+        uint64_t        LatencyP99[4];
+        uint64_t        LatencyP999[4];
 };
 
+int read_full(int fd, void *buf, int len);
+int write_full(int fd, void *buf, int len);
+int writev_full(int fd, struct iovec *iov, int iovcnt);
+int close_fd(int fd);
+int shutdown_fd(int fd);
 int send_msg(int fd, struct Message *msg);
 int receive_msg(int fd, struct Message *msg);
+int receive_msg_header(int fd, struct Message *msg);
+int receive_data(int fd, void *buf, uint32_t len);
+int discard_data(int fd, uint32_t len);
+
+int send_handshake(int fd, uint32_t type, struct Handshake *hs);
+int receive_handshake(int fd, uint32_t type, struct Handshake *hs);
+void stats_to_le(struct StatsReply *stats);
+void stats_from_le(struct StatsReply *stats);
 
 #endif
@@ -0,0 +1,180 @@
+#include <stdio.h>
+
+#include "longhorn-rpc-range-lock.h"
+
+void range_lock_init(struct range_lock *rl) {
+        pthread_mutex_init(&rl->mutex, NULL);
+        rl->root = NULL;
+        rl->next_seq = 0;
+        rl->random = 2463534242U;
+}
+
+static uint32_t next_priority(struct range_lock *rl) {
+        uint32_t x = rl->random;
+
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        rl->random = x;
+        return x;
+}
+
+static int conflicts(struct range_lock_entry *a, struct range_lock_entry *b) {
+        return (a->exclusive || b->exclusive) &&
+                a->start < b->end && b->start < a->end;
+}
+
+static int key_less(struct range_lock_entry *a, struct range_lock_entry *b) {
+        return a->start < b->start || (a->start == b->start && a->seq < b->seq);
+}
+
+static void update_max_end(struct range_lock_entry *n) {
+        n->max_end = n->end;
+        if (n->left != NULL && n->left->max_end > n->max_end) {
+                n->max_end = n->left->max_end;
+        }
+        if (n->right != NULL && n->right->max_end > n->max_end) {
+                n->max_end = n->right->max_end;
+        }
+}
+
+static struct range_lock_entry *rotate_right(struct range_lock_entry *n) {
+        struct range_lock_entry *l = n->left;
+
+        n->left = l->right;
+        l->right = n;
+        update_max_end(n);
+        update_max_end(l);
+        return l;
+}
+
+static struct range_lock_entry *rotate_left(struct range_lock_entry *n) {
+        struct range_lock_entry *r = n->right;
+
+        n->right = r->left;
+        r->left = n;
+        update_max_end(n);
+        update_max_end(r);
+        return r;
+}
+
+static struct range_lock_entry *tree_insert(struct range_lock_entry *n,
+                struct range_lock_entry *entry) {
+        if (n == NULL) {
+                entry->left = NULL;
+                entry->right = NULL;
+                entry->max_end = entry->end;
+                return entry;
+        }
+        if (key_less(entry, n)) {
+                n->left = tree_insert(n->left, entry);
+                if (n->left->priority > n->priority) {
+                        n = rotate_right(n);
+                }
+        } else {
+                n->right = tree_insert(n->right, entry);
+                if (n->right->priority > n->priority) {
+                        n = rotate_left(n);
+                }
+        }
+        update_max_end(n);
+        return n;
+}
+
+static struct range_lock_entry *tree_remove(struct range_lock_entry *n,
+                struct range_lock_entry *entry) {
+        if (n == NULL) {
+                fprintf(stderr, "BUG: range lock entry not found\n");
+                return NULL;
+        }
+        if (n == entry) {
+                if (n->left == NULL) {
+                        return n->right;
+                }
+                if (n->right == NULL) {
+                        return n->left;
+                }
+                // Rotate the entry down until it has at most one child
+                if (n->left->priority > n->right->priority) {
+                        n = rotate_right(n);
+                        n->right = tree_remove(n->right, entry);
+                } else {
+                        n = rotate_left(n);
+                        n->left = tree_remove(n->left, entry);
+                }
+        } else if (key_less(entry, n)) {
+                n->left = tree_remove(n->left, entry);
+        } else {
+                n->right = tree_remove(n->right, entry);
+        }
+        update_max_end(n);
+        return n;
+}
+
+// Everything in the tree arrived before entry
+static int count_blockers(struct range_lock_entry *n,
+                struct range_lock_entry *entry) {
+        int count = 0;
+
+        if (n == NULL || n->max_end <= entry->start) {
+                return 0;
+        }
+        count += count_blockers(n->left, entry);
+        if (conflicts(n, entry)) {
+                count++;
+        }
+        if (n->start < entry->end) {
+                count += count_blockers(n->right, entry);
+        }
+        return count;
+}
+
+// Every later conflicting entry counted the released one as a blocker
+static void release_waiters(struct range_lock_entry *n,
+                struct range_lock_entry *released,
+                struct range_lock_entry **granted) {
+        if (n == NULL || n->max_end <= released->start) {
+                return;
+        }
+        release_waiters(n->left, released, granted);
+        if (n->seq > released->seq && conflicts(n, released)) {
+                n->blockers--;
+                if (n->blockers == 0) {
+                        n->next_granted = *granted;
+                        *granted = n;
+                }
+        }
+        if (n->start < released->end) {
+                release_waiters(n->right, released, granted);
+        }
+}
+
+// Returns 1 if the range is granted right away, 0 if the entry is queued
+// behind conflicting ones and entry->granted will be called later
+int range_lock(struct range_lock *rl, struct range_lock_entry *entry) {
+        int blockers;
+
+        pthread_mutex_lock(&rl->mutex);
+        entry->seq = rl->next_seq++;
+        entry->priority = next_priority(rl);
+        entry->next_granted = NULL;
+        entry->blockers = blockers = count_blockers(rl->root, entry);
+        rl->root = tree_insert(rl->root, entry);
+        pthread_mutex_unlock(&rl->mutex);
+
+        return blockers == 0;
+}
+
+void range_unlock(struct range_lock *rl, struct range_lock_entry *entry) {
+        struct range_lock_entry *granted = NULL, *next;
+
+        pthread_mutex_lock(&rl->mutex);
+        rl->root = tree_remove(rl->root, entry);
+        release_waiters(rl->root, entry, &granted);
+        pthread_mutex_unlock(&rl->mutex);
+
+        for (; granted != NULL; granted = next) {
+                next = granted->next_granted;
+                granted->granted(granted);
+        }
+}
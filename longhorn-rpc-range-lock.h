@@ -0,0 +1,43 @@
+#ifndef LONGHORN_RPC_RANGE_LOCK_HEADER
+#define LONGHORN_RPC_RANGE_LOCK_HEADER
+
+#include <stdint.h>
+#include <pthread.h>
+
+// One locked or waiting byte range [start, end). Shared entries only
+// conflict with exclusive ones. An entry waits for every conflicting entry
+// that arrived before it, so overlapping requests run in arrival order
+// while unrelated ones run in parallel.
+struct range_lock_entry {
+        uint64_t start;
+        uint64_t end;
+        int exclusive;
+
+        // Called, without the lock held, once a queued entry is granted
+        void (*granted)(struct range_lock_entry *entry);
+
+        // Private to the range lock
+        uint64_t seq;
+        int blockers;
+        struct range_lock_entry *next_granted;
+
+        // Interval tree node, a treap keyed on (start, seq) and augmented
+        // with the largest end in the subtree
+        struct range_lock_entry *left;
+        struct range_lock_entry *right;
+        uint32_t priority;
+        uint64_t max_end;
+};
+
+struct range_lock {
+        pthread_mutex_t mutex;
+        struct range_lock_entry *root;
+        uint64_t next_seq;
+        uint32_t random;
+};
+
+void range_lock_init(struct range_lock *rl);
+int range_lock(struct range_lock *rl, struct range_lock_entry *entry);
+void range_unlock(struct range_lock *rl, struct range_lock_entry *entry);
+
+#endif
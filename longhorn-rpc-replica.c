@@ -0,0 +1,659 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "longhorn-rpc-client.h"
+#include "longhorn-rpc-replica.h"
+
+struct replica_write;
+struct replica_read;
+
+// What a replica's completion needs to find its write
+struct replica_ack {
+        struct replica_write *write;
+        int replica;
+        int done;
+        // Sent by the replica's submit thread
+        int deferred;
+};
+
+// A write queued for the submit thread of a lagging replica
+struct replica_job {
+        struct replica_ack *ack;
+        void *buf;
+        size_t count;
+        off_t offset;
+        struct replica_job *next;
+};
+
+// One write fanned out to the replicas. It lives until the last replica
+// answered, which may be well after the caller got its result.
+struct replica_write {
+        struct replica_set *set;
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+        int acked;
+        int failed;
+        int outstanding;
+        int returned;
+        struct replica_ack acks[];
+};
+
+// One try of a read on one replica
+struct replica_attempt {
+        struct replica_read *read;
+        int replica;
+        void *buf;
+        struct Message *req;
+        uint64_t start;
+        int done;
+        int rc;
+};
+
+// A read and its hedge. Freed by whoever drops the last reference: the
+// caller, or the completion of an attempt that lost.
+struct replica_read {
+        struct replica_set *set;
+        size_t count;
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+        int refs;
+        int nr_attempts;
+        int winner;
+        struct replica_attempt attempts[2];
+};
+
+static void free_replica_write(struct replica_write *w) {
+        pthread_cond_destroy(&w->cond);
+        pthread_mutex_destroy(&w->mutex);
+        free(w);
+}
+
+static void replica_write_done(void *data, int rc) {
+        struct replica_ack *ack = data;
+        struct replica_write *w = ack->write;
+        struct replica_set *set = w->set;
+        int replica = ack->replica;
+        struct replica *r = &set->replicas[replica];
+        int late, last;
+
+        pthread_mutex_lock(&w->mutex);
+        if (rc < 0) {
+                w->failed++;
+        } else {
+                w->acked++;
+        }
+        ack->done = 1;
+        w->outstanding--;
+        late = w->returned;
+        last = w->outstanding == 0;
+        if (!late) {
+                pthread_cond_signal(&w->cond);
+        }
+        // Unless late, w may be freed by replica_write_at() from here on
+        pthread_mutex_unlock(&w->mutex);
+
+        pthread_mutex_lock(&set->mutex);
+        if (rc < 0) {
+                if (r->state != ReplicaFailed) {
+                        fprintf(stderr, "Replica %d failed: %s\n", replica,
+                                        strerror(-rc));
+                }
+                r->state = ReplicaFailed;
+                r->errors++;
+        }
+        if (late) {
+                r->behind--;
+                if (r->behind == 0 && r->state == ReplicaLagging) {
+                        r->state = ReplicaHealthy;
+                }
+        }
+        pthread_mutex_unlock(&set->mutex);
+
+        if (late && last) {
+                free_replica_write(w);
+        }
+}
+
+static void *replica_submit_thread(void *arg) {
+        struct replica *r = arg;
+        struct replica_set *set = r->set;
+        struct replica_job *job;
+        int rc;
+
+        pthread_mutex_lock(&set->mutex);
+        while (1) {
+                while (r->jobs == NULL && !set->stopping) {
+                        pthread_cond_wait(&r->jobs_cond, &set->mutex);
+                }
+                job = r->jobs;
+                if (job == NULL) {
+                        break;
+                }
+                r->jobs = job->next;
+                if (r->jobs == NULL) {
+                        r->jobs_tail = NULL;
+                }
+                pthread_mutex_unlock(&set->mutex);
+
+                rc = submit_request(r->conn, TypeWrite, 0, job->buf, job->count,
+                                job->offset, PriorityDefault, replica_write_done,
+                                job->ack, NULL);
+                if (rc < 0) {
+                        replica_write_done(job->ack, rc);
+                }
+                // The payload is on the wire, the copy can go
+                free(job->buf);
+                free(job);
+
+                pthread_mutex_lock(&set->mutex);
+                r->nr_jobs--;
+        }
+        pthread_mutex_unlock(&set->mutex);
+        return NULL;
+}
+
+// Hands the write to the submit thread of the ack's replica
+static void defer_write(struct replica_set *set, struct replica_ack *ack,
+                void *buf, size_t count, off_t offset) {
+        struct replica *r = &set->replicas[ack->replica];
+        struct replica_job *job;
+
+        job = malloc(sizeof(struct replica_job));
+        if (job != NULL) {
+                job->buf = malloc(count);
+                if (job->buf == NULL) {
+                        free(job);
+                        job = NULL;
+                }
+        }
+        if (job == NULL) {
+                pthread_mutex_lock(&set->mutex);
+                r->nr_jobs--;
+                pthread_mutex_unlock(&set->mutex);
+                replica_write_done(ack, -ENOMEM);
+                return;
+        }
+        memcpy(job->buf, buf, count);
+        job->ack = ack;
+        job->count = count;
+        job->offset = offset;
+        job->next = NULL;
+
+        pthread_mutex_lock(&set->mutex);
+        if (r->jobs_tail != NULL) {
+                r->jobs_tail->next = job;
+        } else {
+                r->jobs = job;
+        }
+        r->jobs_tail = job;
+        pthread_cond_signal(&r->jobs_cond);
+        pthread_mutex_unlock(&set->mutex);
+}
+
+// Sends the write to every replica that hasn't failed without waiting in
+// between, so the round-trips overlap and the write takes as long as the
+// slowest replica of the quorum. Replicas that haven't answered by then
+// are marked lagging until they catch up, and get their writes through
+// their submit thread meanwhile. buf may be reused on return.
+int replica_write_at(struct replica_set *set, void *buf, size_t count, off_t offset) {
+        struct replica_write *w;
+        struct replica *r;
+        int i, rc, nr = 0;
+
+        w = malloc(sizeof(struct replica_write) +
+                        set->nr_replicas * sizeof(struct replica_ack));
+        if (w == NULL) {
+                perror("cannot allocate memory for replicated write");
+                return -ENOMEM;
+        }
+        w->set = set;
+        w->acked = 0;
+        w->failed = 0;
+        w->returned = 0;
+        pthread_mutex_init(&w->mutex, NULL);
+        pthread_cond_init(&w->cond, NULL);
+
+        pthread_mutex_lock(&set->mutex);
+        for (i = 0; i < set->nr_replicas; i++) {
+                r = &set->replicas[i];
+                if (r->state != ReplicaFailed &&
+                                r->nr_jobs >= REPLICA_MAX_DEFERRED) {
+                        fprintf(stderr, "Replica %d fell too far behind\n", i);
+                        r->state = ReplicaFailed;
+                }
+                if (r->state == ReplicaFailed) {
+                        continue;
+                }
+                w->acks[nr].write = w;
+                w->acks[nr].replica = i;
+                w->acks[nr].done = 0;
+                // Keeps going through the thread until its queue is
+                // empty, so writes to a replica stay in order
+                w->acks[nr].deferred = r->state == ReplicaLagging ||
+                        r->nr_jobs > 0;
+                if (w->acks[nr].deferred) {
+                        r->nr_jobs++;
+                }
+                nr++;
+        }
+        if (nr < set->quorum) {
+                for (i = 0; i < nr; i++) {
+                        if (w->acks[i].deferred) {
+                                set->replicas[w->acks[i].replica].nr_jobs--;
+                        }
+                }
+                pthread_mutex_unlock(&set->mutex);
+                free_replica_write(w);
+                return -EIO;
+        }
+        pthread_mutex_unlock(&set->mutex);
+        w->outstanding = nr;
+
+        for (i = 0; i < nr; i++) {
+                if (w->acks[i].deferred) {
+                        defer_write(set, &w->acks[i], buf, count, offset);
+                }
+        }
+        for (i = 0; i < nr; i++) {
+                if (w->acks[i].deferred) {
+                        continue;
+                }
+                r = &set->replicas[w->acks[i].replica];
+                rc = submit_request(r->conn, TypeWrite, 0, buf, count, offset,
+                                PriorityDefault, replica_write_done,
+                                &w->acks[i], NULL);
+                if (rc < 0) {
+                        replica_write_done(&w->acks[i], rc);
+                }
+        }
+
+        pthread_mutex_lock(&w->mutex);
+        while (w->acked < set->quorum &&
+                        w->acked + w->outstanding >= set->quorum) {
+                pthread_cond_wait(&w->cond, &w->mutex);
+        }
+        rc = w->acked >= set->quorum ? 0 : -EIO;
+        w->returned = 1;
+
+        // Still holding w->mutex, so the late completions can't run ahead
+        // of this
+        if (w->outstanding != 0) {
+                pthread_mutex_lock(&set->mutex);
+                for (i = 0; i < nr; i++) {
+                        struct replica *r = &set->replicas[w->acks[i].replica];
+
+                        if (w->acks[i].done) {
+                                continue;
+                        }
+                        r->behind++;
+                        if (r->state == ReplicaHealthy) {
+                                r->state = ReplicaLagging;
+                        }
+                }
+                pthread_mutex_unlock(&set->mutex);
+                pthread_mutex_unlock(&w->mutex);
+                return rc;
+        }
+        pthread_mutex_unlock(&w->mutex);
+        free_replica_write(w);
+        return rc;
+}
+
+static int compare_latency(const void *a, const void *b) {
+        uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+        return x < y ? -1 : x > y;
+}
+
+// Called with set->mutex held
+static void update_hedge_threshold(struct replica_set *set) {
+        uint64_t sorted[HEDGE_SAMPLES];
+        int n = set->nr_samples < HEDGE_SAMPLES ? set->nr_samples : HEDGE_SAMPLES;
+
+        memcpy(sorted, set->samples, n * sizeof(uint64_t));
+        qsort(sorted, n, sizeof(uint64_t), compare_latency);
+        set->hedge_ns = sorted[(n - 1) * set->hedge_percentile / 100];
+}
+
+static void record_read_latency(struct replica_set *set, struct replica *r,
+                uint64_t latency) {
+        pthread_mutex_lock(&set->mutex);
+        if (r->read_latency_ns == 0) {
+                r->read_latency_ns = latency;
+        } else {
+                r->read_latency_ns += ((int64_t)latency -
+                                (int64_t)r->read_latency_ns) / 8;
+        }
+        set->samples[set->nr_samples++ % HEDGE_SAMPLES] = latency;
+        if (set->hedge_percentile != 0 &&
+                        set->nr_samples >= HEDGE_MIN_SAMPLES &&
+                        set->nr_samples % HEDGE_UPDATE == 0) {
+                update_hedge_threshold(set);
+        }
+        pthread_mutex_unlock(&set->mutex);
+}
+
+// Called with set->mutex held. Returns -1 if no replica other than exclude
+// is left.
+static int pick_replica(struct replica_set *set, int exclude) {
+        struct replica *r;
+        uint64_t load, best_load = 0;
+        int i, n, best = -1;
+        int explore = set->next_read % READ_EXPLORE == 0;
+
+        // Start at a different replica every time so ties spread out
+        for (i = 0; i < set->nr_replicas; i++) {
+                n = (set->next_read + i) % set->nr_replicas;
+                r = &set->replicas[n];
+                if (n == exclude || r->state == ReplicaFailed) {
+                        continue;
+                }
+                if (explore) {
+                        best = n;
+                        break;
+                }
+                if (set->read_policy == ReadLeastInflight) {
+                        load = __atomic_load_n(&r->conn->inflight, __ATOMIC_RELAXED);
+                } else {
+                        load = r->read_latency_ns;
+                }
+                if (best < 0 || load < best_load) {
+                        best = n;
+                        best_load = load;
+                }
+        }
+        set->next_read++;
+        return best;
+}
+
+static void free_replica_read(struct replica_read *rd) {
+        struct replica_attempt *hedge = &rd->attempts[1];
+
+        if (rd->nr_attempts > 1) {
+                client_free_buffer(rd->set->replicas[hedge->replica].conn,
+                                hedge->buf, rd->count);
+        }
+        pthread_cond_destroy(&rd->cond);
+        pthread_mutex_destroy(&rd->mutex);
+        free(rd);
+}
+
+static void replica_read_done(void *data, int rc) {
+        struct replica_attempt *a = data;
+        struct replica_read *rd = a->read;
+        struct replica_set *set = rd->set;
+        struct replica *r = &set->replicas[a->replica];
+        int last;
+
+        // A cancelled read still took this long to be answered
+        if (rc == 0 || rc == -ECANCELED) {
+                record_read_latency(set, r, now_ns() - a->start);
+        } else {
+                pthread_mutex_lock(&set->mutex);
+                if (r->state != ReplicaFailed) {
+                        fprintf(stderr, "Replica %d failed: %s\n", a->replica,
+                                        strerror(-rc));
+                }
+                r->state = ReplicaFailed;
+                r->errors++;
+                pthread_mutex_unlock(&set->mutex);
+        }
+
+        pthread_mutex_lock(&rd->mutex);
+        a->done = 1;
+        a->rc = rc;
+        if (rc == 0 && rd->winner < 0) {
+                rd->winner = a - rd->attempts;
+        }
+        pthread_cond_signal(&rd->cond);
+        last = --rd->refs == 0;
+        pthread_mutex_unlock(&rd->mutex);
+
+        if (last) {
+                free_replica_read(rd);
+        }
+}
+
+static void start_attempt(struct replica_read *rd, int replica, void *buf,
+                off_t offset) {
+        struct replica_attempt *a = &rd->attempts[rd->nr_attempts];
+        int rc;
+
+        a->read = rd;
+        a->replica = replica;
+        a->buf = buf;
+        a->req = NULL;
+        a->done = 0;
+        a->rc = 0;
+        a->start = now_ns();
+
+        pthread_mutex_lock(&rd->mutex);
+        rd->refs++;
+        rd->nr_attempts++;
+        pthread_mutex_unlock(&rd->mutex);
+
+        rc = submit_request(rd->set->replicas[replica].conn, TypeRead, 0, buf,
+                        rd->count, offset, PriorityDefault, replica_read_done,
+                        a, &a->req);
+        if (rc < 0) {
+                replica_read_done(a, rc);
+        }
+}
+
+// Called with rd->mutex held. Waits until the first attempt completed or
+// the hedge threshold passed.
+static void wait_first_attempt(struct replica_read *rd, uint64_t hedge_ns) {
+        struct replica_attempt *a = &rd->attempts[0];
+        uint64_t deadline = a->start + hedge_ns;
+        struct timespec ts;
+
+        ts.tv_sec = deadline / 1000000000ULL;
+        ts.tv_nsec = deadline % 1000000000ULL;
+        while (!a->done) {
+                if (hedge_ns == 0) {
+                        pthread_cond_wait(&rd->cond, &rd->mutex);
+                } else if (pthread_cond_timedwait(&rd->cond, &rd->mutex,
+                                        &ts) == ETIMEDOUT) {
+                        break;
+                }
+        }
+}
+
+// Reads from the replica the read policy picks. If it fails, or hasn't
+// answered within the hedge threshold, the read also goes to another
+// replica, into a buffer of its own, and the first good answer wins. A
+// losing first attempt is cancelled so it can't touch buf after return.
+int replica_read_at(struct replica_set *set, void *buf, size_t count, off_t offset) {
+        struct replica_read *rd;
+        struct replica_attempt *first;
+        pthread_condattr_t attr;
+        uint64_t hedge_ns;
+        void *hedge_buf;
+        int primary, replica, winner, last;
+
+        rd = malloc(sizeof(struct replica_read));
+        if (rd == NULL) {
+                perror("cannot allocate memory for replicated read");
+                return -ENOMEM;
+        }
+        rd->set = set;
+        rd->count = count;
+        rd->refs = 1;
+        rd->nr_attempts = 0;
+        rd->winner = -1;
+        first = &rd->attempts[0];
+        pthread_mutex_init(&rd->mutex, NULL);
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&rd->cond, &attr);
+        pthread_condattr_destroy(&attr);
+
+        pthread_mutex_lock(&set->mutex);
+        primary = pick_replica(set, -1);
+        hedge_ns = set->hedge_percentile != 0 ? set->hedge_ns : 0;
+        set->reads++;
+        pthread_mutex_unlock(&set->mutex);
+        if (primary < 0) {
+                free_replica_read(rd);
+                return -EIO;
+        }
+        start_attempt(rd, primary, buf, offset);
+
+        pthread_mutex_lock(&rd->mutex);
+        wait_first_attempt(rd, hedge_ns);
+        if (rd->winner < 0) {
+                pthread_mutex_unlock(&rd->mutex);
+
+                pthread_mutex_lock(&set->mutex);
+                replica = pick_replica(set, primary);
+                if (replica >= 0) {
+                        set->hedged++;
+                }
+                pthread_mutex_unlock(&set->mutex);
+                if (replica >= 0) {
+                        hedge_buf = client_alloc_buffer(set->replicas[replica].conn,
+                                        count);
+                        if (hedge_buf != NULL) {
+                                start_attempt(rd, replica, hedge_buf, offset);
+                        }
+                }
+
+                pthread_mutex_lock(&rd->mutex);
+                while (rd->winner < 0 && (!first->done ||
+                                (rd->nr_attempts > 1 && !rd->attempts[1].done))) {
+                        pthread_cond_wait(&rd->cond, &rd->mutex);
+                }
+        }
+
+        winner = rd->winner;
+        if (winner == 1) {
+                // Not done means its callback hasn't run, so the request is
+                // still valid
+                if (!first->done) {
+                        cancel_request(set->replicas[primary].conn, first->req);
+                }
+                memcpy(buf, rd->attempts[1].buf, count);
+        }
+        last = --rd->refs == 0;
+        pthread_mutex_unlock(&rd->mutex);
+        if (last) {
+                free_replica_read(rd);
+        }
+
+        if (winner == 1) {
+                pthread_mutex_lock(&set->mutex);
+                set->hedge_wins++;
+                pthread_mutex_unlock(&set->mutex);
+        }
+        return winner >= 0 ? 0 : -EIO;
+}
+
+// hedge_percentile of the recent read latencies is how long a read waits
+// before it is hedged, 0 to never hedge. Reads are only hedged once
+// enough latencies have been seen.
+int set_read_policy(struct replica_set *set, enum replica_read_policy policy,
+                int hedge_percentile) {
+        if (hedge_percentile < 0 || hedge_percentile > 100) {
+                return -EINVAL;
+        }
+        pthread_mutex_lock(&set->mutex);
+        set->read_policy = policy;
+        set->hedge_percentile = hedge_percentile;
+        if (hedge_percentile != 0 && set->nr_samples >= HEDGE_MIN_SAMPLES) {
+                update_hedge_threshold(set);
+        }
+        pthread_mutex_unlock(&set->mutex);
+        return 0;
+}
+
+enum replica_state get_replica_state(struct replica_set *set, int i) {
+        enum replica_state state;
+
+        pthread_mutex_lock(&set->mutex);
+        state = set->replicas[i].state;
+        pthread_mutex_unlock(&set->mutex);
+        return state;
+}
+
+// The connections must have their response processing started, and stay
+// owned by the caller. quorum 0 means a majority.
+struct replica_set *new_replica_set(struct client_connection **conns,
+                int nr_replicas, int quorum) {
+        struct replica_set *set;
+        int i, rc;
+
+        if (quorum == 0) {
+                quorum = nr_replicas / 2 + 1;
+        }
+        if (nr_replicas <= 0 || quorum < 0 || quorum > nr_replicas) {
+                fprintf(stderr, "Invalid quorum %d of %d replicas\n", quorum,
+                                nr_replicas);
+                return NULL;
+        }
+
+        set = malloc(sizeof(struct replica_set));
+        if (set == NULL) {
+                perror("cannot allocate memory for replica set");
+                return NULL;
+        }
+        set->replicas = calloc(nr_replicas, sizeof(struct replica));
+        if (set->replicas == NULL) {
+                perror("cannot allocate memory for replica set");
+                free(set);
+                return NULL;
+        }
+        for (i = 0; i < nr_replicas; i++) {
+                set->replicas[i].set = set;
+                set->replicas[i].conn = conns[i];
+                set->replicas[i].state = ReplicaHealthy;
+                pthread_cond_init(&set->replicas[i].jobs_cond, NULL);
+        }
+        set->nr_replicas = nr_replicas;
+        set->quorum = quorum;
+        set->read_policy = ReadLeastInflight;
+        set->next_read = 0;
+        set->hedge_percentile = 0;
+        set->hedge_ns = 0;
+        set->nr_samples = 0;
+        set->reads = 0;
+        set->hedged = 0;
+        set->hedge_wins = 0;
+        set->stopping = 0;
+        pthread_mutex_init(&set->mutex, NULL);
+
+        for (i = 0; i < nr_replicas; i++) {
+                rc = pthread_create(&set->replicas[i].submit_thread, NULL,
+                                replica_submit_thread, &set->replicas[i]);
+                if (rc != 0) {
+                        fprintf(stderr, "Fail to create replica submit thread: %s\n",
+                                        strerror(rc));
+                        set->nr_replicas = i;
+                        free_replica_set(set);
+                        return NULL;
+                }
+        }
+        return set;
+}
+
+// Lagging writes still point at the set, so only call this once they are
+// done
+void free_replica_set(struct replica_set *set) {
+        int i;
+
+        pthread_mutex_lock(&set->mutex);
+        set->stopping = 1;
+        for (i = 0; i < set->nr_replicas; i++) {
+                pthread_cond_signal(&set->replicas[i].jobs_cond);
+        }
+        pthread_mutex_unlock(&set->mutex);
+        for (i = 0; i < set->nr_replicas; i++) {
+                pthread_join(set->replicas[i].submit_thread, NULL);
+                pthread_cond_destroy(&set->replicas[i].jobs_cond);
+        }
+        pthread_mutex_destroy(&set->mutex);
+        free(set->replicas);
+        free(set);
+}
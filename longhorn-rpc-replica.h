@@ -0,0 +1,99 @@
+#ifndef LONGHORN_RPC_REPLICA_HEADER
+#define LONGHORN_RPC_REPLICA_HEADER
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+struct client_connection;
+struct replica_set;
+struct replica_job;
+
+// Hedging waits for the chosen percentile of the last HEDGE_SAMPLES read
+// latencies, recomputed every HEDGE_UPDATE reads once there are
+// HEDGE_MIN_SAMPLES of them
+#define HEDGE_SAMPLES           256
+#define HEDGE_MIN_SAMPLES       32
+#define HEDGE_UPDATE            32
+
+// Every READ_EXPLORE-th read ignores the policy and goes round-robin, so
+// a replica that was slow once gets a chance to show it recovered
+#define READ_EXPLORE            64
+
+// Writes a lagging replica may have waiting for its submit thread before
+// it is given up on and failed
+#define REPLICA_MAX_DEFERRED    256
+
+enum replica_read_policy {
+        ReadLeastInflight,      // replica with the fewest requests in flight
+        ReadLowestLatency,      // replica with the lowest average latency
+};
+
+enum replica_state {
+        ReplicaHealthy,
+        ReplicaLagging,         // still working on writes the caller was
+                                // already told about
+        ReplicaFailed,          // a request failed, no longer written to
+};
+
+struct replica {
+        struct replica_set *set;
+        struct client_connection *conn;
+        enum replica_state state;
+
+        // Writes acknowledged to the caller that this replica hasn't
+        // finished yet
+        int behind;
+        uint64_t errors;
+
+        // Moving average of the time its reads take
+        uint64_t read_latency_ns;
+
+        // Writes to a lagging replica are sent by its own thread from a
+        // copy of the payload, so a replica out of credits doesn't hold up
+        // the writes to the others. nr_jobs counts the ones not sent yet.
+        struct replica_job *jobs;
+        struct replica_job *jobs_tail;
+        int nr_jobs;
+        pthread_cond_t jobs_cond;
+        pthread_t submit_thread;
+};
+
+// The same volume on several servers. Writes go to every replica that
+// hasn't failed and complete once a quorum of them acknowledged. Reads go
+// to one replica picked by the read policy, and to a second one if the
+// first is slow to answer.
+struct replica_set {
+        int nr_replicas;
+        struct replica *replicas;
+        int quorum;
+
+        enum replica_read_policy read_policy;
+        unsigned int next_read;
+        // 0 disables hedging
+        int hedge_percentile;
+        uint64_t hedge_ns;
+        uint64_t samples[HEDGE_SAMPLES];
+        uint64_t nr_samples;
+
+        uint64_t reads;
+        uint64_t hedged;        // reads that sent a second request
+        uint64_t hedge_wins;    // ... and were answered by it first
+
+        // Set by free_replica_set() to stop the submit threads
+        int stopping;
+
+        // Protects everything above but the connections
+        pthread_mutex_t mutex;
+};
+
+struct replica_set *new_replica_set(struct client_connection **conns,
+                int nr_replicas, int quorum);
+void free_replica_set(struct replica_set *set);
+int replica_write_at(struct replica_set *set, void *buf, size_t count, off_t offset);
+int replica_read_at(struct replica_set *set, void *buf, size_t count, off_t offset);
+int set_read_policy(struct replica_set *set, enum replica_read_policy policy,
+                int hedge_percentile);
+enum replica_state get_replica_state(struct replica_set *set, int i);
+
+#endif
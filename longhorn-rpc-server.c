@@ -1,63 +1,594 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 
 #include "longhorn-rpc-server.h"
+#include "longhorn-rpc-trace.h"
+#include "longhorn-rpc-loopback.h"
 
-void *server_process_requests(void *arg) {
-        struct server_request *req = arg;
+#define container_of(ptr, type, member) \
+        ((type *)((char *)(ptr) - offsetof(type, member)))
+
+int server_launch_request(struct server_connection *conn,
+                struct server_request *req);
+
+// Called by the receiving thread only, so checking and taking the credit
+// doesn't race with other takers
+int server_take_credit(struct server_connection *conn, uint32_t len) {
+        if (conn->inflight >= conn->max_inflight ||
+                        conn->inflight_bytes + len > conn->max_inflight_bytes) {
+                return -EBUSY;
+        }
+        __sync_fetch_and_add(&conn->inflight, 1);
+        __sync_fetch_and_add(&conn->inflight_bytes, len);
+        return 0;
+}
+
+void server_return_credit(struct server_connection *conn, uint32_t len) {
+        __sync_fetch_and_sub(&conn->inflight_bytes, len);
+        __sync_fetch_and_sub(&conn->inflight, 1);
+}
+
+// Answer a request with an error without buffering its payload
+int server_reject_request(struct server_connection *conn, struct Message *msg) {
+        int rc = 0;
+
+        if (msg->Flags & FlagData) {
+                rc = discard_data(conn->fd, msg->DataLength);
+                if (rc < 0) {
+                        return rc;
+                }
+        }
+        msg->Type = TypeError;
+        msg->Flags = 0;
+
+        pthread_mutex_lock(&conn->mutex);
+        rc = send_msg(conn->fd, msg);
+        pthread_mutex_unlock(&conn->mutex);
+        return rc;
+}
+
+// Run the handler for a request, or for the piece of it at offset
+int server_handle_request(struct server_connection *conn, struct Message *msg,
+                void *data, size_t count, off_t offset) {
+        struct handler_callbacks *cbs = conn->cbs;
+
+        if (conn->volumes != NULL) {
+                cbs = lookup_volume(conn->volumes, msg->Volume);
+        } else if (msg->Volume != 0) {
+                cbs = NULL;
+        }
+        if (cbs == NULL) {
+                return -ENODEV;
+        }
+        if (msg->Type == TypeRead) {
+                return cbs->read_at(cbs->data, data, count, offset);
+        }
+        return cbs->write_at(cbs->data, data, count, offset);
+}
+
+void server_account_request(struct server_connection *conn,
+                struct server_request *req, int rc, uint64_t handled) {
+        struct server_stats *stats = conn->stats;
+        struct Message *msg = req->msg;
+        int read = msg->Type == TypeRead;
+
+        histogram_record(stats->latency[StageReceive],
+                        req->received - req->arrived);
+        histogram_record(stats->latency[StageQueue], req->started - req->received);
+        histogram_record(stats->latency[StageHandle], handled - req->started);
+        stats_add(stats, read ? CounterReads : CounterWrites, 1);
+        stats_add(stats, read ? CounterReadBytes : CounterWriteBytes,
+                        msg->DataLength);
+        if (rc < 0) {
+                stats_add(stats, read ? CounterReadErrors : CounterWriteErrors, 1);
+        }
+}
+
+// Last use of conn by a request, see shutdown_server_connection()
+static void server_put_request(struct server_connection *conn) {
+        pthread_mutex_lock(&conn->mutex);
+        if (__sync_sub_and_fetch(&conn->requests, 1) == 0) {
+                pthread_cond_signal(&conn->idle_cond);
+        }
+        pthread_mutex_unlock(&conn->mutex);
+}
+
+void server_complete_request(struct server_request *req, int rc) {
         struct server_connection *conn = req->conn;
         struct Message *msg = req->msg;
-        int rc;
+        int node = req->node;
+        int io = msg->Type != TypeStats;
+        uint64_t handled;
 
-        free(req);
+        TRACE(ServerHandled, msg->Seq, rc);
+        if (io) {
+                // Every piece failed before running
+                server_request_started(req);
+                handled = now_ns();
+                server_account_request(conn, req, rc, handled);
+        }
 
-        if (msg->Type == TypeRead) {
-                rc = conn->cbs->read_at(msg->Data, msg->DataLength, msg->Offset);
-        } else if (msg->Type == TypeWrite) {
-                rc = conn->cbs->write_at(msg->Data, msg->DataLength, msg->Offset);
+        msg->Flags = 0;
+        if (rc < 0) {
+                msg->Type = TypeError;
+        } else {
+                // Only read data travels back, a write response just
+                // acknowledges
+                if (msg->Type == TypeRead || msg->Type == TypeStats) {
+                        msg->Flags = FlagData;
+                }
+                msg->Type = TypeResponse;
         }
-        msg->Type = TypeResponse;
+
+        // Overlapping requests queued behind this one may start while the
+        // response is on its way. Stats requests never took a range.
+        if (conn->range_locking && io) {
+                range_unlock(&conn->range_lock, &req->lock);
+        }
+        free(req);
+
+        // Return the credit before answering, otherwise a client reacting to
+        // the response could see its next request rejected
+        server_return_credit(conn, msg->DataLength);
 
         pthread_mutex_lock(&conn->mutex);
         rc = send_msg(conn->fd, msg);
         pthread_mutex_unlock(&conn->mutex);
+        TRACE(ServerRespond, msg->Seq, rc);
 
         if (rc < 0) {
                 fprintf(stderr, "fail to send response\n");
         }
+        if (io) {
+                histogram_record(conn->stats->latency[StageRespond],
+                                now_ns() - handled);
+        }
         if (msg->DataLength != 0) {
-                free(msg->Data);
+                pool_free(conn->pools[node + 1], msg->Data, msg->DataLength);
         }
         free(msg);
+        server_put_request(conn);
 }
 
-int server_dispatch_requests(struct server_connection *conn, struct Message *msg) {
-        int rc = 0;
-        pthread_t pid;
+// Forget a request the connection is going down for, without answering
+void server_drop_request(struct server_request *req) {
+        struct server_connection *conn = req->conn;
+        struct Message *msg = req->msg;
 
-        struct server_request *req;
+        if (msg->Data != NULL) {
+                pool_free(conn->pools[req->node + 1], msg->Data, msg->DataLength);
+        }
+        server_return_credit(conn, msg->DataLength);
+        free(msg);
+        free(req);
+        server_put_request(conn);
+}
+
+// Called before running the handler, only the first piece's call counts
+void server_request_started(struct server_request *req) {
+        if (__sync_bool_compare_and_swap(&req->started, 0, now_ns())) {
+                TRACE(ServerStart, req->msg->Seq, 0);
+                stats_add(req->conn->stats, CounterStarted, 1);
+        }
+}
+
+// For requests executed in several pieces, the last one to finish answers
+void server_finish_piece(struct server_request *req, int rc) {
+        if (rc < 0) {
+                req->rc = rc;
+        }
+        if (__sync_sub_and_fetch(&req->pending, 1) == 0) {
+                server_complete_request(req, req->rc);
+        }
+}
 
+void *server_process_requests(void *arg) {
+        struct server_request *req = arg;
+        struct Message *msg = req->msg;
+        int rc;
+
+        server_request_started(req);
+        rc = server_handle_request(req->conn, msg, msg->Data, msg->DataLength,
+                        msg->Offset);
+        server_complete_request(req, rc);
+        return NULL;
+}
+
+// Pick the cpu the request will run on before its buffer is allocated, so
+// the buffer can live on the same node
+void server_place_request(struct server_connection *conn,
+                struct server_request *req) {
+        int i;
+
+        req->cpu = -1;
+        req->node = -1;
+        if (conn->exec_mode == ExecSharded) {
+                struct shard *shard = shard_of(conn->shards, req->msg->Volume,
+                                req->msg->Offset);
+
+                req->cpu = shard->cpu;
+                req->node = shard->node;
+                return;
+        }
+        if (conn->exec_mode == ExecWorkStealing) {
+                struct steal_worker *w = next_steal_worker(conn);
+
+                req->worker = w->id;
+                req->cpu = w->cpu;
+                req->node = w->node;
+                return;
+        }
+        if (conn->nr_worker_cpus == 0) {
+                return;
+        }
+        i = conn->next_worker++ % conn->nr_worker_cpus;
+        req->cpu = conn->worker_cpus[i];
+        req->node = conn->worker_nodes[i];
+}
+
+// Payloads come from the pool of the node the request will run on
+void *server_alloc_data(struct server_connection *conn,
+                struct server_request *req) {
+        struct buffer_pool **pool = &conn->pools[req->node + 1];
+
+        if (*pool == NULL) {
+                *pool = new_buffer_pool(req->node);
+                if (*pool == NULL) {
+                        return NULL;
+                }
+        }
+        return pool_alloc(*pool, req->msg->DataLength);
+}
+
+void server_request_granted(struct range_lock_entry *entry) {
+        struct server_request *req = container_of(entry, struct server_request, lock);
+
+        // Nobody is left to report the failure to, handle it in this thread
+        // rather than dropping it
+        if (server_launch_request(req->conn, req) < 0) {
+                server_process_requests(req);
+        }
+}
+
+// Answered right away by the receiving thread, it is quick and needs no
+// handler
+int server_answer_stats(struct server_connection *conn,
+                struct server_request *req) {
+        struct Message *msg = req->msg;
+
+        if (msg->DataLength != sizeof(struct StatsReply)) {
+                fprintf(stderr, "Stats request of %u bytes, expect %lu\n",
+                                msg->DataLength, sizeof(struct StatsReply));
+                server_complete_request(req, -EINVAL);
+                return 0;
+        }
+        msg->Data = server_alloc_data(conn, req);
+        if (msg->Data == NULL) {
+                server_complete_request(req, -ENOMEM);
+                return 0;
+        }
+        collect_server_stats(conn->stats, msg->Data);
+        stats_to_le(msg->Data);
+        server_complete_request(req, 0);
+        return 0;
+}
+
+int server_dispatch_requests(struct server_connection *conn,
+                struct server_request *req) {
+        struct Message *msg = req->msg;
+
+        if (msg->Type == TypeStats) {
+                // Like a read it carries no payload. If one came anyway,
+                // completing the request frees it.
+                if (msg->Flags & FlagData) {
+                        fprintf(stderr, "Stats request with payload\n");
+                        server_complete_request(req, -EINVAL);
+                        return 0;
+                }
+                return server_answer_stats(conn, req);
+        }
         if (msg->Type != TypeRead && msg->Type != TypeWrite) {
                 fprintf(stderr, "Invalid request type");
+                server_drop_request(req);
                 return -EINVAL;
         }
+        if (msg->DataLength > conn->max_data_length) {
+                fprintf(stderr, "Request of %u bytes exceeds negotiated maximum %u\n",
+                                msg->DataLength, conn->max_data_length);
+                server_drop_request(req);
+                return -EINVAL;
+        }
+        // Read requests carry no payload, give the handler a buffer to fill
+        if (msg->Type == TypeRead && msg->DataLength != 0) {
+                msg->Data = server_alloc_data(conn, req);
+                if (msg->Data == NULL) {
+                        perror("cannot allocate memory for read");
+                        server_drop_request(req);
+                        return -ENOMEM;
+                }
+        }
+        stats_add(conn->stats, CounterReceived, 1);
 
-        req = malloc(sizeof(struct server_request));
-        req->msg = msg;
-        req->conn = conn;
-        rc = pthread_create(&pid, NULL, server_process_requests, req);
-        return rc;
+        if (!throttle_admit(conn, req)) {
+                return 0;
+        }
+        // Like the other starters, run it here rather than drop it
+        if (server_start_request(conn, req) < 0) {
+                server_process_requests(req);
+        }
+        return 0;
 }
 
-struct server_connection *new_server_connection(char *socket_path,
-                                                struct handler_callbacks *cbs) {
+// Called in arrival order, unless throttling held the request back
+int server_start_request(struct server_connection *conn,
+                struct server_request *req) {
+        struct Message *msg = req->msg;
+
+        if (conn->exec_mode == ExecSharded) {
+                return shard_dispatch(conn, req);
+        }
+
+        // This is where the order of overlapping requests is decided. A
+        // request that has to wait is launched by whoever releases its range
+        // last.
+        if (conn->range_locking) {
+                // Every volume gets its own part of the key space, volume
+                // offsets have to stay below 2^48
+                req->lock.start = ((uint64_t)msg->Volume << 48) + msg->Offset;
+                req->lock.end = req->lock.start + msg->DataLength;
+                req->lock.exclusive = msg->Type == TypeWrite;
+                req->lock.granted = server_request_granted;
+                if (!range_lock(&conn->range_lock, &req->lock)) {
+                        return 0;
+                }
+        }
+        return server_launch_request(conn, req);
+}
+
+int server_launch_request(struct server_connection *conn,
+                struct server_request *req) {
+        pthread_attr_t attr;
+        cpu_set_t cpus;
+        pthread_t pid;
+        int rc = 0;
+
+        if (conn->exec_mode == ExecWorkStealing) {
+                steal_submit(conn, req);
+                return 0;
+        }
+        if (conn->exec_mode == ExecDeadline) {
+                deadline_submit(conn, req);
+                return 0;
+        }
+
+        pthread_attr_init(&attr);
+        // Nobody waits for request threads, let them release their stack
+        // on exit
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (req->cpu >= 0) {
+                CPU_ZERO(&cpus);
+                CPU_SET(req->cpu, &cpus);
+                pin_thread_attr(&attr, &cpus);
+        }
+        rc = pthread_create(&pid, &attr, server_process_requests, req);
+        pthread_attr_destroy(&attr);
+        if (rc != 0) {
+                fprintf(stderr, "Fail to create request thread: %s\n", strerror(rc));
+                return -rc;
+        }
+        return 0;
+}
+
+// Must be called before start_server()
+int set_worker_affinity(struct server_connection *conn, cpu_set_t *cpus) {
+        int cpu, i = 0, nr = CPU_COUNT(cpus);
+        int numa = numa_node_count() > 1;
+
+        free(conn->worker_cpus);
+        free(conn->worker_nodes);
+        conn->worker_cpus = malloc(nr * sizeof(int));
+        conn->worker_nodes = malloc(nr * sizeof(int));
+        if (conn->worker_cpus == NULL || conn->worker_nodes == NULL) {
+                perror("cannot allocate memory for worker cpus");
+                conn->nr_worker_cpus = 0;
+                return -ENOMEM;
+        }
+
+        for (cpu = 0; cpu < CPU_SETSIZE && i < nr; cpu++) {
+                if (!CPU_ISSET(cpu, cpus)) {
+                        continue;
+                }
+                conn->worker_cpus[i] = cpu;
+                // Single node machines keep using plain malloc
+                conn->worker_nodes[i] = numa ? cpu_to_node(cpu) : -1;
+                i++;
+        }
+        conn->nr_worker_cpus = nr;
+        conn->next_worker = 0;
+        return 0;
+}
+
+// Serve every volume of the registry, instead of just the handlers given
+// at accept time as volume 0. Must be called before start_server().
+void set_volume_registry(struct server_connection *conn, struct volume_registry *reg) {
+        conn->volumes = reg;
+}
+
+static void stats_attach(struct server_connection *conn,
+                struct server_stats *stats) {
+        pthread_mutex_lock(&stats->mutex);
+        conn->stats = stats;
+        conn->stats_next = stats->conns;
+        stats->conns = conn;
+        pthread_mutex_unlock(&stats->mutex);
+        stats_add(stats, CounterConnections, 1);
+}
+
+// What is only kept per connection goes into the counters, so totals
+// don't drop when a client disconnects
+static void stats_detach(struct server_connection *conn) {
+        struct server_stats *stats = conn->stats;
+        struct server_connection **p;
+        struct throttle_stats ts;
+        uint64_t hits, misses;
+        int i;
+
+        for (i = 0; i < MAX_NUMA_NODES + 1; i++) {
+                if (conn->pools[i] != NULL) {
+                        pool_get_stats(conn->pools[i], &hits, &misses);
+                        stats_add(stats, CounterPoolHits, hits);
+                        stats_add(stats, CounterPoolMisses, misses);
+                }
+        }
+        get_throttle_stats(conn, &ts);
+        stats_add(stats, CounterThrottled, ts.delayed);
+        stats_add(stats, CounterThrottleDelay, ts.delay_ns);
+        stats_add(stats, CounterConnections, -1);
+
+        pthread_mutex_lock(&stats->mutex);
+        for (p = &stats->conns; *p != NULL; p = &(*p)->stats_next) {
+                if (*p == conn) {
+                        *p = conn->stats_next;
+                        break;
+                }
+        }
+        pthread_mutex_unlock(&stats->mutex);
+        if (conn->own_stats) {
+                free_server_stats(stats);
+        }
+        conn->stats = NULL;
+}
+
+// Count this connection in stats, which other connections may share, from
+// now on. Must be called before start_server().
+int set_server_stats(struct server_connection *conn, struct server_stats *stats) {
+        if (stats == NULL) {
+                return -EINVAL;
+        }
+        stats_detach(conn);
+        conn->own_stats = 0;
+        stats_attach(conn, stats);
+        return 0;
+}
+
+static uint64_t counter_diff(uint64_t a, uint64_t b) {
+        return a > b ? a - b : 0;
+}
+
+// Counters are summed without stopping anybody, so they may be a few
+// requests apart from each other
+void collect_server_stats(struct server_stats *stats, struct StatsReply *reply) {
+        uint64_t counters[NR_SERVER_COUNTERS], hits, misses;
+        struct server_connection *conn;
+        struct histogram_data *snap;
+        struct throttle_stats ts;
+        int i;
+
+        memset(reply, 0, sizeof(struct StatsReply));
+        stats_sum(stats, counters);
+        reply->PoolHits = counters[CounterPoolHits];
+        reply->PoolMisses = counters[CounterPoolMisses];
+        reply->Throttled = counters[CounterThrottled];
+        reply->ThrottleDelay = counters[CounterThrottleDelay];
+
+        pthread_mutex_lock(&stats->mutex);
+        for (conn = stats->conns; conn != NULL; conn = conn->stats_next) {
+                reply->Inflight += __atomic_load_n(&conn->inflight, __ATOMIC_RELAXED);
+                reply->InflightBytes += __atomic_load_n(&conn->inflight_bytes,
+                                __ATOMIC_RELAXED);
+                get_throttle_stats(conn, &ts);
+                reply->ThrottleQueued += ts.queued;
+                reply->Throttled += ts.delayed;
+                reply->ThrottleDelay += ts.delay_ns;
+                for (i = 0; i < MAX_NUMA_NODES + 1; i++) {
+                        struct buffer_pool *pool = __atomic_load_n(&conn->pools[i],
+                                        __ATOMIC_ACQUIRE);
+
+                        if (pool != NULL) {
+                                pool_get_stats(pool, &hits, &misses);
+                                reply->PoolHits += hits;
+                                reply->PoolMisses += misses;
+                        }
+                }
+        }
+        pthread_mutex_unlock(&stats->mutex);
+
+        reply->Connections = counters[CounterConnections];
+        reply->Reads = counters[CounterReads];
+        reply->Writes = counters[CounterWrites];
+        reply->ReadBytes = counters[CounterReadBytes];
+        reply->WriteBytes = counters[CounterWriteBytes];
+        reply->ReadErrors = counters[CounterReadErrors];
+        reply->WriteErrors = counters[CounterWriteErrors];
+        reply->Rejected = counters[CounterRejected];
+        reply->Queued = counter_diff(counters[CounterReceived],
+                        counters[CounterStarted]);
+        reply->Running = counter_diff(counters[CounterStarted],
+                        counters[CounterReads] + counters[CounterWrites]);
+
+        snap = malloc(sizeof(struct histogram_data));
+        if (snap == NULL) {
+                return;
+        }
+        for (i = 0; i < NR_SERVER_STAGES; i++) {
+                histogram_snapshot(stats->latency[i], snap);
+                reply->LatencyP50[i] = histogram_percentile(snap, 50);
+                reply->LatencyP99[i] = histogram_percentile(snap, 99);
+                reply->LatencyP999[i] = histogram_percentile(snap, 99.9);
+        }
+        free(snap);
+}
+
+// Answer the client's handshake with the smaller of both sides' limits and
+// the features both support
+int server_handshake(struct server_connection *conn) {
+        struct Handshake hs;
+        int rc;
+
+        rc = receive_handshake(conn->fd, TypeHandshake, &hs);
+        if (rc < 0) {
+                return rc;
+        }
+        if (hs.MaxDataLength == 0 || hs.MaxInflight == 0 ||
+                        hs.MaxInflightBytes == 0) {
+                fprintf(stderr, "client asked for invalid parameters\n");
+                return -EINVAL;
+        }
+
+        if (hs.MaxDataLength < conn->max_data_length) {
+                conn->max_data_length = hs.MaxDataLength;
+        }
+        if (hs.MaxInflight < conn->max_inflight) {
+                conn->max_inflight = hs.MaxInflight;
+        }
+        if (hs.MaxInflightBytes < conn->max_inflight_bytes) {
+                conn->max_inflight_bytes = hs.MaxInflightBytes;
+        }
+        // A full sized fragment must always fit in the byte credits
+        if (conn->max_inflight_bytes < conn->max_data_length) {
+                conn->max_data_length = conn->max_inflight_bytes;
+        }
+        conn->features &= hs.Features;
+
+        hs.MaxDataLength = conn->max_data_length;
+        hs.MaxInflight = conn->max_inflight;
+        hs.MaxInflightBytes = conn->max_inflight_bytes;
+        hs.Features = conn->features;
+        return send_handshake(conn->fd, TypeHandshake, &hs);
+}
+
+// Several clients may connect, each gets its own connection from
+// accept_server_connection()
+int server_listen(char *socket_path) {
         struct sockaddr_un addr;
-        int fd, connfd, rc = 0;
-        struct server_connection *conn = NULL;
+        int fd, rc = 0;
 
         fd = socket(AF_UNIX, SOCK_STREAM, 0);
         if (fd == -1) {
@@ -79,30 +610,159 @@ struct server_connection *new_server_connection(char *socket_path,
                 perror("fail to bind server");
         }
 
-        rc = listen(fd, 1);
-        connfd  = accept(fd, (struct sockaddr*)NULL, NULL);
+        rc = listen(fd, SOMAXCONN);
+        if (rc < 0) {
+                perror("fail to listen");
+        }
+        return fd;
+}
+
+struct server_connection *accept_server_connection(int listen_fd,
+                                                   struct handler_callbacks *cbs) {
+        int connfd;
+
+        connfd = accept(listen_fd, (struct sockaddr*)NULL, NULL);
+        if (connfd < 0) {
+                perror("fail to accept client");
+                return NULL;
+        }
+        return new_server_connection_fd(connfd, cbs);
+}
+
+// Takes over an accepted socket, or one end of a loopback_pair(), and
+// handshakes over it. The descriptor is closed on failure.
+struct server_connection *new_server_connection_fd(int connfd,
+                                                   struct handler_callbacks *cbs) {
+        struct server_stats *stats;
+        struct server_connection *conn;
+        int rc;
 
         conn = malloc(sizeof(struct server_connection));
+        if (conn == NULL) {
+                perror("cannot allocate memory for conn");
+                close_fd(connfd);
+                return NULL;
+        }
         conn->fd = connfd;
         conn->cbs = cbs;
+        conn->volumes = NULL;
+        conn->max_data_length = MAX_DATA_LENGTH;
+        conn->max_inflight = DEFAULT_MAX_INFLIGHT;
+        conn->max_inflight_bytes = DEFAULT_MAX_INFLIGHT_BYTES;
+        conn->features = SUPPORTED_FEATURES;
+        conn->inflight = 0;
+        conn->inflight_bytes = 0;
+        conn->requests = 0;
+        conn->nr_worker_cpus = 0;
+        conn->worker_cpus = NULL;
+        conn->worker_nodes = NULL;
+        conn->next_worker = 0;
+        bzero(conn->pools, sizeof(conn->pools));
+        conn->range_locking = 1;
+        range_lock_init(&conn->range_lock);
+        conn->exec_mode = ExecThreadPerRequest;
+        conn->shards = NULL;
+        conn->steal = NULL;
+        conn->deadline = NULL;
+        throttle_init(&conn->throttle);
         pthread_mutex_init(&conn->mutex, NULL);
+        pthread_cond_init(&conn->idle_cond, NULL);
 
+        rc = server_handshake(conn);
+        if (rc < 0) {
+                fprintf(stderr, "handshake with client failed\n");
+                close_fd(connfd);
+                free(conn);
+                return NULL;
+        }
+        stats = new_server_stats();
+        if (stats == NULL) {
+                close_fd(connfd);
+                free(conn);
+                return NULL;
+        }
+        conn->own_stats = 1;
+        stats_attach(conn, stats);
+        return conn;
+}
+
+// Serves a single client
+struct server_connection *new_server_connection(char *socket_path,
+                                                struct handler_callbacks *cbs) {
+        struct server_connection *conn;
+        int fd;
+
+        fd = server_listen(socket_path);
+        conn = accept_server_connection(fd, cbs);
+        close(fd);
         return conn;
 }
 
 int start_server(struct server_connection *conn) {
+        struct server_request *req;
+        uint64_t arrived;
         int rc = 0;
+
         while (1) {
                 // msg will be freed after done processing
                 struct Message *msg = malloc(sizeof(struct Message));
 		bzero(msg, sizeof(struct Message));
 
-                rc = receive_msg(conn->fd, msg);
+                rc = receive_msg_header(conn->fd, msg);
 		if (rc < 0) {
 			fprintf(stderr, "Fail to receive request\n");
+                        free(msg);
 			return rc;
 		}
-		rc = server_dispatch_requests(conn, msg);
+                arrived = now_ns();
+                TRACE(ServerReceive, msg->Seq, msg->DataLength);
+
+                // A client ignoring its credits gets errors instead of more
+                // memory and threads
+                if (server_take_credit(conn, msg->DataLength) < 0) {
+                        fprintf(stderr, "Client exceeded its credits, reject seq %lu\n",
+                                        msg->Seq);
+                        stats_add(conn->stats, CounterRejected, 1);
+                        rc = server_reject_request(conn, msg);
+                        free(msg);
+                        if (rc < 0) {
+                                return rc;
+                        }
+                        continue;
+                }
+
+                req = malloc(sizeof(struct server_request));
+                if (req == NULL) {
+                        perror("cannot allocate memory for request");
+                        server_return_credit(conn, msg->DataLength);
+                        free(msg);
+                        return -ENOMEM;
+                }
+                req->msg = msg;
+                req->conn = conn;
+                req->arrived = arrived;
+                req->started = 0;
+                server_place_request(conn, req);
+                __sync_fetch_and_add(&conn->requests, 1);
+
+                if ((msg->Flags & FlagData) && msg->DataLength > 0) {
+                        msg->Data = server_alloc_data(conn, req);
+                        if (msg->Data == NULL) {
+                                perror("cannot allocate memory for data");
+                                server_drop_request(req);
+                                return -ENOMEM;
+                        }
+                        rc = receive_data(conn->fd, msg->Data, msg->DataLength);
+                        if (rc < 0) {
+                                fprintf(stderr, "Fail to receive request\n");
+                                server_drop_request(req);
+                                return rc;
+                        }
+                }
+                req->received = now_ns();
+                TRACE(ServerDispatch, msg->Seq, 0);
+
+		rc = server_dispatch_requests(conn, req);
 		if (rc < 0) {
 			fprintf(stderr, "Fail to process requests\n");
 			return rc;
@@ -111,6 +771,39 @@ int start_server(struct server_connection *conn) {
 }
 
 void shutdown_server_connection(struct server_connection *conn) {
-        close(conn->fd);
+        int i;
+
+        // Requests still running answer on conn->fd and free into its pools
+        stop_throttle(conn);
+        pthread_mutex_lock(&conn->mutex);
+        while (conn->requests != 0) {
+                pthread_cond_wait(&conn->idle_cond, &conn->mutex);
+        }
+        pthread_mutex_unlock(&conn->mutex);
+        close_fd(conn->fd);
+        stop_workers(conn);
+        free(conn->worker_cpus);
+        free(conn->worker_nodes);
+        stats_detach(conn);
+        for (i = 0; i < MAX_NUMA_NODES + 1; i++) {
+                if (conn->pools[i] != NULL) {
+                        free_buffer_pool(conn->pools[i]);
+                }
+        }
         free(conn);
 }
+
+// Time requests answered since the last reset spent in stage, in ns. Covers
+// every connection sharing conn's stats.
+void server_latency_snapshot(struct server_connection *conn,
+                enum server_stage stage, struct histogram_data *snap) {
+        histogram_snapshot(conn->stats->latency[stage], snap);
+}
+
+void server_latency_reset(struct server_connection *conn) {
+        int i;
+
+        for (i = 0; i < NR_SERVER_STAGES; i++) {
+                histogram_reset(conn->stats->latency[i]);
+        }
+}
@@ -4,29 +4,137 @@
 #include <pthread.h>
 
 #include "longhorn-rpc-protocol.h"
+#include "longhorn-rpc-affinity.h"
+#include "longhorn-rpc-pool.h"
+#include "longhorn-rpc-range-lock.h"
+#include "longhorn-rpc-shard.h"
+#include "longhorn-rpc-steal.h"
+#include "longhorn-rpc-deadline.h"
+#include "longhorn-rpc-throttle.h"
+#include "longhorn-rpc-volume.h"
+#include "longhorn-rpc-stats.h"
+
+// How requests are executed once received
+enum server_exec_mode {
+        ExecThreadPerRequest,   // a new thread for every request
+        ExecSharded,            // one worker per offset shard, see set_shards()
+        ExecWorkStealing,       // pool of workers with work stealing deques,
+                                // see start_workers()
+        ExecDeadline,           // pool of workers fed by priority and deadline,
+                                // see set_deadline_sched()
+};
 
 struct server_connection {
         int fd;
 
+        // Negotiated with the client at connection time
+        uint32_t max_data_length;
+        uint32_t max_inflight;
+        uint32_t max_inflight_bytes;
+        uint64_t features;
+
+        // Credits the client is using, must be atomic
+        uint32_t inflight;
+        uint32_t inflight_bytes;
+
+        // Requests received and not answered yet, must be atomic. Dropping
+        // to zero is signalled on idle_cond under mutex.
+        int requests;
+        pthread_cond_t idle_cond;
+
+        // Request threads are pinned round-robin to these cpus, and their
+        // buffers are allocated on the cpu's NUMA node
+        int nr_worker_cpus;
+        int *worker_cpus;
+        int *worker_nodes;
+        unsigned int next_worker;
+
+        // Payload buffers, one pool per NUMA node indexed by node + 1 so
+        // unplaced requests use pools[0]. Pools are created by the
+        // receiving thread only.
+        struct buffer_pool *pools[MAX_NUMA_NODES + 1];
+
+        // Serializes overlapping requests in arrival order, on by default
+        int range_locking;
+        struct range_lock range_lock;
+
+        enum server_exec_mode exec_mode;
+        struct shard_set *shards;
+        struct steal_pool *steal;
+        struct deadline_sched *deadline;
+
+        // IOPS and bandwidth limits, see set_throttle()
+        struct throttle throttle;
+
+        // Counters and latencies, private unless set_server_stats() shares
+        // them with other connections
+        struct server_stats *stats;
+        int own_stats;
+        struct server_connection *stats_next;
+
         pthread_t response_thread;
 
+        // Handlers of volume 0, or of every volume with a registry
         struct handler_callbacks *cbs;
+        struct volume_registry *volumes;
         struct Message *msg_table;
         pthread_mutex_t mutex;
 };
 
+// data is passed to the handlers, so one set of functions can serve many
+// volumes
 struct handler_callbacks {
-        int (*read_at) (void *buf, size_t count, off_t offset);
-        int (*write_at) (void *buf, size_t count, off_t offset);
+        int (*read_at) (void *data, void *buf, size_t count, off_t offset);
+        int (*write_at) (void *data, void *buf, size_t count, off_t offset);
+        void *data;
 };
 
 struct server_request {
         struct server_connection *conn;
         struct Message* msg;
+
+        // Where the request will run, -1 if not pinned or not known
+        int cpu;
+        int node;
+        int worker;
+
+        // Deadline scheduling, and when a throttled request may start
+        uint64_t deadline;
+        uint64_t release;
+        struct server_request *sched_next;
+
+        struct range_lock_entry lock;
+
+        // Stage timestamps, started is taken by the first piece to run
+        uint64_t arrived;
+        uint64_t received;
+        uint64_t started;
+
+        // Requests executed in pieces complete when pending drops to zero
+        int pending;
+        int rc;
+        struct shard_job job;
 };
 
+int server_listen(char *socket_path);
+struct server_connection *accept_server_connection(int listen_fd, struct handler_callbacks *cbs);
 struct server_connection *new_server_connection(char *socket_path, struct handler_callbacks *cbs);
+struct server_connection *new_server_connection_fd(int fd, struct handler_callbacks *cbs);
+int set_worker_affinity(struct server_connection *conn, cpu_set_t *cpus);
+void set_volume_registry(struct server_connection *conn, struct volume_registry *reg);
+int set_server_stats(struct server_connection *conn, struct server_stats *stats);
+void collect_server_stats(struct server_stats *stats, struct StatsReply *reply);
+
+int server_handle_request(struct server_connection *conn, struct Message *msg,
+                void *data, size_t count, off_t offset);
+void server_request_started(struct server_request *req);
+void server_finish_piece(struct server_request *req, int rc);
+int server_start_request(struct server_connection *conn, struct server_request *req);
+void *server_process_requests(void *arg);
 int start_server(struct server_connection *conn);
 void shutdown_server_connection(struct server_connection *conn);
+void server_latency_snapshot(struct server_connection *conn,
+                enum server_stage stage, struct histogram_data *snap);
+void server_latency_reset(struct server_connection *conn);
 
 #endif
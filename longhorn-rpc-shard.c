@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "longhorn-rpc-server.h"
+#include "longhorn-rpc-shard.h"
+
+// Volumes start at different shards, so the start of every volume doesn't
+// land on shard 0
+struct shard *shard_of(struct shard_set *set, uint16_t volume, off_t offset) {
+        return &set->shards[(offset / set->stripe_size + volume) %
+                set->nr_shards];
+}
+
+static void shard_push(struct shard *shard, struct shard_job *job) {
+        job->next = NULL;
+        pthread_mutex_lock(&shard->mutex);
+        if (shard->tail == NULL) {
+                shard->head = job;
+        } else {
+                shard->tail->next = job;
+        }
+        shard->tail = job;
+        pthread_cond_signal(&shard->cond);
+        pthread_mutex_unlock(&shard->mutex);
+}
+
+static void *shard_process(void *arg) {
+        struct shard *shard = arg;
+        struct server_request *req;
+        struct shard_job *job;
+        int rc;
+
+        while (1) {
+                pthread_mutex_lock(&shard->mutex);
+                while (shard->head == NULL && !shard->stop) {
+                        pthread_cond_wait(&shard->cond, &shard->mutex);
+                }
+                job = shard->head;
+                if (job == NULL) {
+                        pthread_mutex_unlock(&shard->mutex);
+                        break;
+                }
+                shard->head = job->next;
+                if (shard->head == NULL) {
+                        shard->tail = NULL;
+                }
+                pthread_mutex_unlock(&shard->mutex);
+
+                req = job->req;
+                server_request_started(req);
+                rc = server_handle_request(req->conn, req->msg, job->data,
+                                job->count, job->offset);
+                // The first piece lives in the request, which is gone once
+                // its last piece finishes
+                if (job != &req->job) {
+                        free(job);
+                }
+                server_finish_piece(req, rc);
+        }
+        return NULL;
+}
+
+// Split the request along stripe boundaries and queue every piece on its
+// shard. The last piece to finish sends the response. Each shard runs its
+// pieces in the order they were queued, which for overlapping requests of
+// one connection is arrival order. Requests of different connections are
+// ordered the same way on every shard they share.
+int shard_dispatch(struct server_connection *conn, struct server_request *req) {
+        struct shard_set *set = conn->shards;
+        struct Message *msg = req->msg;
+        off_t pos = msg->Offset, end = msg->Offset + msg->DataLength;
+        struct shard_job *job;
+        size_t len;
+        int pieces = 0, ordered;
+
+        if (end == pos) {
+                end = pos + 1;
+        }
+        for (; pos < end; pos += len) {
+                len = set->stripe_size - pos % set->stripe_size;
+                if (len > end - pos) {
+                        len = end - pos;
+                }
+                pieces++;
+        }
+        req->pending = pieces;
+        req->rc = 0;
+
+        // A request on a single shard can't be ordered differently anywhere
+        ordered = pieces > 1;
+        if (ordered) {
+                pthread_mutex_lock(&set->mutex);
+        }
+        for (pos = msg->Offset; pieces > 0; pieces--, pos += len) {
+                len = set->stripe_size - pos % set->stripe_size;
+                if (len > msg->Offset + msg->DataLength - pos) {
+                        len = msg->Offset + msg->DataLength - pos;
+                }
+
+                if (pos == msg->Offset) {
+                        job = &req->job;
+                } else {
+                        job = malloc(sizeof(struct shard_job));
+                        if (job == NULL) {
+                                // Earlier pieces may be running already,
+                                // fail this one and let them finish
+                                perror("cannot allocate memory for shard job");
+                                server_finish_piece(req, -ENOMEM);
+                                continue;
+                        }
+                }
+                job->req = req;
+                job->data = msg->Data + (pos - msg->Offset);
+                job->count = len;
+                job->offset = pos;
+                shard_push(shard_of(set, msg->Volume, pos), job);
+        }
+        // Don't touch req anymore, all its pieces may be done already
+        if (ordered) {
+                pthread_mutex_unlock(&set->mutex);
+        }
+        return 0;
+}
+
+// Shard i is pinned to the ith cpu of cpus, round-robin, if cpus isn't
+// NULL
+struct shard_set *new_shard_set(int nr_shards, uint64_t stripe_size,
+                cpu_set_t *cpus) {
+        struct shard_set *set;
+        struct shard *shard;
+        pthread_attr_t attr;
+        cpu_set_t cpu;
+        int numa = numa_node_count() > 1;
+        int i, rc;
+
+        if (nr_shards <= 0 || stripe_size == 0) {
+                return NULL;
+        }
+        set = calloc(1, sizeof(struct shard_set));
+        if (set == NULL) {
+                perror("cannot allocate memory for shards");
+                return NULL;
+        }
+        set->shards = calloc(nr_shards, sizeof(struct shard));
+        if (set->shards == NULL) {
+                perror("cannot allocate memory for shards");
+                free(set);
+                return NULL;
+        }
+        set->stripe_size = stripe_size;
+        pthread_mutex_init(&set->mutex, NULL);
+
+        for (i = 0; i < nr_shards; i++) {
+                shard = &set->shards[i];
+                shard->id = i;
+                shard->cpu = cpus != NULL ? nth_cpu(cpus, i) : -1;
+                // Single node machines keep using plain malloc
+                shard->node = numa && shard->cpu >= 0 ?
+                        cpu_to_node(shard->cpu) : -1;
+                pthread_mutex_init(&shard->mutex, NULL);
+                pthread_cond_init(&shard->cond, NULL);
+
+                pthread_attr_init(&attr);
+                if (shard->cpu >= 0) {
+                        CPU_ZERO(&cpu);
+                        CPU_SET(shard->cpu, &cpu);
+                        pin_thread_attr(&attr, &cpu);
+                }
+                rc = pthread_create(&shard->thread, &attr, shard_process, shard);
+                pthread_attr_destroy(&attr);
+                if (rc != 0) {
+                        fprintf(stderr, "Fail to create shard thread: %s\n",
+                                        strerror(rc));
+                        free_shard_set(set);
+                        return NULL;
+                }
+                set->nr_shards++;
+        }
+        return set;
+}
+
+// Lets the workers drain their queues before they exit. Connections using
+// the set must be shut down first.
+void free_shard_set(struct shard_set *set) {
+        int i;
+
+        for (i = 0; i < set->nr_shards; i++) {
+                pthread_mutex_lock(&set->shards[i].mutex);
+                set->shards[i].stop = 1;
+                pthread_cond_signal(&set->shards[i].cond);
+                pthread_mutex_unlock(&set->shards[i].mutex);
+        }
+        for (i = 0; i < set->nr_shards; i++) {
+                pthread_join(set->shards[i].thread, NULL);
+        }
+        free(set->shards);
+        free(set);
+}
+
+// Run the requests of conn on the shards of set. Every connection serving
+// the same volumes has to use the same set: it is what keeps overlapping
+// requests apart, range locking is turned off. Must be called before
+// start_server().
+int set_shards(struct server_connection *conn, struct shard_set *set) {
+        if (set == NULL) {
+                return -EINVAL;
+        }
+        conn->shards = set;
+        conn->range_locking = 0;
+        conn->exec_mode = ExecSharded;
+        return 0;
+}
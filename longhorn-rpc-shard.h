@@ -0,0 +1,60 @@
+#ifndef LONGHORN_RPC_SHARD_HEADER
+#define LONGHORN_RPC_SHARD_HEADER
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sched.h>
+#include <pthread.h>
+
+// Default size of the stripes the offset space is dealt out in
+#define DEFAULT_SHARD_STRIPE_SIZE (1024 * 1024)
+
+struct server_connection;
+struct server_request;
+
+// The part of a request that falls into one shard's stripe
+struct shard_job {
+        struct server_request *req;
+        void *data;
+        size_t count;
+        off_t offset;
+
+        struct shard_job *next;
+};
+
+// One worker thread owning stripe i of volume v if (i + v) % nr_shards ==
+// id. Only that thread runs handlers for the shard's offsets, whichever
+// connection the requests came on, so overlapping requests never run at
+// the same time.
+struct shard {
+        int id;
+        int cpu;
+        int node;
+        pthread_t thread;
+
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+        struct shard_job *head;
+        struct shard_job *tail;
+        int stop;
+};
+
+// Shared by every connection serving the same volumes, see set_shards()
+struct shard_set {
+        int nr_shards;
+        uint64_t stripe_size;
+        struct shard *shards;
+
+        // Held while the pieces of a request are queued, so requests
+        // spanning several shards reach all of them in the same order
+        pthread_mutex_t mutex;
+};
+
+struct shard_set *new_shard_set(int nr_shards, uint64_t stripe_size,
+                cpu_set_t *cpus);
+void free_shard_set(struct shard_set *set);
+int set_shards(struct server_connection *conn, struct shard_set *set);
+struct shard *shard_of(struct shard_set *set, uint16_t volume, off_t offset);
+int shard_dispatch(struct server_connection *conn, struct server_request *req);
+
+#endif
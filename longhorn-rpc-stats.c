@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "longhorn-rpc-stats.h"
+
+// Slot of the calling thread, handed out round-robin on first use
+static __thread int stats_slot = -1;
+static unsigned int next_stats_slot;
+
+struct server_stats *new_server_stats() {
+        struct server_stats *stats;
+        int i;
+
+        if (posix_memalign((void **)&stats, 64, sizeof(struct server_stats)) != 0) {
+                perror("cannot allocate memory for server stats");
+                return NULL;
+        }
+        memset(stats, 0, sizeof(struct server_stats));
+        pthread_mutex_init(&stats->mutex, NULL);
+        for (i = 0; i < NR_SERVER_STAGES; i++) {
+                stats->latency[i] = new_histogram();
+                if (stats->latency[i] == NULL) {
+                        free_server_stats(stats);
+                        return NULL;
+                }
+        }
+        return stats;
+}
+
+// No connection may be attached anymore
+void free_server_stats(struct server_stats *stats) {
+        int i;
+
+        for (i = 0; i < NR_SERVER_STAGES; i++) {
+                free_histogram(stats->latency[i]);
+        }
+        pthread_mutex_destroy(&stats->mutex);
+        free(stats);
+}
+
+void stats_add(struct server_stats *stats, enum server_counter counter,
+                uint64_t value) {
+        if (stats_slot < 0) {
+                stats_slot = __atomic_fetch_add(&next_stats_slot, 1,
+                                __ATOMIC_RELAXED) % STATS_SLOTS;
+        }
+        __atomic_fetch_add(&stats->slots[stats_slot].counters[counter], value,
+                        __ATOMIC_RELAXED);
+}
+
+// counters must have room for NR_SERVER_COUNTERS
+void stats_sum(struct server_stats *stats, uint64_t *counters) {
+        int i, j;
+
+        memset(counters, 0, NR_SERVER_COUNTERS * sizeof(uint64_t));
+        for (i = 0; i < STATS_SLOTS; i++) {
+                for (j = 0; j < NR_SERVER_COUNTERS; j++) {
+                        counters[j] += __atomic_load_n(&stats->slots[i].counters[j],
+                                        __ATOMIC_RELAXED);
+                }
+        }
+}
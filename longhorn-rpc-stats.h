@@ -0,0 +1,65 @@
+#ifndef LONGHORN_RPC_STATS_HEADER
+#define LONGHORN_RPC_STATS_HEADER
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "longhorn-rpc-histogram.h"
+
+struct server_connection;
+
+// Where a request spends its time on the server
+enum server_stage {
+        StageReceive,           // header read to payload received
+        StageQueue,             // received to handler start: throttling,
+                                // range locks and dispatch
+        StageHandle,            // handler start to last piece done
+        StageRespond,           // handler done to response sent
+        NR_SERVER_STAGES,
+};
+
+enum server_counter {
+        CounterReceived,        // valid requests received
+        CounterStarted,         // requests a handler started on
+        CounterReads,           // answered, failed ones included
+        CounterWrites,
+        CounterReadBytes,
+        CounterWriteBytes,
+        CounterReadErrors,
+        CounterWriteErrors,
+        CounterRejected,        // over the client's credits
+        // Folded in from connections that went away, live ones are
+        // summed on every query
+        CounterPoolHits,
+        CounterPoolMisses,
+        CounterThrottled,
+        CounterThrottleDelay,
+        CounterConnections,
+        NR_SERVER_COUNTERS,
+};
+
+#define STATS_SLOTS     16
+
+// Padded to whole cache lines, so threads never share one
+struct stats_slot {
+        uint64_t counters[NR_SERVER_COUNTERS];
+} __attribute__((aligned(64)));
+
+// Counters and stage latencies of every connection attached to it. Threads
+// add to their own slot without locking, queries sum the slots. mutex
+// only protects the list of connections.
+struct server_stats {
+        struct stats_slot slots[STATS_SLOTS];
+        struct histogram *latency[NR_SERVER_STAGES];
+
+        pthread_mutex_t mutex;
+        struct server_connection *conns;
+};
+
+struct server_stats *new_server_stats();
+void free_server_stats(struct server_stats *stats);
+void stats_add(struct server_stats *stats, enum server_counter counter,
+                uint64_t value);
+void stats_sum(struct server_stats *stats, uint64_t *counters);
+
+#endif
@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "longhorn-rpc-server.h"
+#include "longhorn-rpc-steal.h"
+
+static __thread struct steal_worker *current_worker;
+
+// Every queued request holds one of the connection's max_inflight credits
+// until it completes, and the rings are sized for all of them, so a full
+// ring means the credits are broken and nothing can be trusted anymore
+static void ring_push(struct steal_ring *r, struct server_request *req) {
+        if (r->bottom - r->top > r->mask) {
+                fprintf(stderr, "BUG: work stealing ring overflow\n");
+                abort();
+        }
+        r->slots[r->bottom++ & r->mask] = req;
+}
+
+static struct server_request *ring_pop_top(struct steal_ring *r) {
+        if (r->bottom == r->top) {
+                return NULL;
+        }
+        return r->slots[r->top++ & r->mask];
+}
+
+static struct server_request *ring_pop_bottom(struct steal_ring *r) {
+        if (r->bottom == r->top) {
+                return NULL;
+        }
+        return r->slots[--r->bottom & r->mask];
+}
+
+static void push(struct steal_worker *w, struct steal_ring *r,
+                struct server_request *req) {
+        pthread_mutex_lock(&w->mutex);
+        ring_push(r, req);
+        pthread_mutex_unlock(&w->mutex);
+}
+
+// The owner runs the oldest new request, then the newest it released
+static struct server_request *pop_own(struct steal_worker *w) {
+        struct server_request *req;
+
+        pthread_mutex_lock(&w->mutex);
+        req = ring_pop_top(&w->inject);
+        if (req == NULL) {
+                req = ring_pop_bottom(&w->deque);
+        }
+        pthread_mutex_unlock(&w->mutex);
+        return req;
+}
+
+// Thieves take the oldest request of either ring, new ones first
+static struct server_request *pop_stolen(struct steal_worker *w) {
+        struct server_request *req;
+
+        pthread_mutex_lock(&w->mutex);
+        req = ring_pop_top(&w->inject);
+        if (req == NULL) {
+                req = ring_pop_top(&w->deque);
+        }
+        pthread_mutex_unlock(&w->mutex);
+        return req;
+}
+
+// Visit the other workers starting after self, so thieves spread out
+// instead of all hitting worker 0
+static struct server_request *steal(struct steal_pool *pool,
+                struct steal_worker *self) {
+        struct server_request *req;
+        int i;
+
+        for (i = 1; i < pool->nr_workers; i++) {
+                req = pop_stolen(&pool->workers[(self->id + i) % pool->nr_workers]);
+                if (req != NULL) {
+                        return req;
+                }
+        }
+        return NULL;
+}
+
+// Sleep until something is queued anywhere. Returns 1 once the pool is
+// stopping and drained.
+static int park(struct steal_pool *pool) {
+        int stop;
+
+        pthread_mutex_lock(&pool->park_mutex);
+        pool->idle++;
+        while (__sync_fetch_and_add(&pool->queued, 0) == 0 && !pool->stop) {
+                pthread_cond_wait(&pool->park_cond, &pool->park_mutex);
+        }
+        pool->idle--;
+        stop = pool->stop && pool->queued == 0;
+        pthread_mutex_unlock(&pool->park_mutex);
+        return stop;
+}
+
+static void *steal_process(void *arg) {
+        struct steal_worker *self = arg;
+        struct steal_pool *pool = self->conn->steal;
+        struct server_request *req;
+
+        current_worker = self;
+        while (1) {
+                req = pop_own(self);
+                if (req == NULL) {
+                        req = steal(pool, self);
+                }
+                if (req == NULL) {
+                        if (park(pool)) {
+                                break;
+                        }
+                        continue;
+                }
+                __sync_fetch_and_sub(&pool->queued, 1);
+                server_process_requests(req);
+        }
+        return NULL;
+}
+
+// Used to place a new request before its buffer is allocated
+struct steal_worker *next_steal_worker(struct server_connection *conn) {
+        struct steal_pool *pool = conn->steal;
+
+        return &pool->workers[pool->next_worker++ % pool->nr_workers];
+}
+
+// Requests from the receiving thread are injected into the worker they
+// were placed on, behind the ones already waiting there. Requests a worker
+// releases, e.g. ones that were waiting on its range lock, go to its deque.
+void steal_submit(struct server_connection *conn, struct server_request *req) {
+        struct steal_pool *pool = conn->steal;
+        struct steal_worker *w = current_worker;
+
+        if (w != NULL && w->conn == conn) {
+                push(w, &w->deque, req);
+        } else {
+                w = &pool->workers[req->worker];
+                push(w, &w->inject, req);
+        }
+
+        // Pairs with the check in park(): a worker going idle either sees
+        // the request queued or is already counted in idle
+        __sync_fetch_and_add(&pool->queued, 1);
+        if (__sync_fetch_and_add(&pool->idle, 0) != 0) {
+                pthread_mutex_lock(&pool->park_mutex);
+                pthread_cond_signal(&pool->park_cond);
+                pthread_mutex_unlock(&pool->park_mutex);
+        }
+}
+
+// Workers are pinned to the server's worker cpus if set, so call
+// set_worker_affinity() first
+int start_workers(struct server_connection *conn, int nr_workers) {
+        struct steal_pool *pool;
+        struct steal_worker *w;
+        pthread_attr_t attr;
+        cpu_set_t cpus;
+        unsigned int capacity = 2;
+        int i, rc;
+
+        if (nr_workers <= 0) {
+                return -EINVAL;
+        }
+        while (capacity < conn->max_inflight) {
+                capacity <<= 1;
+        }
+
+        pool = calloc(1, sizeof(struct steal_pool));
+        if (pool == NULL) {
+                perror("cannot allocate memory for workers");
+                return -ENOMEM;
+        }
+        pool->workers = calloc(nr_workers, sizeof(struct steal_worker));
+        if (pool->workers == NULL) {
+                perror("cannot allocate memory for workers");
+                free(pool);
+                return -ENOMEM;
+        }
+        pthread_mutex_init(&pool->park_mutex, NULL);
+        pthread_cond_init(&pool->park_cond, NULL);
+        conn->steal = pool;
+
+        for (i = 0; i < nr_workers; i++) {
+                w = &pool->workers[i];
+                w->id = i;
+                w->conn = conn;
+                w->cpu = -1;
+                w->node = -1;
+                if (conn->nr_worker_cpus != 0) {
+                        w->cpu = conn->worker_cpus[i % conn->nr_worker_cpus];
+                        w->node = conn->worker_nodes[i % conn->nr_worker_cpus];
+                }
+                pthread_mutex_init(&w->mutex, NULL);
+                w->inject.slots = malloc(capacity * sizeof(struct server_request *));
+                w->inject.mask = capacity - 1;
+                w->deque.slots = malloc(capacity * sizeof(struct server_request *));
+                w->deque.mask = capacity - 1;
+                if (w->inject.slots == NULL || w->deque.slots == NULL) {
+                        perror("cannot allocate memory for worker queues");
+                        free(w->inject.slots);
+                        free(w->deque.slots);
+                        rc = -ENOMEM;
+                        goto fail;
+                }
+
+                pthread_attr_init(&attr);
+                if (w->cpu >= 0) {
+                        CPU_ZERO(&cpus);
+                        CPU_SET(w->cpu, &cpus);
+                        pin_thread_attr(&attr, &cpus);
+                }
+                rc = pthread_create(&w->thread, &attr, steal_process, w);
+                pthread_attr_destroy(&attr);
+                if (rc != 0) {
+                        fprintf(stderr, "Fail to create worker thread: %s\n",
+                                        strerror(rc));
+                        free(w->inject.slots);
+                        free(w->deque.slots);
+                        rc = -rc;
+                        goto fail;
+                }
+                pool->nr_workers++;
+        }
+
+        conn->exec_mode = ExecWorkStealing;
+        return 0;
+fail:
+        stop_workers(conn);
+        return rc;
+}
+
+// Lets the workers drain their queues before they exit
+void stop_workers(struct server_connection *conn) {
+        struct steal_pool *pool = conn->steal;
+        int i;
+
+        if (pool == NULL) {
+                return;
+        }
+        pthread_mutex_lock(&pool->park_mutex);
+        pool->stop = 1;
+        pthread_cond_broadcast(&pool->park_cond);
+        pthread_mutex_unlock(&pool->park_mutex);
+
+        for (i = 0; i < pool->nr_workers; i++) {
+                pthread_join(pool->workers[i].thread, NULL);
+                free(pool->workers[i].inject.slots);
+                free(pool->workers[i].deque.slots);
+        }
+        free(pool->workers);
+        free(pool);
+        conn->steal = NULL;
+        conn->exec_mode = ExecThreadPerRequest;
+}
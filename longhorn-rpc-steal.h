@@ -0,0 +1,56 @@
+#ifndef LONGHORN_RPC_STEAL_HEADER
+#define LONGHORN_RPC_STEAL_HEADER
+
+#include <pthread.h>
+
+struct server_connection;
+struct server_request;
+
+// Requests between top and bottom of a ring. Pushes go to the bottom.
+struct steal_ring {
+        struct server_request **slots;
+        unsigned int mask;
+        unsigned int top;
+        unsigned int bottom;
+};
+
+// A worker of the work-stealing pool. New requests from the receiving
+// thread go into inject, a FIFO: the owner and thieves both take its top,
+// the oldest request. Requests the owner releases itself go into deque,
+// where the owner takes the bottom, so they run next while cache warm,
+// and thieves take the top. The owner empties inject before its deque,
+// thieves steal from inject first.
+struct steal_worker {
+        int id;
+        int cpu;
+        int node;
+        pthread_t thread;
+        struct server_connection *conn;
+
+        pthread_mutex_t mutex;
+        struct steal_ring inject;
+        struct steal_ring deque;
+};
+
+// Shared by all workers of a connection
+struct steal_pool {
+        int nr_workers;
+        struct steal_worker *workers;
+        unsigned int next_worker;
+
+        // Requests sitting in any worker queue, must be atomic
+        int queued;
+
+        // Workers that found nothing to run or steal sleep here
+        pthread_mutex_t park_mutex;
+        pthread_cond_t park_cond;
+        int idle;
+        int stop;
+};
+
+int start_workers(struct server_connection *conn, int nr_workers);
+void stop_workers(struct server_connection *conn);
+struct steal_worker *next_steal_worker(struct server_connection *conn);
+void steal_submit(struct server_connection *conn, struct server_request *req);
+
+#endif
@@ -0,0 +1,245 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "longhorn-rpc-server.h"
+#include "longhorn-rpc-throttle.h"
+
+static enum throttle_class class_of(struct server_connection *conn,
+                struct Message *msg) {
+        uint32_t priority = (msg->Flags & FlagPriorityMask) >> FlagPriorityShift;
+
+        if ((conn->features & FeaturePriority) && priority == PriorityIdle) {
+                return ThrottleIdle;
+        }
+        return ThrottleNormal;
+}
+
+static void bucket_refill(struct token_bucket *b, uint64_t now) {
+        double burst = (double)b->rate * THROTTLE_BURST_NS / 1e9;
+
+        if (burst < 1) {
+                burst = 1;
+        }
+        b->tokens += (double)(now - b->last_ns) * b->rate / 1e9;
+        if (b->tokens > burst) {
+                b->tokens = burst;
+        }
+        b->last_ns = now;
+}
+
+// Take cost tokens, returns when the bucket will be out of debt again
+static uint64_t bucket_take(struct token_bucket *b, double cost, uint64_t now) {
+        if (b->rate == 0) {
+                return now;
+        }
+        bucket_refill(b, now);
+        b->tokens -= cost;
+        if (b->tokens >= 0) {
+                return now;
+        }
+        return now + (uint64_t)(-b->tokens * 1e9 / b->rate);
+}
+
+// A new limit starts with a full bucket, a changed one keeps its tokens or
+// its debt
+static void bucket_set_rate(struct token_bucket *b, uint64_t rate, uint64_t now) {
+        if (b->rate == 0) {
+                b->tokens = 0;
+                b->last_ns = 0;
+        } else {
+                bucket_refill(b, now);
+        }
+        b->rate = rate;
+}
+
+// Called with t->mutex held, returns the queue whose head is due first
+static struct throttle_queue *throttle_next(struct throttle *t) {
+        struct throttle_queue *q, *next = NULL;
+        int i;
+
+        for (i = 0; i < NR_THROTTLE_CLASSES; i++) {
+                q = &t->queues[i];
+                if (q->head != NULL && (next == NULL ||
+                                q->head->release < next->head->release)) {
+                        next = q;
+                }
+        }
+        return next;
+}
+
+static void *throttle_process(void *arg) {
+        struct server_connection *conn = arg;
+        struct throttle *t = &conn->throttle;
+        struct throttle_queue *q;
+        struct server_request *req;
+        struct timespec ts;
+
+        pthread_mutex_lock(&t->mutex);
+        while (1) {
+                q = throttle_next(t);
+                if (q == NULL) {
+                        if (t->stop) {
+                                break;
+                        }
+                        pthread_cond_wait(&t->cond, &t->mutex);
+                        continue;
+                }
+                // Stopping lets everything through right away
+                if (!t->stop && q->head->release > now_ns()) {
+                        ts.tv_sec = q->head->release / 1000000000ULL;
+                        ts.tv_nsec = q->head->release % 1000000000ULL;
+                        pthread_cond_timedwait(&t->cond, &t->mutex, &ts);
+                        continue;
+                }
+
+                req = q->head;
+                q->head = req->sched_next;
+                if (q->head == NULL) {
+                        q->tail = NULL;
+                }
+                t->stats.queued--;
+                pthread_mutex_unlock(&t->mutex);
+
+                // Nobody is left to report the failure to, handle it in
+                // this thread rather than dropping it
+                if (server_start_request(conn, req) < 0) {
+                        server_process_requests(req);
+                }
+                pthread_mutex_lock(&t->mutex);
+        }
+        pthread_mutex_unlock(&t->mutex);
+        return NULL;
+}
+
+void throttle_init(struct throttle *t) {
+        pthread_condattr_t attr;
+
+        bzero(t, sizeof(struct throttle));
+        pthread_mutex_init(&t->mutex, NULL);
+        // Release times are monotonic
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&t->cond, &attr);
+        pthread_condattr_destroy(&attr);
+}
+
+// Limits the connection or one class of it to iops requests and bps bytes
+// per second, 0 meaning no limit. Can be called at any time; requests
+// already waiting keep their release time.
+int set_throttle(struct server_connection *conn, enum throttle_class class,
+                uint64_t iops, uint64_t bps) {
+        struct throttle *t = &conn->throttle;
+        uint64_t now = now_ns();
+        int rc;
+
+        if (class < 0 || class >= NR_THROTTLE_CLASSES) {
+                return -EINVAL;
+        }
+
+        pthread_mutex_lock(&t->mutex);
+        if (!t->running) {
+                rc = pthread_create(&t->thread, NULL, throttle_process, conn);
+                if (rc != 0) {
+                        pthread_mutex_unlock(&t->mutex);
+                        fprintf(stderr, "Fail to create throttle thread: %s\n",
+                                        strerror(rc));
+                        return -rc;
+                }
+                t->running = 1;
+        }
+        bucket_set_rate(&t->limits[class].iops, iops, now);
+        bucket_set_rate(&t->limits[class].bps, bps, now);
+        t->enabled = 1;
+        pthread_mutex_unlock(&t->mutex);
+        return 0;
+}
+
+// Returns 1 if the request may start now. Otherwise it is queued and
+// started by the throttle thread once its class and the connection have
+// the tokens for it.
+int throttle_admit(struct server_connection *conn, struct server_request *req) {
+        struct throttle *t = &conn->throttle;
+        struct Message *msg = req->msg;
+        enum throttle_class classes[2];
+        struct throttle_limit *limit;
+        struct throttle_queue *q;
+        uint64_t now, release, r;
+        int i;
+
+        // Connections without limits don't pay for the lock
+        if (!t->enabled) {
+                return 1;
+        }
+
+        classes[0] = ThrottleConnection;
+        classes[1] = class_of(conn, msg);
+        q = &t->queues[classes[1]];
+        now = now_ns();
+        release = now;
+
+        pthread_mutex_lock(&t->mutex);
+        for (i = 0; i < 2; i++) {
+                limit = &t->limits[classes[i]];
+                r = bucket_take(&limit->iops, 1, now);
+                if (r > release) {
+                        release = r;
+                }
+                r = bucket_take(&limit->bps, msg->DataLength, now);
+                if (r > release) {
+                        release = r;
+                }
+        }
+        if (release <= now && q->head == NULL) {
+                pthread_mutex_unlock(&t->mutex);
+                return 1;
+        }
+        // Release times only go backwards when the limits change, don't let
+        // that reorder the class
+        if (q->tail != NULL && release < q->tail->release) {
+                release = q->tail->release;
+        }
+
+        req->release = release;
+        req->sched_next = NULL;
+        if (q->tail == NULL) {
+                q->head = req;
+        } else {
+                q->tail->sched_next = req;
+        }
+        q->tail = req;
+
+        t->stats.delayed++;
+        t->stats.delay_ns += release - now;
+        t->stats.queued++;
+        pthread_cond_signal(&t->cond);
+        pthread_mutex_unlock(&t->mutex);
+        return 0;
+}
+
+void get_throttle_stats(struct server_connection *conn, struct throttle_stats *stats) {
+        struct throttle *t = &conn->throttle;
+
+        pthread_mutex_lock(&t->mutex);
+        *stats = t->stats;
+        pthread_mutex_unlock(&t->mutex);
+}
+
+// Starts whatever is still queued before the thread exits
+void stop_throttle(struct server_connection *conn) {
+        struct throttle *t = &conn->throttle;
+
+        pthread_mutex_lock(&t->mutex);
+        if (!t->running) {
+                pthread_mutex_unlock(&t->mutex);
+                return;
+        }
+        t->stop = 1;
+        pthread_cond_signal(&t->cond);
+        pthread_mutex_unlock(&t->mutex);
+
+        pthread_join(t->thread, NULL);
+        t->running = 0;
+}
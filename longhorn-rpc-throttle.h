@@ -0,0 +1,73 @@
+#ifndef LONGHORN_RPC_THROTTLE_HEADER
+#define LONGHORN_RPC_THROTTLE_HEADER
+
+#include <stdint.h>
+#include <pthread.h>
+
+struct server_connection;
+struct server_request;
+
+// How long a client may run at full speed after being idle, as time worth
+// of tokens
+#define THROTTLE_BURST_NS (100 * 1000 * 1000ULL)
+
+// Limits apply to the whole connection or to one priority class of it. A
+// request has to get through both its class and the connection limit.
+enum throttle_class {
+        ThrottleConnection,
+        ThrottleNormal,
+        ThrottleIdle,
+        NR_THROTTLE_CLASSES
+};
+
+// A request always takes its tokens, even if that leaves the bucket in
+// debt, and then waits until the debt is refilled. This way the wait is
+// known on arrival and large requests can't starve behind small ones.
+struct token_bucket {
+        uint64_t rate;          // tokens per second, 0 for no limit
+        double tokens;
+        uint64_t last_ns;
+};
+
+struct throttle_limit {
+        struct token_bucket iops;
+        struct token_bucket bps;
+};
+
+// Throttled requests of a class in release order
+struct throttle_queue {
+        struct server_request *head;
+        struct server_request *tail;
+};
+
+struct throttle_stats {
+        uint64_t delayed;       // requests that had to wait
+        uint64_t delay_ns;      // total time they waited
+        int queued;             // requests waiting right now
+};
+
+struct throttle {
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+
+        // Set once any limit is, requests skip throttling until then
+        int enabled;
+        struct throttle_limit limits[NR_THROTTLE_CLASSES];
+        // Indexed by class too, nothing queues on ThrottleConnection
+        struct throttle_queue queues[NR_THROTTLE_CLASSES];
+        struct throttle_stats stats;
+
+        // Dispatches queued requests once they are due
+        pthread_t thread;
+        int running;
+        int stop;
+};
+
+void throttle_init(struct throttle *t);
+int set_throttle(struct server_connection *conn, enum throttle_class class,
+                uint64_t iops, uint64_t bps);
+int throttle_admit(struct server_connection *conn, struct server_request *req);
+void get_throttle_stats(struct server_connection *conn, struct throttle_stats *stats);
+void stop_throttle(struct server_connection *conn);
+
+#endif
@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "longhorn-rpc-trace.h"
+
+int trace_enabled;
+
+// Writers take a ticket and fill entry ticket % size, so the ring always
+// holds the latest entries. Once allocated it is never freed, a writer
+// may still be in trace_record() long after tracing was turned off.
+static struct trace_entry *ring;
+static uint32_t ring_mask;
+static uint64_t ring_head;
+
+static __thread uint32_t trace_tid;
+
+static const char *event_names[NR_TRACE_EVENTS] = {
+        "ClientQueue",
+        "ClientCredit",
+        "ClientLocked",
+        "ClientSent",
+        "ClientResponse",
+        "ClientDone",
+        "ServerReceive",
+        "ServerDispatch",
+        "ServerStart",
+        "ServerHandled",
+        "ServerRespond",
+};
+
+const char *trace_event_name(enum trace_event event) {
+        if (event >= NR_TRACE_EVENTS) {
+                return "Unknown";
+        }
+        return event_names[event];
+}
+
+// entries is rounded up to a power of two. Enabling again reuses the
+// existing ring, whatever its size.
+int trace_enable(uint32_t entries) {
+        struct trace_entry *r;
+        uint32_t size = 2;
+
+        if (__atomic_load_n(&ring, __ATOMIC_ACQUIRE) == NULL) {
+                if (entries == 0 || entries > (1U << 31)) {
+                        return -EINVAL;
+                }
+                while (size < entries) {
+                        size <<= 1;
+                }
+                r = calloc(size, sizeof(struct trace_entry));
+                if (r == NULL) {
+                        perror("cannot allocate memory for trace ring");
+                        return -ENOMEM;
+                }
+                ring_mask = size - 1;
+                __atomic_store_n(&ring, r, __ATOMIC_RELEASE);
+        }
+        __atomic_store_n(&trace_enabled, 1, __ATOMIC_RELEASE);
+        return 0;
+}
+
+// Entries recorded so far stay in the ring for trace_dump()
+void trace_disable() {
+        __atomic_store_n(&trace_enabled, 0, __ATOMIC_RELEASE);
+}
+
+void trace_record(enum trace_event event, uint64_t seq, int64_t arg) {
+        struct trace_entry *r = __atomic_load_n(&ring, __ATOMIC_ACQUIRE);
+        struct trace_entry *e;
+        struct timespec ts;
+        uint64_t ticket;
+
+        if (r == NULL) {
+                return;
+        }
+        if (trace_tid == 0) {
+                trace_tid = syscall(SYS_gettid);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        ticket = __atomic_fetch_add(&ring_head, 1, __ATOMIC_RELAXED);
+        e = &r[ticket & ring_mask];
+        __atomic_store_n(&e->stamp, 0, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        e->time_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+        e->seq = seq;
+        e->arg = arg;
+        e->event = event;
+        e->tid = trace_tid;
+        __atomic_store_n(&e->stamp, ticket + 1, __ATOMIC_RELEASE);
+}
+
+// Prints the ring oldest entry first, one "time_ns tid event seq arg" line
+// each, while writers carry on. Entries being written or overwritten during
+// the dump are skipped. Returns the number of entries printed.
+int trace_dump(FILE *f) {
+        struct trace_entry *r = __atomic_load_n(&ring, __ATOMIC_ACQUIRE);
+        struct trace_entry e;
+        uint64_t head, ticket;
+        int n = 0;
+
+        if (r == NULL) {
+                return 0;
+        }
+        head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+        ticket = head > ring_mask + 1 ? head - ring_mask - 1 : 0;
+        for (; ticket < head; ticket++) {
+                struct trace_entry *src = &r[ticket & ring_mask];
+
+                if (__atomic_load_n(&src->stamp, __ATOMIC_ACQUIRE) != ticket + 1) {
+                        continue;
+                }
+                memcpy(&e, src, sizeof(e));
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                if (__atomic_load_n(&src->stamp, __ATOMIC_RELAXED) != ticket + 1) {
+                        continue;
+                }
+                fprintf(f, "%lu %u %s %lu %ld\n", e.time_ns, e.tid,
+                                trace_event_name(e.event), e.seq, e.arg);
+                n++;
+        }
+        fflush(f);
+        return n;
+}
@@ -0,0 +1,64 @@
+#ifndef LONGHORN_RPC_TRACE_HEADER
+#define LONGHORN_RPC_TRACE_HEADER
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Stages of a request's life, in the order they happen. Client events are
+// per fragment, seq is the fragment's Seq on both sides.
+enum trace_event {
+        TraceClientQueue,       // about to wait for credits, arg is length
+        TraceClientCredit,      // got its credits
+        TraceClientLocked,      // holds the connection to send
+        TraceClientSent,        // on the wire
+        TraceClientResponse,    // response header read
+        TraceClientDone,        // fragment completed, arg is rc
+        TraceServerReceive,     // request header read, arg is length
+        TraceServerDispatch,    // payload received, dispatching
+        TraceServerStart,       // handler started
+        TraceServerHandled,     // last piece done, arg is rc
+        TraceServerRespond,     // response on the wire
+        NR_TRACE_EVENTS,
+};
+
+// Every tracepoint is a USDT probe in provider longhorn_rpc, named like
+// its event (e.g. ClientSent), when built with systemtap's sys/sdt.h.
+// Probes are a nop until a tracer attaches.
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_USDT(event, seq, arg) \
+        DTRACE_PROBE2(longhorn_rpc, event, (uint64_t)(seq), (int64_t)(arg))
+#endif
+#endif
+#ifndef TRACE_USDT
+#define TRACE_USDT(event, seq, arg) do { } while (0)
+#endif
+
+// While the trace ring is off, a tracepoint costs a load and a branch
+#define TRACE(event, seq, arg) do {                                     \
+        TRACE_USDT(event, seq, arg);                                    \
+        if (__builtin_expect(trace_enabled, 0)) {                       \
+                trace_record(Trace##event, (seq), (arg));               \
+        }                                                               \
+} while (0)
+
+struct trace_entry {
+        // Ticket + 1 once the entry is complete, 0 while being written
+        uint64_t stamp;
+        uint64_t time_ns;
+        uint64_t seq;
+        int64_t arg;
+        uint32_t event;
+        uint32_t tid;
+};
+
+extern int trace_enabled;
+
+int trace_enable(uint32_t entries);
+void trace_disable();
+void trace_record(enum trace_event event, uint64_t seq, int64_t arg);
+int trace_dump(FILE *f);
+const char *trace_event_name(enum trace_event event);
+
+#endif
@@ -0,0 +1,47 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "longhorn-rpc-volume.h"
+
+struct volume_registry *new_volume_registry() {
+        struct volume_registry *reg = calloc(1, sizeof(struct volume_registry));
+
+        if (reg == NULL) {
+                perror("cannot allocate memory for volume registry");
+        }
+        return reg;
+}
+
+void free_volume_registry(struct volume_registry *reg) {
+        free(reg);
+}
+
+// Volumes can come and go while connections are serving
+int register_volume(struct volume_registry *reg, uint16_t id,
+                struct handler_callbacks *cbs) {
+        struct handler_callbacks *expected = NULL;
+
+        if (cbs == NULL) {
+                return -EINVAL;
+        }
+        if (!__atomic_compare_exchange_n(&reg->volumes[id], &expected, cbs, 0,
+                                __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+                return -EEXIST;
+        }
+        return 0;
+}
+
+// New requests for the volume fail from now on, but ones already running
+// may still use its handlers, so they must stay valid until those are
+// answered
+int unregister_volume(struct volume_registry *reg, uint16_t id) {
+        if (__atomic_exchange_n(&reg->volumes[id], NULL, __ATOMIC_ACQ_REL) == NULL) {
+                return -ENOENT;
+        }
+        return 0;
+}
+
+struct handler_callbacks *lookup_volume(struct volume_registry *reg, uint16_t id) {
+        return __atomic_load_n(&reg->volumes[id], __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,25 @@
+#ifndef LONGHORN_RPC_VOLUME_HEADER
+#define LONGHORN_RPC_VOLUME_HEADER
+
+#include <stdint.h>
+
+// Volume IDs are the 16 bit Volume of the message header
+#define MAX_VOLUMES (1 << 16)
+
+struct handler_callbacks;
+
+// Maps volume IDs to their handlers. One registry can be shared by every
+// connection of a server, so a client reaches all of its volumes over a
+// single connection. Lookups take no lock.
+struct volume_registry {
+        struct handler_callbacks *volumes[MAX_VOLUMES];
+};
+
+struct volume_registry *new_volume_registry();
+void free_volume_registry(struct volume_registry *reg);
+int register_volume(struct volume_registry *reg, uint16_t id,
+                struct handler_callbacks *cbs);
+int unregister_volume(struct volume_registry *reg, uint16_t id);
+struct handler_callbacks *lookup_volume(struct volume_registry *reg, uint16_t id);
+
+#endif
@@ -11,104 +11,262 @@
 
 #include "longhorn-rpc-client.h"
 #include "longhorn-rpc-server.h"
+#include "longhorn-rpc-replica.h"
+#include "longhorn-rpc-gf.h"
+#include "longhorn-rpc-ec.h"
+#include "longhorn-rpc-bench.h"
+#include "longhorn-rpc-trace.h"
+#include "longhorn-rpc-loopback.h"
+#include "longhorn-rpc-nbd.h"
+#include "longhorn-rpc-pattern.h"
 
 const int request_count = 1;
 
 const size_t SAMPLE_SIZE = 100 * 1024 * 1024;
 
+// Bytes of every volume a server exports and a benchmark covers. Volumes
+// are mapped without reserving swap, only what gets written takes memory.
+static size_t volume_size = 100 * 1024 * 1024;
+
 static void *server_buf;
 
 static struct client_connection *client_conn;
-static struct server_connection *server_conn;
-
-int start_test(struct client_connection *conn, int request_size, int queue_depth) {
-        int rc = 0;
-        int i, request_count;
-
-        char *buf;
-        void *tmpbuf = malloc(request_size);
-
-        struct timespec write_start, write_stop, read_start, read_stop;
-        uint32_t delta_write_ms, delta_read_ms;
-        float write_bw, read_bw;
-
-        if (SAMPLE_SIZE & request_size != 0) {
-                fprintf(stderr, "Request_size if not aligned with SAMPLE_SIZE!\n");
-                exit(-1);
-        }
-        request_count = SAMPLE_SIZE / request_size;
-
-        buf = mmap(NULL, SAMPLE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-        if (buf == (void *)-1) {
-                perror("Cannot allocate enough memory");
-                exit(-1);
-        }
 
-        for (i = 0; i < SAMPLE_SIZE; i ++) {
-                buf[i] = rand() % 26 + 'a';
+#define MAX_REPLICAS 16
+static struct client_connection *replica_conns[MAX_REPLICAS];
+static int nr_replicas;
+
+// Applied to every client the server accepts
+static struct {
+        int pin;
+        cpu_set_t cpus;
+        char *exec_mode;
+        int workers;
+        uint64_t iops[NR_THROTTLE_CLASSES];
+        uint64_t bps[NR_THROTTLE_CLASSES];
+        struct volume_registry *volumes;
+        struct server_stats *stats;
+        struct shard_set *shards;
+        struct deadline_sched *deadline;
+} server_opts;
+
+// Writes the sample through the replica set, then reads it back from every
+// replica. The data is the pattern of seed on volume 0, like the benchmark
+// writes.
+int start_replica_test(struct replica_set *set, int request_size, uint64_t seed) {
+        struct timespec start, stop;
+        uint32_t delta_ms;
+        void *buf, *tmpbuf;
+        int i, j, rc = 0;
+
+        seed = pattern_volume_seed(seed, 0);
+        buf = client_alloc_buffer(set->replicas[0].conn, request_size);
+        tmpbuf = client_alloc_buffer(set->replicas[0].conn, request_size);
+        if (buf == NULL || tmpbuf == NULL) {
+                rc = -ENOMEM;
+                goto out;
         }
 
-        printf("Sample memory generated\n");
-
-        clock_gettime(CLOCK_MONOTONIC_RAW, &write_start);
-        // We're going to write the whole thing to server(which store it in
-        // memory), then read from it.
-        for (i = 0; i < request_count; i ++) {
-                int rc, offset = i * request_size;
+        clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+        for (i = 0; i < SAMPLE_SIZE / request_size; i ++) {
+                int offset = i * request_size;
 
-//                printf("Write %d at %d\n", request_size, offset);
-                rc = write_at(conn, buf + offset, request_size, offset);
+                pattern_fill(seed, offset, buf, request_size);
+                rc = replica_write_at(set, buf, request_size, offset);
                 if (rc < 0) {
                         fprintf(stderr, "Fail to complete write for %d\n", offset);
                         goto out;
                 }
         }
+        clock_gettime(CLOCK_MONOTONIC_RAW, &stop);
+        delta_ms = (stop.tv_sec - start.tv_sec) * 1E3 + (stop.tv_nsec - start.tv_nsec) / 1E6;
+        printf("Replicated write to %d of %d replicas done in %d ms\n",
+                        set->quorum, set->nr_replicas, delta_ms);
+        printf("Write bandwidth is %.2f M/s\n",
+                        (SAMPLE_SIZE / 1024 / 1024) / (delta_ms / 1E3));
+
+        clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+        for (i = 0; i < SAMPLE_SIZE / request_size; i ++) {
+                int offset = i * request_size;
+
+                rc = replica_read_at(set, tmpbuf, request_size, offset);
+                if (rc < 0 || pattern_verify(seed, offset, tmpbuf, request_size) >= 0) {
+                        fprintf(stderr, "Replicated read inconsistent at %d!\n",
+                                        offset);
+                        rc = -EIO;
+                        goto out;
+                }
+        }
+        clock_gettime(CLOCK_MONOTONIC_RAW, &stop);
+        delta_ms = (stop.tv_sec - start.tv_sec) * 1E3 + (stop.tv_nsec - start.tv_nsec) / 1E6;
+        printf("Replicated read done in %d ms, %lu of %lu reads hedged, %lu won by the hedge\n",
+                        delta_ms, set->hedged, set->reads, set->hedge_wins);
+        printf("Read bandwidth is %.2f M/s\n",
+                        (SAMPLE_SIZE / 1024 / 1024) / (delta_ms / 1E3));
+
+        for (j = 0; j < set->nr_replicas; j++) {
+                if (get_replica_state(set, j) == ReplicaFailed) {
+                        printf("Replica %d failed\n", j);
+                        continue;
+                }
+                for (i = 0; i < SAMPLE_SIZE / request_size; i ++) {
+                        int offset = i * request_size;
+
+                        rc = read_at(set->replicas[j].conn, tmpbuf, request_size, offset);
+                        if (rc < 0 || pattern_verify(seed, offset, tmpbuf,
+                                                request_size) >= 0) {
+                                fprintf(stderr, "Replica %d inconsistent at %d!\n",
+                                                j, offset);
+                                rc = -EIO;
+                                goto out;
+                        }
+                }
+                printf("Replica %d verified\n", j);
+        }
+out:
+        client_free_buffer(set->replicas[0].conn, buf, request_size);
+        client_free_buffer(set->replicas[0].conn, tmpbuf, request_size);
+        return rc;
+}
 
-        clock_gettime(CLOCK_MONOTONIC_RAW, &write_stop);
-        delta_write_ms = (write_stop.tv_sec - write_start.tv_sec) * 1E3 + (write_stop.tv_nsec - write_start.tv_nsec) / 1E6;
-        write_bw = (SAMPLE_SIZE / 1024 / 1024) / (delta_write_ms / 1E3);
-        printf("Write done in %d ms\n", delta_write_ms);
-        printf("Write bandwidth is %.2f M/s\n", write_bw);
+// Writes the sample to the erasure coded volume and reads it back, then
+// reads it again with the first m servers taken out. The data is the
+// pattern of seed.
+int start_ec_test(struct ec_volume *vol, int request_size, uint64_t seed) {
+        struct timespec start, stop;
+        uint32_t delta_ms;
+        char *buf, *tmpbuf;
+        int i, pass, rc = 0;
+
+        seed = pattern_volume_seed(seed, 0);
+        buf = malloc(request_size);
+        tmpbuf = malloc(request_size);
+        if (buf == NULL || tmpbuf == NULL) {
+                rc = -ENOMEM;
+                goto out;
+        }
 
-        clock_gettime(CLOCK_MONOTONIC_RAW, &read_start);
-        for (i = 0; i < request_count; i ++) {
-                int rc, offset = i * request_size;
+        clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+        for (i = 0; i < SAMPLE_SIZE / request_size; i ++) {
+                int offset = i * request_size;
 
-                rc = read_at(conn, tmpbuf, request_size, offset);
+                pattern_fill(seed, offset, buf, request_size);
+                rc = ec_write_at(vol, buf, request_size, offset);
                 if (rc < 0) {
-                        fprintf(stderr, "Fail to complete read for %d\n", offset);
+                        fprintf(stderr, "Fail to complete write for %d\n", offset);
                         goto out;
                 }
-
-                if (memcmp(tmpbuf, buf + offset, request_size) != 0) {
-                        fprintf(stderr, "Inconsistency found at %d!\n", offset);
-                        goto out;
+        }
+        clock_gettime(CLOCK_MONOTONIC_RAW, &stop);
+        delta_ms = (stop.tv_sec - start.tv_sec) * 1E3 + (stop.tv_nsec - start.tv_nsec) / 1E6;
+        printf("Erasure coded %d+%d write done in %d ms\n", vol->k, vol->m, delta_ms);
+        printf("Write bandwidth is %.2f M/s\n",
+                        (SAMPLE_SIZE / 1024 / 1024) / (delta_ms / 1E3));
+
+        for (pass = 0; pass < 2; pass++) {
+                if (pass == 1) {
+                        for (i = 0; i < vol->m; i++) {
+                                ec_fail_server(vol, i);
+                        }
                 }
+                clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+                for (i = 0; i < SAMPLE_SIZE / request_size; i ++) {
+                        int offset = i * request_size;
+
+                        rc = ec_read_at(vol, tmpbuf, request_size, offset);
+                        if (rc < 0 || pattern_verify(seed, offset, tmpbuf,
+                                                request_size) >= 0) {
+                                fprintf(stderr, "Inconsistency found at %d!\n", offset);
+                                rc = -EIO;
+                                goto out;
+                        }
+                }
+                clock_gettime(CLOCK_MONOTONIC_RAW, &stop);
+                delta_ms = (stop.tv_sec - start.tv_sec) * 1E3 + (stop.tv_nsec - start.tv_nsec) / 1E6;
+                printf("%s read done in %d ms\n", pass ? "Degraded" : "Healthy", delta_ms);
+                printf("Read bandwidth is %.2f M/s\n",
+                                (SAMPLE_SIZE / 1024 / 1024) / (delta_ms / 1E3));
         }
-        clock_gettime(CLOCK_MONOTONIC_RAW, &read_stop);
-        delta_read_ms = (read_stop.tv_sec - read_start.tv_sec) * 1E3 + (read_stop.tv_nsec - read_start.tv_nsec) / 1E6;
-        read_bw = (SAMPLE_SIZE / 1024 / 1024) / (delta_read_ms / 1E3);
-        printf("Read done in %d ms\n", delta_read_ms);
-        printf("Read bandwidth is %.2f M/s\n", read_bw);
 out:
+        free(buf);
         free(tmpbuf);
-        munmap(buf, SAMPLE_SIZE);
         return rc;
 }
 
-int server_read_at(void *buf, size_t count, off_t offset) {
-        if (offset + count > SAMPLE_SIZE) {
+// Encode and decode throughput of every kernel the cpu supports, on chunks
+// of chunk_size bytes
+void start_ec_benchmark(int k, int m, size_t chunk_size) {
+        uint8_t *chunks[EC_MAX_CHUNKS], *matrix;
+        int present[EC_MAX_CHUNKS];
+        struct timespec start, stop;
+        double secs;
+        int i, iter, iters;
+        enum gf_kernel kernel;
+
+        matrix = ec_parity_matrix(k, m);
+        for (i = 0; i < k + m; i++) {
+                chunks[i] = malloc(chunk_size);
+                if (matrix == NULL || chunks[i] == NULL) {
+                        fprintf(stderr, "Cannot allocate enough memory\n");
+                        exit(-1);
+                }
+                memset(chunks[i], rand(), chunk_size);
+        }
+        // About 1 GiB of data coded per run
+        iters = (1ULL << 30) / (k * chunk_size);
+        if (iters == 0) {
+                iters = 1;
+        }
+
+        printf("Erasure code %d+%d, chunks of %lu bytes\n", k, m, chunk_size);
+        for (kernel = 0; kernel < NR_GF_KERNELS; kernel++) {
+                if (gf_set_kernel(kernel) < 0) {
+                        continue;
+                }
+
+                clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+                for (iter = 0; iter < iters; iter++) {
+                        ec_encode(k, m, matrix, chunks, chunks + k, chunk_size);
+                }
+                clock_gettime(CLOCK_MONOTONIC_RAW, &stop);
+                secs = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1E9;
+                printf("%-7s encode %8.2f M/s", gf_kernel_name(kernel),
+                                (double)iters * k * chunk_size / 1024 / 1024 / secs);
+
+                // Worst case, as many data chunks lost as there is parity
+                for (i = 0; i < k + m; i++) {
+                        present[i] = i >= m || i >= k;
+                }
+                clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+                for (iter = 0; iter < iters; iter++) {
+                        ec_decode(k, m, matrix, chunks, present, chunk_size);
+                }
+                clock_gettime(CLOCK_MONOTONIC_RAW, &stop);
+                secs = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1E9;
+                printf("   decode %8.2f M/s\n",
+                                (double)iters * k * chunk_size / 1024 / 1024 / secs);
+        }
+
+        for (i = 0; i < k + m; i++) {
+                free(chunks[i]);
+        }
+        free(matrix);
+}
+
+// data is the volume's volume_size buffer
+int server_read_at(void *data, void *buf, size_t count, off_t offset) {
+        if (offset + count > volume_size) {
                 return -EINVAL;
         }
-        memcpy(buf, server_buf + offset, count);
+        memcpy(buf, data + offset, count);
         return 0;
 }
 
-int server_write_at(void *buf, size_t count, off_t offset) {
-        if (offset + count > SAMPLE_SIZE) {
+int server_write_at(void *data, void *buf, size_t count, off_t offset) {
+        if (offset + count > volume_size) {
                 return -EINVAL;
         }
-        memcpy(server_buf + offset, buf, count);
+        memcpy(data + offset, buf, count);
         return 0;
 }
 
@@ -117,6 +275,173 @@ static struct handler_callbacks cbs = {
         .write_at = server_write_at,
 };
 
+// Volumes 0 to n - 1, each with its own buffer
+struct volume_registry *create_volumes(int n) {
+        struct volume_registry *reg;
+        struct handler_callbacks *vol_cbs;
+        int i;
+
+        reg = new_volume_registry();
+        vol_cbs = calloc(n, sizeof(struct handler_callbacks));
+        if (reg == NULL || vol_cbs == NULL) {
+                exit(-1);
+        }
+        for (i = 0; i < n; i++) {
+                vol_cbs[i] = cbs;
+                vol_cbs[i].data = mmap(NULL, volume_size, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+                if (vol_cbs[i].data == (void *)-1) {
+                        perror("Cannot allocate enough memory");
+                        exit(-1);
+                }
+                register_volume(reg, i, &vol_cbs[i]);
+        }
+        return reg;
+}
+
+int parse_throttle(char *arg, enum throttle_class class) {
+        unsigned long long iops, bps;
+
+        if (sscanf(arg, "%llu:%llu", &iops, &bps) != 2) {
+                fprintf(stderr, "Invalid throttle %s, expect <iops>:<bps>\n", arg);
+                return -EINVAL;
+        }
+        server_opts.iops[class] = iops;
+        server_opts.bps[class] = bps;
+        return 0;
+}
+
+void print_server_stats(struct StatsReply *st) {
+        static const char *stages[4] = {
+                "receive", "queue", "handle", "respond",
+        };
+        uint64_t pool = st->PoolHits + st->PoolMisses;
+        int i;
+
+        printf("Connections      %lu\n", st->Connections);
+        printf("In flight        %lu requests, %lu bytes\n", st->Inflight,
+                        st->InflightBytes);
+        printf("Queued           %lu\n", st->Queued);
+        printf("Running          %lu\n", st->Running);
+        printf("Throttled        %lu queued, %lu delayed for %.1f ms in total\n",
+                        st->ThrottleQueued, st->Throttled, st->ThrottleDelay / 1E6);
+        printf("Reads            %lu, %lu bytes, %lu errors\n", st->Reads,
+                        st->ReadBytes, st->ReadErrors);
+        printf("Writes           %lu, %lu bytes, %lu errors\n", st->Writes,
+                        st->WriteBytes, st->WriteErrors);
+        printf("Rejected         %lu\n", st->Rejected);
+        printf("Buffer pool      %.1f%% hits of %lu allocations\n",
+                        pool ? 100.0 * st->PoolHits / pool : 0, pool);
+        for (i = 0; i < 4; i++) {
+                printf("Latency %-8s us p50 %.1f p99 %.1f p99.9 %.1f\n", stages[i],
+                                st->LatencyP50[i] / 1E3, st->LatencyP99[i] / 1E3,
+                                st->LatencyP999[i] / 1E3);
+        }
+}
+
+// Volumes, stats and workers shared by every client the server accepts
+void setup_server(int volumes) {
+        server_buf = mmap(NULL, volume_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (server_buf == (void *)-1) {
+                perror("Cannot allocate enough memory");
+                exit(-1);
+        }
+        cbs.data = server_buf;
+        // Shared by all clients, so any of them can ask for the whole
+        // server's stats
+        server_opts.stats = new_server_stats();
+        if (server_opts.stats == NULL) {
+                exit(-1);
+        }
+        if (volumes > 1) {
+                server_opts.volumes = create_volumes(volumes);
+        }
+        // One worker owns a stripe for every client, so overlapping
+        // requests of different clients never run at the same time
+        if (strcmp(server_opts.exec_mode, "shard") == 0) {
+                server_opts.shards = new_shard_set(server_opts.workers,
+                                DEFAULT_SHARD_STRIPE_SIZE,
+                                server_opts.pin ? &server_opts.cpus : NULL);
+                if (server_opts.shards == NULL) {
+                        exit(-1);
+                }
+        }
+        // Idle requests of one client wait for the foreground requests of
+        // every client
+        if (strcmp(server_opts.exec_mode, "deadline") == 0) {
+                server_opts.deadline = new_deadline_sched(server_opts.workers,
+                                server_opts.pin ? &server_opts.cpus : NULL);
+                if (server_opts.deadline == NULL) {
+                        exit(-1);
+                }
+        }
+}
+
+void *serve_client(void *arg) {
+        struct server_connection *conn = arg;
+        int i, rc = 0;
+
+        if (server_opts.pin) {
+                set_worker_affinity(conn, &server_opts.cpus);
+        }
+        if (server_opts.volumes != NULL) {
+                set_volume_registry(conn, server_opts.volumes);
+        }
+        set_server_stats(conn, server_opts.stats);
+        if (server_opts.shards != NULL) {
+                rc = set_shards(conn, server_opts.shards);
+        } else if (strcmp(server_opts.exec_mode, "steal") == 0) {
+                rc = start_workers(conn, server_opts.workers);
+        } else if (server_opts.deadline != NULL) {
+                rc = set_deadline_sched(conn, server_opts.deadline);
+        }
+        for (i = 0; i < NR_THROTTLE_CLASSES && rc == 0; i++) {
+                if (server_opts.iops[i] != 0 || server_opts.bps[i] != 0) {
+                        rc = set_throttle(conn, i, server_opts.iops[i],
+                                        server_opts.bps[i]);
+                }
+        }
+        if (rc == 0) {
+                start_server(conn);
+        }
+        shutdown_server_connection(conn);
+        return NULL;
+}
+
+// Dumps the trace ring to stderr on every SIGUSR1, which every other
+// thread blocks
+void *trace_dump_thread(void *arg) {
+        sigset_t *signals = arg;
+        int sig;
+
+        while (sigwait(signals, &sig) == 0) {
+                fprintf(stderr, "Trace ring:\n");
+                trace_dump(stderr);
+        }
+        return NULL;
+}
+
+int start_trace_ring(uint32_t entries) {
+        static sigset_t signals;
+        pthread_t thread;
+        int rc;
+
+        rc = trace_enable(entries);
+        if (rc < 0) {
+                return rc;
+        }
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGUSR1);
+        pthread_sigmask(SIG_BLOCK, &signals, NULL);
+        rc = pthread_create(&thread, NULL, trace_dump_thread, &signals);
+        if (rc != 0) {
+                return -rc;
+        }
+        pthread_detach(thread);
+        return 0;
+}
+
 void signal_handler(int signo) {
         if (signo == SIGINT) {
                 printf("SIGINT received, stop process\n");
@@ -124,32 +449,282 @@ void signal_handler(int signo) {
         if (client_conn != NULL) {
                 shutdown_client_connection(client_conn);
         }
-        if (server_conn != NULL) {
-                shutdown_server_connection(server_conn);
+        while (nr_replicas > 0) {
+                shutdown_client_connection(replica_conns[--nr_replicas]);
         }
         exit(0);
 }
 
+void *serve_loopback(void *arg) {
+        struct server_connection *conn;
+
+        conn = new_server_connection_fd((int)(long)arg, &cbs);
+        if (conn == NULL) {
+                exit(-1);
+        }
+        return serve_client(conn);
+}
+
+// Serves one end of a loopback pair from a thread of this process, the
+// other end is for the client
+int start_loopback_server(int volumes) {
+        pthread_t thread;
+        int fds[2], rc;
+
+        setup_server(volumes);
+        rc = loopback_pair(fds);
+        if (rc < 0) {
+                fprintf(stderr, "Cannot create loopback pair: %s\n", strerror(-rc));
+                exit(-1);
+        }
+        rc = pthread_create(&thread, NULL, serve_loopback, (void *)(long)fds[0]);
+        if (rc != 0) {
+                fprintf(stderr, "Fail to create server thread: %s\n", strerror(rc));
+                exit(-1);
+        }
+        pthread_detach(thread);
+        return fds[1];
+}
+
+// socket_path is NULL to connect to start_loopback_server()
+struct client_connection *connect_client(char *socket_path, int busy_poll_us,
+                int idle_priority, cpu_set_t *cpus, int volumes) {
+        struct client_connection *conn;
+
+        if (socket_path == NULL) {
+                conn = new_client_connection_fd(start_loopback_server(volumes));
+        } else {
+                conn = new_client_connection(socket_path);
+        }
+        if (conn == NULL) {
+                fprintf(stderr, "cannot estibalish connection");
+                exit(-1);
+        }
+
+        set_busy_poll(conn, busy_poll_us * 1000ULL);
+        if (idle_priority && set_io_priority(conn, PriorityIdle) < 0) {
+                fprintf(stderr, "Server doesn't support priorities\n");
+                exit(-1);
+        }
+        if (cpus != NULL) {
+                set_response_affinity(conn, cpus);
+        }
+        start_response_processing(conn);
+        return conn;
+}
+
 int main(int argc, char *argv[])
 {
         int request_size = 4096;
         char *socket_path = NULL;
-        int queue_depth = 128;
+        char *replica_list = NULL;
+        int quorum = 0;
+        enum replica_read_policy read_policy = ReadLeastInflight;
+        int hedge_percentile = 0;
+        int ec_k = 0, ec_m = 0;
+        int ec_benchmark = 0;
+        int volumes = 1;
+        int query_stats = 0;
+        int trace_entries = 0;
+        struct bench_config bench;
+        int busy_poll_us = 0;
+        int idle_priority = 0;
+        char *cpu_list = NULL;
+        cpu_set_t cpus;
         int client = 0;
+        int loopback = 0;
+        char *record_path = NULL;
+        char *nbd_path = NULL;
+        struct replay_config replay;
 	int c, rc = 0;
 
-        while ((c = getopt(argc, argv, "r:q:s:c")) != -1) {
+        server_opts.exec_mode = "thread";
+        server_opts.workers = 4;
+        init_bench_config(&bench, volume_size);
+        memset(&replay, 0, sizeof(replay));
+        replay.timing = ReplayOriginal;
+
+        while ((c = getopt(argc, argv, "r:q:s:p:a:x:n:t:f:T:R:Q:P:H:E:V:m:M:j:w:d:g:k:L:o:y:N:FJKSbilc")) != -1) {
                 switch (c) {
                 case 'r':
-                        request_size = atoi(optarg);
+                        // A list of sizes is swept by the benchmark, the
+                        // other tests use the first
+                        if (parse_bench_list(optarg, bench.sizes,
+                                                &bench.nr_sizes) < 0) {
+                                fprintf(stderr, "Invalid request sizes %s\n", optarg);
+                                return -EINVAL;
+                        }
+                        request_size = bench.sizes[0];
                         break;
                 case 'q':
-                        queue_depth = atoi(optarg);
+                        if (parse_bench_list(optarg, bench.depths,
+                                                &bench.nr_depths) < 0) {
+                                fprintf(stderr, "Invalid queue depths %s\n", optarg);
+                                return -EINVAL;
+                        }
+                        break;
+                case 'm':
+                        if (strcmp(optarg, "seq") == 0) {
+                                bench.pattern = BenchSequential;
+                        } else if (strcmp(optarg, "rand") == 0) {
+                                bench.pattern = BenchRandom;
+                        } else {
+                                fprintf(stderr, "Unknown access pattern %s\n", optarg);
+                                return -EINVAL;
+                        }
+                        break;
+                case 'M':
+                        // Read percentages, each one a run
+                        if (parse_bench_list(optarg, bench.read_percents,
+                                                &bench.nr_read_percents) < 0) {
+                                fprintf(stderr, "Invalid read mixes %s\n", optarg);
+                                return -EINVAL;
+                        }
+                        break;
+                case 'j':
+                        bench.threads = atoi(optarg);
+                        break;
+                case 'w':
+                        bench.warmup_secs = atoi(optarg);
+                        break;
+                case 'd':
+                        // 0 runs one pass over the sample
+                        bench.runtime_secs = atoi(optarg);
+                        break;
+                case 'J':
+                        bench.json = 1;
+                        break;
+                case 'k':
+                        // Seed of the benchmark's data
+                        bench.seed = strtoull(optarg, NULL, 0);
+                        break;
+                case 'K':
+                        // Volumes hold the seed's data from an earlier run
+                        bench.prefilled = 1;
+                        break;
+                case 'L':
+                        // MiB of every volume
+                        volume_size = strtoull(optarg, NULL, 0) << 20;
+                        if (volume_size == 0) {
+                                fprintf(stderr, "Invalid volume size %s\n", optarg);
+                                return -EINVAL;
+                        }
+                        bench.span = volume_size;
+                        break;
+                case 'g':
+                        // Entries of the trace ring, dumped on SIGUSR1
+                        trace_entries = atoi(optarg);
+                        break;
+                case 'S':
+                        // Print the server's stats and exit
+                        query_stats = 1;
+                        break;
+                case 'a':
+                        cpu_list = optarg;
+                        break;
+                case 'x':
+                        server_opts.exec_mode = optarg;
+                        break;
+                case 'n':
+                        server_opts.workers = atoi(optarg);
+                        break;
+                case 't':
+                        // <iops>:<bytes per second> for each client, 0 for
+                        // no limit
+                        if (parse_throttle(optarg, ThrottleConnection) < 0) {
+                                return -EINVAL;
+                        }
+                        break;
+                case 'f':
+                        // Same for the normal, foreground class of each
+                        // client
+                        if (parse_throttle(optarg, ThrottleNormal) < 0) {
+                                return -EINVAL;
+                        }
+                        break;
+                case 'T':
+                        // Same for the idle class of each client
+                        if (parse_throttle(optarg, ThrottleIdle) < 0) {
+                                return -EINVAL;
+                        }
+                        break;
+                case 'i':
+                        idle_priority = 1;
+                        break;
+                case 'R':
+                        // Comma separated sockets of the replicas
+                        replica_list = optarg;
+                        break;
+                case 'Q':
+                        quorum = atoi(optarg);
+                        break;
+                case 'P':
+                        // How replicated reads pick a replica
+                        if (strcmp(optarg, "latency") == 0) {
+                                read_policy = ReadLowestLatency;
+                        } else if (strcmp(optarg, "inflight") != 0) {
+                                fprintf(stderr, "Unknown read policy %s\n", optarg);
+                                return -EINVAL;
+                        }
+                        break;
+                case 'H':
+                        // Hedge reads slower than this latency percentile
+                        hedge_percentile = atoi(optarg);
+                        break;
+                case 'E':
+                        // <k>:<m>, erasure code the -R servers instead of
+                        // replicating to them
+                        if (sscanf(optarg, "%d:%d", &ec_k, &ec_m) != 2) {
+                                fprintf(stderr, "Invalid erasure code %s\n", optarg);
+                                return -EINVAL;
+                        }
+                        break;
+                case 'V':
+                        // Volumes a server exports, or a client spreads
+                        // its requests over
+                        volumes = atoi(optarg);
+                        if (volumes <= 0 || volumes > MAX_VOLUMES) {
+                                fprintf(stderr, "Invalid number of volumes %s\n",
+                                                optarg);
+                                return -EINVAL;
+                        }
+                        bench.volumes = volumes;
+                        break;
+                case 'b':
+                        // Benchmark the -E erasure code kernels and exit
+                        ec_benchmark = 1;
+                        break;
+                case 'p':
+                        busy_poll_us = atoi(optarg);
                         break;
                 case 's':
                         socket_path = malloc(strlen(optarg) + 1);
                         strcpy(socket_path, optarg);
 			break;
+                case 'o':
+                        // Record the requests of the run to a block trace
+                        record_path = optarg;
+                        break;
+                case 'y':
+                        // Replay a block trace instead of the benchmark,
+                        // at queue depth -q
+                        replay.path = optarg;
+                        break;
+                case 'F':
+                        replay.timing = ReplayFast;
+                        break;
+                case 'N':
+                        // Serve the volumes to NBD clients on this socket
+                        // instead of benchmarking them
+                        nbd_path = optarg;
+                        client = 1;
+                        break;
+                case 'l':
+                        // Client and server in this process, connected
+                        // through the loopback transport
+                        loopback = 1;
+                        client = 1;
+                        break;
                 case 'c':
                         client = 1;
 			break;
@@ -158,44 +733,183 @@ int main(int argc, char *argv[])
                         return -EINVAL;
                 }
         }
-        if (socket_path == NULL) {
+        if (loopback) {
+                socket_path = "loopback";
+        } else if (socket_path == NULL) {
 		socket_path = "/tmp/rpc.sock";
 	}
 
-	printf("Socket %s, request %d, queue depth %d\n", socket_path,
-			request_size, queue_depth);
+        // Keep JSON output parseable
+        if (!bench.json) {
+                printf("Socket %s, request %d, queue depth %d\n", socket_path,
+                                request_size, bench.depths[0]);
+        }
+
+        // Pins the response thread of a client, or the request threads of
+        // a server
+        if (cpu_list != NULL && parse_cpu_list(cpu_list, &cpus) < 0) {
+                fprintf(stderr, "Invalid cpu list %s\n", cpu_list);
+                return -EINVAL;
+        }
+
+        if (strcmp(server_opts.exec_mode, "thread") != 0 &&
+                        strcmp(server_opts.exec_mode, "shard") != 0 &&
+                        strcmp(server_opts.exec_mode, "steal") != 0 &&
+                        strcmp(server_opts.exec_mode, "deadline") != 0) {
+                fprintf(stderr, "Unknown execution mode %s\n",
+                                server_opts.exec_mode);
+                return -EINVAL;
+        }
 
         if (signal(SIGINT, signal_handler) == SIG_ERR) {
                 printf("Cannot catch signal, failed initialization\n");
                 exit(-1);
         }
-        if (client) {
-                client_conn = new_client_connection(socket_path);
-                if (client_conn == NULL) {
-                        fprintf(stderr, "cannot estibalish connection");
+        // A peer going away shows up as an error on its connection, it must
+        // not kill the process and every other connection with it
+        signal(SIGPIPE, SIG_IGN);
+        // Before any other thread starts, so all of them block SIGUSR1
+        if (trace_entries > 0 && start_trace_ring(trace_entries) < 0) {
+                fprintf(stderr, "Cannot start the trace ring\n");
+                exit(-1);
+        }
+        if (ec_benchmark) {
+                if (ec_k <= 0 || ec_m < 0 || ec_k + ec_m > EC_MAX_CHUNKS) {
+                        fprintf(stderr, "Benchmark needs a valid -E <k>:<m>\n");
+                        return -EINVAL;
                 }
-
-                start_response_processing(client_conn);
-
-                start_test(client_conn, request_size, queue_depth);
-
-                rc = pthread_join(client_conn->response_thread, NULL);
-                if (rc < 0) {
-                        perror("Fail to wait for response thread to exit");
+                start_ec_benchmark(ec_k, ec_m, request_size);
+                return 0;
+        }
+        if (client && replica_list != NULL) {
+                struct replica_set *set;
+                char *path;
+
+                for (path = strtok(replica_list, ","); path != NULL;
+                                path = strtok(NULL, ",")) {
+                        if (nr_replicas == MAX_REPLICAS) {
+                                fprintf(stderr, "Too many replicas\n");
+                                exit(-1);
+                        }
+                        replica_conns[nr_replicas] = connect_client(path,
+                                        busy_poll_us, idle_priority,
+                                        cpu_list != NULL ? &cpus : NULL, volumes);
+                        nr_replicas++;
+                }
+                if (ec_k != 0) {
+                        struct ec_volume *vol;
+
+                        if (nr_replicas != ec_k + ec_m) {
+                                fprintf(stderr, "Erasure code %d+%d needs %d servers\n",
+                                                ec_k, ec_m, ec_k + ec_m);
+                                exit(-1);
+                        }
+                        vol = new_ec_volume(replica_conns, ec_k, ec_m,
+                                        DEFAULT_EC_CHUNK_SIZE);
+                        if (vol == NULL) {
+                                exit(-1);
+                        }
+                        rc = start_ec_test(vol, request_size, bench.seed);
+                        exit(rc < 0 ? -1 : 0);
+                }
+                set = new_replica_set(replica_conns, nr_replicas, quorum);
+                if (set == NULL) {
+                        exit(-1);
+                }
+                if (set_read_policy(set, read_policy, hedge_percentile) < 0) {
+                        fprintf(stderr, "Invalid hedge percentile %d\n",
+                                        hedge_percentile);
+                        exit(-1);
+                }
+                rc = start_replica_test(set, request_size, bench.seed);
+                exit(rc < 0 ? -1 : 0);
+        } else if (client) {
+                client_conn = connect_client(loopback ? NULL : socket_path,
+                                busy_poll_us, idle_priority,
+                                cpu_list != NULL ? &cpus : NULL, volumes);
+
+                if (query_stats) {
+                        struct StatsReply stats;
+
+                        rc = get_server_stats(client_conn, &stats);
+                        if (rc < 0) {
+                                fprintf(stderr, "Fail to get server stats: %s\n",
+                                                strerror(-rc));
+                                exit(-1);
+                        }
+                        print_server_stats(&stats);
+                        exit(0);
                 }
-        } else {
-                unlink(socket_path);
 
-                server_buf = mmap(NULL, SAMPLE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-                if (server_buf == (void *)-1) {
-                        perror("Cannot allocate enough memory");
+                if (volumes > 1 && !(client_conn->features & FeatureVolumes)) {
+                        fprintf(stderr, "Server doesn't support volumes\n");
                         exit(-1);
                 }
-                bzero(server_buf, SAMPLE_SIZE);
+                if (record_path != NULL) {
+                        rc = client_start_recording(client_conn, record_path);
+                        if (rc < 0) {
+                                fprintf(stderr, "Cannot record to %s: %s\n",
+                                                record_path, strerror(-rc));
+                                exit(-1);
+                        }
+                }
+                if (nbd_path != NULL) {
+                        struct nbd_config nbd;
+
+                        nbd.path = nbd_path;
+                        nbd.volumes = volumes;
+                        nbd.size = volume_size;
+                        rc = run_nbd_gateway(client_conn, &nbd);
+                } else if (replay.path != NULL) {
+                        replay.depth = bench.depths[0];
+                        replay.seed = bench.seed;
+                        rc = run_replay(client_conn, &replay);
+                } else {
+                        rc = run_benchmark(client_conn, &bench);
+                        if (rc == -EINVAL) {
+                                fprintf(stderr, "Invalid benchmark configuration\n");
+                        }
+                }
+                if (record_path != NULL) {
+                        uint64_t records;
+
+                        if (client_stop_recording(client_conn, &records) < 0) {
+                                fprintf(stderr, "Trace %s is incomplete\n",
+                                                record_path);
+                                rc = -EIO;
+                        } else {
+                                fprintf(stderr, "Recorded %lu requests to %s\n",
+                                                records, record_path);
+                        }
+                }
+                exit(rc < 0 ? -1 : 0);
+        } else {
+                struct server_connection *conn;
+                pthread_t thread;
+                int listen_fd;
 
-                server_conn = new_server_connection(socket_path, &cbs);
+                unlink(socket_path);
 
-                start_server(server_conn);
+                if (cpu_list != NULL) {
+                        server_opts.pin = 1;
+                        server_opts.cpus = cpus;
+                }
+                setup_server(volumes);
+                listen_fd = server_listen(socket_path);
+                while (1) {
+                        conn = accept_server_connection(listen_fd, &cbs);
+                        if (conn == NULL) {
+                                continue;
+                        }
+                        rc = pthread_create(&thread, NULL, serve_client, conn);
+                        if (rc != 0) {
+                                fprintf(stderr, "Fail to create client thread: %s\n",
+                                                strerror(rc));
+                                shutdown_server_connection(conn);
+                                continue;
+                        }
+                        pthread_detach(thread);
+                }
         }
         return 0;
 }
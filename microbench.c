@@ -0,0 +1,392 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "longhorn-rpc-protocol.h"
+#include "longhorn-rpc-loopback.h"
+
+// Microbenchmark of the framing layer alone: send_msg() and receive_msg()
+// over a socketpair, a pair of pipes or a loopback pair, with no client or
+// server threads, queues or handlers around them. Built with --wrap on the
+// calls protocol.c makes, and on syscall() for the loopback futexes, so
+// every syscall it issues is counted.
+
+#define MAX_SIZES       16
+
+static uint64_t nr_syscalls;
+
+ssize_t __real_read(int fd, void *buf, size_t count);
+ssize_t __real_write(int fd, const void *buf, size_t count);
+ssize_t __real_writev(int fd, const struct iovec *iov, int iovcnt);
+
+ssize_t __wrap_read(int fd, void *buf, size_t count) {
+        __atomic_fetch_add(&nr_syscalls, 1, __ATOMIC_RELAXED);
+        return __real_read(fd, buf, count);
+}
+
+ssize_t __wrap_write(int fd, const void *buf, size_t count) {
+        __atomic_fetch_add(&nr_syscalls, 1, __ATOMIC_RELAXED);
+        return __real_write(fd, buf, count);
+}
+
+ssize_t __wrap_writev(int fd, const struct iovec *iov, int iovcnt) {
+        __atomic_fetch_add(&nr_syscalls, 1, __ATOMIC_RELAXED);
+        return __real_writev(fd, iov, iovcnt);
+}
+
+long __real_syscall(long number, ...);
+
+long __wrap_syscall(long number, ...) {
+        long a[6];
+        va_list ap;
+        int i;
+
+        va_start(ap, number);
+        for (i = 0; i < 6; i++) {
+                a[i] = va_arg(ap, long);
+        }
+        va_end(ap);
+        __atomic_fetch_add(&nr_syscalls, 1, __ATOMIC_RELAXED);
+        return __real_syscall(number, a[0], a[1], a[2], a[3], a[4], a[5]);
+}
+
+enum transport {
+        TransportSocketpair,
+        TransportPipe,
+        TransportLoopback,
+};
+
+static const char *transport_names[] = { "socketpair", "pipe", "loopback" };
+
+// One side of the pair, tx and rx are the same fd for a socketpair
+struct endpoint {
+        int tx;
+        int rx;
+};
+
+struct run {
+        struct endpoint peer;
+        int pipelined;
+        int size;
+        int count;
+        void *payload;
+        int rc;
+};
+
+struct result {
+        uint64_t ns;
+        uint64_t cycles;
+        uint64_t syscalls;
+};
+
+// TSC cycles, 0 where there is no cheap cycle counter
+static uint64_t now_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return 0;
+#endif
+}
+
+static int open_endpoints(enum transport t, struct endpoint *a,
+                struct endpoint *b) {
+        int sv[2], p1[2], p2[2], rc;
+
+        if (t == TransportLoopback) {
+                rc = loopback_pair(sv);
+                if (rc < 0) {
+                        return rc;
+                }
+                a->tx = a->rx = sv[0];
+                b->tx = b->rx = sv[1];
+                return 0;
+        }
+        if (t == TransportSocketpair) {
+                if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+                        perror("cannot create socketpair");
+                        return -errno;
+                }
+                a->tx = a->rx = sv[0];
+                b->tx = b->rx = sv[1];
+                return 0;
+        }
+        if (pipe(p1) < 0) {
+                perror("cannot create pipe");
+                return -errno;
+        }
+        if (pipe(p2) < 0) {
+                perror("cannot create pipe");
+                close(p1[0]);
+                close(p1[1]);
+                return -errno;
+        }
+        a->tx = p1[1];
+        b->rx = p1[0];
+        b->tx = p2[1];
+        a->rx = p2[0];
+        return 0;
+}
+
+static void close_endpoint(struct endpoint *e) {
+        close_fd(e->tx);
+        if (e->rx != e->tx) {
+                close_fd(e->rx);
+        }
+}
+
+static void init_request(struct Message *msg, struct run *r, int seq) {
+        memset(msg, 0, sizeof(struct Message));
+        msg->Seq = seq;
+        msg->Type = TypeWrite;
+        msg->Offset = (int64_t)seq * r->size;
+        msg->DataLength = r->size;
+        msg->Data = r->payload;
+        if (r->size != 0) {
+                msg->Flags = FlagData;
+        }
+}
+
+static int receive_one(int fd, struct Message *msg, int seq) {
+        int rc;
+
+        rc = receive_msg(fd, msg);
+        if (rc < 0) {
+                return rc;
+        }
+        free(msg->Data);
+        if (msg->Seq != seq) {
+                fprintf(stderr, "out of order message %lu, expected %d\n",
+                                msg->Seq, seq);
+                return -EPROTO;
+        }
+        return 0;
+}
+
+// Pipelined, the peer sends every request back to back while the
+// measuring side receives them. Otherwise it answers each request with a
+// header-only response before the next one is sent.
+static void *peer_thread(void *arg) {
+        struct run *r = arg;
+        struct Message msg;
+        int i;
+
+        for (i = 0; i < r->count; i++) {
+                if (r->pipelined) {
+                        init_request(&msg, r, i);
+                        r->rc = send_msg(r->peer.tx, &msg);
+                } else {
+                        r->rc = receive_one(r->peer.rx, &msg, i);
+                        if (r->rc < 0) {
+                                break;
+                        }
+                        msg.Type = TypeResponse;
+                        msg.Flags = 0;
+                        msg.DataLength = 0;
+                        r->rc = send_msg(r->peer.tx, &msg);
+                }
+                if (r->rc < 0) {
+                        break;
+                }
+        }
+        return NULL;
+}
+
+static int run_once(enum transport t, int pipelined, int size, int count,
+                void *payload, struct result *res) {
+        struct endpoint self;
+        struct run r;
+        struct Message msg;
+        pthread_t peer;
+        uint64_t start_ns, start_cycles, start_syscalls;
+        int i, rc = 0;
+
+        memset(&r, 0, sizeof(r));
+        r.pipelined = pipelined;
+        r.size = size;
+        r.count = count;
+        r.payload = payload;
+        rc = open_endpoints(t, &self, &r.peer);
+        if (rc < 0) {
+                return rc;
+        }
+
+        start_syscalls = __atomic_load_n(&nr_syscalls, __ATOMIC_RELAXED);
+        start_cycles = now_cycles();
+        start_ns = now_ns();
+        rc = pthread_create(&peer, NULL, &peer_thread, &r);
+        if (rc != 0) {
+                fprintf(stderr, "cannot create peer thread: %s\n", strerror(rc));
+                close_endpoint(&self);
+                close_endpoint(&r.peer);
+                return -rc;
+        }
+        for (i = 0; i < count; i++) {
+                if (pipelined) {
+                        rc = receive_one(self.rx, &msg, i);
+                } else {
+                        init_request(&msg, &r, i);
+                        rc = send_msg(self.tx, &msg);
+                        if (rc == 0) {
+                                rc = receive_one(self.rx, &msg, i);
+                        }
+                }
+                if (rc < 0) {
+                        break;
+                }
+        }
+        res->ns = now_ns() - start_ns;
+        res->cycles = now_cycles() - start_cycles;
+        res->syscalls = __atomic_load_n(&nr_syscalls, __ATOMIC_RELAXED) -
+                start_syscalls;
+
+        // Unblocks the peer if this side gave up early
+        close_endpoint(&self);
+        pthread_join(peer, NULL);
+        close_endpoint(&r.peer);
+        if (rc == 0) {
+                rc = r.rc;
+        }
+        return rc;
+}
+
+// Enough messages to move about 512 MiB, within limits that keep each
+// case to a few seconds
+static int default_count(int size) {
+        long count = (512L << 20) / (sizeof(struct MessageHeader) + size);
+
+        if (count < 1000) {
+                return 1000;
+        }
+        if (count > 200000) {
+                return 200000;
+        }
+        return count;
+}
+
+static int parse_sizes(char *arg, int *sizes, int *nr) {
+        char *s, *end;
+        long v;
+
+        *nr = 0;
+        for (s = arg; *s != '\0'; s = end + 1) {
+                v = strtol(s, &end, 0);
+                if (end == s || v < 0 || v > MAX_DATA_LENGTH || *nr == MAX_SIZES) {
+                        return -EINVAL;
+                }
+                sizes[(*nr)++] = v;
+                if (*end == '\0') {
+                        break;
+                }
+                if (*end != ',') {
+                        return -EINVAL;
+                }
+        }
+        return *nr == 0 ? -EINVAL : 0;
+}
+
+static void usage() {
+        fprintf(stderr, "Usage: rpc-microbench [-s size,...] [-n messages] "
+                        "[-t socketpair|pipe|loopback]\n");
+}
+
+int main(int argc, char *argv[])
+{
+        int sizes[MAX_SIZES] = { 0, 512, 4096, 65536, MAX_DATA_LENGTH };
+        int nr_sizes = 5;
+        int transports[3] = { TransportSocketpair, TransportPipe,
+                TransportLoopback };
+        int nr_transports = 3;
+        int count = 0;
+        void *payload;
+        struct result res;
+        int c, t, p, i, n, rc = 0;
+
+        while ((c = getopt(argc, argv, "s:n:t:")) != -1) {
+                switch (c) {
+                case 's':
+                        if (parse_sizes(optarg, sizes, &nr_sizes) < 0) {
+                                fprintf(stderr, "Invalid payload sizes %s\n", optarg);
+                                return -EINVAL;
+                        }
+                        break;
+                case 'n':
+                        count = atoi(optarg);
+                        break;
+                case 't':
+                        nr_transports = 1;
+                        if (strcmp(optarg, "socketpair") == 0) {
+                                transports[0] = TransportSocketpair;
+                        } else if (strcmp(optarg, "pipe") == 0) {
+                                transports[0] = TransportPipe;
+                        } else if (strcmp(optarg, "loopback") == 0) {
+                                transports[0] = TransportLoopback;
+                        } else {
+                                fprintf(stderr, "Unknown transport %s\n", optarg);
+                                return -EINVAL;
+                        }
+                        break;
+                default:
+                        usage();
+                        return -EINVAL;
+                }
+        }
+
+        payload = malloc(MAX_DATA_LENGTH);
+        if (payload == NULL) {
+                perror("cannot allocate memory for payload");
+                return -ENOMEM;
+        }
+        memset(payload, 0x5a, MAX_DATA_LENGTH);
+
+        // ns/msg is per request, the response included when not pipelined.
+        // bytes/cycle counts header and payload of the requests only.
+        printf("%-10s %-9s %8s %8s %10s %12s %11s\n", "transport", "mode",
+                        "size", "messages", "ns/msg", "syscalls/msg",
+                        "bytes/cycle");
+        for (t = 0; t < nr_transports; t++) {
+                for (p = 1; p >= 0; p--) {
+                        for (i = 0; i < nr_sizes; i++) {
+                                n = count > 0 ? count : default_count(sizes[i]);
+                                // Warm up caches, the allocator and the
+                                // kernel's socket buffers first
+                                rc = run_once(transports[t], p, sizes[i],
+                                                n / 10 + 1, payload, &res);
+                                if (rc == 0) {
+                                        rc = run_once(transports[t], p, sizes[i],
+                                                        n, payload, &res);
+                                }
+                                if (rc < 0) {
+                                        fprintf(stderr, "Run failed: %s\n",
+                                                        strerror(-rc));
+                                        goto out;
+                                }
+                                printf("%-10s %-9s %8d %8d %10.1f %12.2f ",
+                                                transport_names[transports[t]],
+                                                p ? "pipelined" : "pingpong",
+                                                sizes[i], n, (double)res.ns / n,
+                                                (double)res.syscalls / n);
+                                if (res.cycles != 0) {
+                                        printf("%11.3f\n", (double)n *
+                                                        (sizeof(struct MessageHeader) +
+                                                         sizes[i]) / res.cycles);
+                                } else {
+                                        printf("%11s\n", "-");
+                                }
+                                fflush(stdout);
+                        }
+                }
+        }
+out:
+        free(payload);
+        return rc;
+}